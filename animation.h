@@ -0,0 +1,379 @@
+#ifndef __ANIMATION_H__
+#define __ANIMATION_H__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "Eigen/Geometry"
+
+#include "globals.h"
+#include "hittable.h"
+#include "hittablelist.h"
+#include "bvh.h"
+#include "lightbvh.h"
+#include "camera.h"
+#include "envmap.h"
+#include "film.h"
+#include "render.h"
+
+/******************************************************************************
+ * animation sequences
+ *
+ *  A sequence renders frames of one loaded scene: materials, textures and
+ *  geometry are set up once, and per frame only the camera and the
+ *  transforms of animated instances change.
+ *
+ *    cameraPath      keyframed eye, look at and field of view, Catmull-Rom
+ *                    through eye and look at, linear field of view
+ *    transformPath   keyframed translation, rotation and uniform scale of an
+ *                    instance, linear, rotations slerped
+ *    instance        an object's own BVH under a transform. The BVH is built
+ *                    once in object space, moving the instance only
+ *                    transforms rays, so nothing below it is rebuilt
+ *
+ *  Each frame's top level is the static scene's BVH plus the frame's
+ *  instances under a small BVH of their own, which is rebuilt only when an
+ *  instance moved since the previous frame. Emitters are gathered from the
+ *  static scene once, so lights must not be animated.
+ *
+ *  renderSequence() pipelines frames: while frame N renders, frame N+1 is set
+ *  up on another thread and frame N-1's PNG is encoded on a third, and it
+ *  reports how long each stage took per frame.
+ ******************************************************************************/
+
+struct cameraKey {
+  float time;
+  vec3f eye;
+  vec3f lookAt;
+  float fov;
+};
+
+class cameraPath {
+  public:
+    void  add(const cameraKey& key) {
+      keys.insert(std::upper_bound(keys.begin(), keys.end(), key,
+                                    [](const cameraKey& a, const cameraKey& b) { return a.time < b.time; }),
+                  key);
+    }
+
+    bool  empty() const { return keys.empty(); }
+
+    // eye, look at and fov at time, held constant before the first and after the last key
+    cameraKey at(float time) const {
+      if (time <= keys.front().time || keys.size() == 1)
+        return keys.front();
+
+      if (time >= keys.back().time)
+        return keys.back();
+
+      size_t  i = std::upper_bound(keys.begin(), keys.end(), time,
+                                    [](float t, const cameraKey& key) { return t < key.time; }) - keys.begin() - 1;
+      const cameraKey&  k0 = keys[i > 0 ? i - 1 : i];
+      const cameraKey&  k1 = keys[i];
+      const cameraKey&  k2 = keys[i + 1];
+      const cameraKey&  k3 = keys[std::min(i + 2, keys.size() - 1)];
+      float             u = (time - k1.time) / (k2.time - k1.time);
+
+      return {time, catmullRom(k0.eye, k1.eye, k2.eye, k3.eye, u),
+              catmullRom(k0.lookAt, k1.lookAt, k2.lookAt, k3.lookAt, u), k1.fov + u * (k2.fov - k1.fov)};
+    }
+
+    // keys evenly spaced on a circle around center, for turntables
+    static cameraPath orbit(const vec3f& center, float radius, float height, float fov, float duration,
+                            int numKeys = 8) {
+      cameraPath  path;
+
+      for (int i = 0; i <= numKeys; i++) {
+        float angle = 2.0f * pi * i / numKeys;
+
+        path.add({duration * i / numKeys,
+                  center + vec3f(radius * std::sin(angle), height, radius * std::cos(angle)), center, fov});
+      }
+
+      return path;
+    }
+
+  private:
+    static vec3f  catmullRom(const vec3f& p0, const vec3f& p1, const vec3f& p2, const vec3f& p3, float u) {
+      float u2 = u * u, u3 = u2 * u;
+
+      return 0.5f * (2.0f * p1 + (p2 - p0) * u + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * u2 +
+                      (3.0f * p1 - p0 - 3.0f * p2 + p3) * u3);
+    }
+
+  private:
+    std::vector<cameraKey>  keys;
+};
+
+struct transformKey {
+  float time;
+  vec3f translation;
+  quatf rotation;
+  float scale;
+};
+
+// rigid motion and uniform scale, so normals only need rotating
+struct instanceTransform {
+  vec3f translation{0, 0, 0};
+  quatf rotation = quatf::Identity();
+  float scale = 1.0f;
+
+  bool  operator==(const instanceTransform& o) const {
+    return translation == o.translation && rotation.coeffs() == o.rotation.coeffs() && scale == o.scale;
+  }
+
+  vec3f toWorld(const vec3f& p) const { return translation + scale * (rotation * p); }
+  vec3f toObject(const vec3f& p) const { return rotation.conjugate() * (p - translation) / scale; }
+};
+
+class transformPath {
+  public:
+    void  add(const transformKey& key) {
+      keys.insert(std::upper_bound(keys.begin(), keys.end(), key,
+                                    [](const transformKey& a, const transformKey& b) { return a.time < b.time; }),
+                  key);
+    }
+
+    instanceTransform at(float time) const {
+      if (keys.empty())
+        return {};
+
+      if (time <= keys.front().time || keys.size() == 1)
+        return {keys.front().translation, keys.front().rotation, keys.front().scale};
+
+      if (time >= keys.back().time)
+        return {keys.back().translation, keys.back().rotation, keys.back().scale};
+
+      size_t  i = std::upper_bound(keys.begin(), keys.end(), time,
+                                    [](float t, const transformKey& key) { return t < key.time; }) - keys.begin();
+      const transformKey& k0 = keys[i - 1];
+      const transformKey& k1 = keys[i];
+      float               u = (time - k0.time) / (k1.time - k0.time);
+
+      return {lerp(k0.translation, k1.translation, u), k0.rotation.slerp(u, k1.rotation),
+              k0.scale + u * (k1.scale - k0.scale)};
+    }
+
+  private:
+    std::vector<transformKey> keys;
+};
+
+class instance : public hittable {
+  public:
+    instance(shared_ptr<hittable> objectBVH, const instanceTransform& xf) : object(objectBVH), transform(xf) {
+      aabb  objectBox;
+
+      object->boundingBox(0, 1.0f, objectBox);
+      box = transformBox(objectBox);
+    }
+
+    virtual bool  hit(const ray& r, float tMin, float tMax, hitRecord& record) const override {
+      if (!box.hit(r, tMin, tMax))
+        return false;
+
+      // t is the same in both spaces as long as dir isn't renormalized
+      ray objectRay(transform.toObject(r.o), transform.rotation.conjugate() * r.dir / transform.scale, r.time,
+                    r.coneWidth / transform.scale, r.coneSpread);
+
+      if (!object->hit(objectRay, tMin, tMax, record))
+        return false;
+
+      record.p = transform.toWorld(record.p);
+      record.normal = transform.rotation * record.normal;
+      record.tangent = transform.rotation * record.tangent;
+      record.bitangent = transform.rotation * record.bitangent;
+      record.coneWidth *= transform.scale;
+      record.uvScale /= transform.scale;
+
+      return true;
+    }
+
+    virtual bool  boundingBox(float time0, float time1, aabb& outputBox) const override {
+      outputBox = box;
+      return true;
+    }
+
+    virtual void  calcTangentBasis(const vec3f& normal, vec3f& tangent, vec3f& bitangent) const override {}
+
+    // not in the compute shader scene
+    virtual int   populateVector(class shared_ptr<class hittableVector> hittableVector) const override {
+      return -1;
+    }
+
+  private:
+    aabb  transformBox(const aabb& objectBox) const {
+      vec3f lo(infinity, infinity, infinity), hi(-infinity, -infinity, -infinity);
+
+      for (int corner = 0; corner < 8; corner++) {
+        vec3f p(objectBox.minimum(0), objectBox.minimum(1), objectBox.minimum(2));
+
+        for (int axis = 0; axis < 3; axis++) {
+          if (corner & (1 << axis))
+            p(axis) = objectBox.maximum(axis);
+        }
+
+        p = transform.toWorld(p);
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+      }
+
+      return aabb(lo, hi);
+    }
+
+  private:
+    shared_ptr<hittable>  object;
+    instanceTransform     transform;
+    aabb                  box;
+};
+
+// everything a frame renders from, immutable once set up so the next frame can be built alongside
+struct sequenceFrame {
+  int                         index;
+  float                       time;
+  camera                      cam;
+  shared_ptr<hittableList>    world;
+  double                      setupSeconds;
+  bool                        rebuilt;
+};
+
+class animatedScene {
+  public:
+    // world and lights as from buildLights(), both static
+    animatedScene(const hittableList& staticWorld, const hittableList& staticLights, cameraPath cameraKeys) :
+      world(staticWorld), lights(staticLights), path(std::move(cameraKeys)) {}
+
+    // objectBVH is built once in object space and may be shared by several instances
+    void  addInstance(shared_ptr<hittable> objectBVH, transformPath motion) {
+      animated.push_back({objectBVH, std::move(motion)});
+    }
+
+    // camera and instances at time, reusing the last frame's instance level if nothing moved.
+    // Frames must be set up in order, one at a time
+    sequenceFrame setup(int index, float time, int width, int height) {
+      auto                            start = std::chrono::steady_clock::now();
+      cameraKey                       key = path.at(time);
+      camera                          cam(key.eye, key.lookAt, vec3f(0, 1.0f, 0), key.fov,
+                                          static_cast<float>(width) / height, 0, 10.0f, 0, 1.0f);
+      std::vector<instanceTransform>  transforms;
+      bool                            rebuild = !frameWorld;
+
+      cam.setImageHeight(height);
+
+      for (const auto& a : animated)
+        transforms.push_back(a.motion.at(time));
+
+      rebuild = rebuild || transforms != lastTransforms;
+
+      if (rebuild) {
+        hittableList  instances;
+
+        for (size_t i = 0; i < animated.size(); i++)
+          instances.add(make_shared<instance>(animated[i].objectBVH, transforms[i]));
+
+        frameWorld = make_shared<hittableList>(world);
+
+        if (!instances.objects.empty())
+          frameWorld->add(make_shared<bvhNode>(instances, 0, 1));
+
+        lastTransforms = std::move(transforms);
+      }
+
+      return {index, time, cam, frameWorld,
+              std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), rebuild};
+    }
+
+    const hittableList& sceneLights() const { return lights; }
+
+  private:
+    struct animatedObject {
+      shared_ptr<hittable>  objectBVH;
+      transformPath         motion;
+    };
+
+  private:
+    hittableList                    world;
+    hittableList                    lights;
+    cameraPath                      path;
+    std::vector<animatedObject>     animated;
+    shared_ptr<hittableList>        frameWorld;
+    std::vector<instanceTransform>  lastTransforms;
+};
+
+struct sequenceTiming {
+  double  setup, render, encode;
+  bool    rebuilt;
+};
+
+/*
+ * renders numFrames frames at fps to filenamePattern, a printf pattern taking the frame index such as
+ * "frame%04d.png". With pipelined, frame N+1 is set up and frame N-1 encoded while frame N renders.
+ * Returns per frame timings, empty if an image couldn't be written
+ */
+std::vector<sequenceTiming> renderSequence(animatedScene& scene, const materialTable& materials,
+                                           const environmentLight& background, int width, int height,
+                                           int numFrames, float fps, int numSamples, int maxBounce,
+                                           const std::string& filenamePattern, bool pipelined = true) {
+  using clock = std::chrono::steady_clock;
+
+  std::vector<sequenceTiming> timings(numFrames);
+  std::future<sequenceFrame>  nextFrame;
+  std::future<bool>           encoding;
+  bool                        ok = true;
+  auto                        setupFrame = [&scene, fps, width, height](int index) {
+    return scene.setup(index, index / fps, width, height);
+  };
+
+  auto                        policy = pipelined ? std::launch::async : std::launch::deferred;
+
+  if (numFrames > 0)
+    nextFrame = std::async(policy, setupFrame, 0);
+
+  for (int f = 0; f < numFrames; f++) {
+    sequenceFrame frame = nextFrame.get();
+
+    if (f + 1 < numFrames)
+      nextFrame = std::async(policy, setupFrame, f + 1);
+
+    auto  start = clock::now();
+    film  image(width, height);
+
+    renderFilm(*frame.world, materials, scene.sceneLights(), frame.cam, background, image, numSamples, maxBounce);
+    timings[f].setup = frame.setupSeconds;
+    timings[f].render = std::chrono::duration<double>(clock::now() - start).count();
+    timings[f].rebuilt = frame.rebuilt;
+
+    if (encoding.valid())
+      ok = encoding.get() && ok;
+
+    std::vector<uint8_t>  target(4 * width * height);
+    char                  filename[1024];
+
+    image.toTarget(target.data(), 4);
+    snprintf(filename, sizeof(filename), filenamePattern.c_str(), f);
+    encoding = std::async(policy,
+                          [&timings, f, width, height, name = std::string(filename), target = std::move(target)] {
+                            auto  start = clock::now();
+                            bool  written = writePNG(name, width, height, target.data());
+
+                            timings[f].encode = std::chrono::duration<double>(clock::now() - start).count();
+                            return written;
+                          });
+
+    if (!pipelined)
+      ok = encoding.get() && ok;
+  }
+
+  if (encoding.valid())
+    ok = encoding.get() && ok;
+
+  if (!ok)
+    timings.clear();
+
+  return timings;
+}
+
+#endif
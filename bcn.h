@@ -0,0 +1,454 @@
+#ifndef __BCN_H__
+#define __BCN_H__
+
+#include <atomic>
+#include <cstring>
+
+#include "globals.h"
+#include "texture.h"
+
+// keep image textures block compressed in memory, decoded on lookup
+#define USE_BLOCK_COMPRESSION 0
+
+/******************************************************************************
+ * Block compressed textures
+ *
+ *  Textures are compressed at load time into the GPU block formats and
+ *  decoded on the CPU per lookup:
+ *
+ *    BC1   color, 4x4 texels in 8 bytes: two 565 endpoints + 2 bit indices
+ *    BC4   one channel, 4x4 texels in 8 bytes: two 8 bit endpoints + 3 bit indices
+ *    BC5   two channels (normal x, y), two BC4 blocks, z rebuilt on lookup
+ *
+ *  BC7 is not supported, its encoder search is too slow for load time.
+ *
+ *  Decoded blocks can be kept in a small per-thread direct-mapped cache, since
+ *  bilinear lookups and coherent rays touch the same block repeatedly.
+ ******************************************************************************/
+
+enum class bcFormat { bc1, bc4, bc5 };
+
+inline void unpack565(uint16_t c, int rgb[3]) {
+  int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+inline uint16_t pack565(const vec3f& c) {
+  int r = static_cast<int>(clamp(c(0), 0, 255.0f) * 31.0f / 255.0f + 0.5f);
+  int g = static_cast<int>(clamp(c(1), 0, 255.0f) * 63.0f / 255.0f + 0.5f);
+  int b = static_cast<int>(clamp(c(2), 0, 255.0f) * 31.0f / 255.0f + 0.5f);
+
+  return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+}
+
+inline void bc1Palette(const uint8_t* block, int palette[4][3]) {
+  uint16_t  c0 = block[0] | (block[1] << 8);
+  uint16_t  c1 = block[2] | (block[3] << 8);
+
+  unpack565(c0, palette[0]);
+  unpack565(c1, palette[1]);
+
+  for (int c = 0; c < 3; c++) {
+    if (c0 > c1) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+    else {
+      palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+      palette[3][c] = 0;
+    }
+  }
+}
+
+inline void bc4Palette(const uint8_t* block, int palette[8]) {
+  int e0 = block[0], e1 = block[1];
+
+  palette[0] = e0;
+  palette[1] = e1;
+
+  if (e0 > e1) {
+    for (int k = 1; k < 7; k++)
+      palette[k + 1] = ((7 - k) * e0 + k * e1) / 7;
+  }
+  else {
+    for (int k = 1; k < 5; k++)
+      palette[k + 1] = ((5 - k) * e0 + k * e1) / 5;
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+}
+
+inline int bc4Index(const uint8_t* block, int texel) {
+  uint64_t  bits = 0;
+
+  for (int b = 0; b < 6; b++)
+    bits |= static_cast<uint64_t>(block[2 + b]) << (8 * b);
+
+  return (bits >> (3 * texel)) & 7;
+}
+
+inline void decodeBC4Block(const uint8_t* block, uint8_t values[16]) {
+  int       palette[8];
+  uint64_t  bits = 0;
+
+  bc4Palette(block, palette);
+
+  for (int b = 0; b < 6; b++)
+    bits |= static_cast<uint64_t>(block[2 + b]) << (8 * b);
+
+  for (int t = 0; t < 16; t++)
+    values[t] = palette[(bits >> (3 * t)) & 7];
+}
+
+// texels: 16 rgb values in 0 to 255
+void encodeBC1(const vec3f texels[16], uint8_t* block) {
+  vec3f mean(0, 0, 0);
+
+  for (int t = 0; t < 16; t++)
+    mean += texels[t];
+  mean /= 16.0f;
+
+  // principal axis of the block's colors by power iteration
+  Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+
+  for (int t = 0; t < 16; t++) {
+    vec3f d = texels[t] - mean;
+    covariance += d * d.transpose();
+  }
+
+  vec3f axis(1.0f, 1.0f, 1.0f);
+
+  for (int iter = 0; iter < 8; iter++) {
+    axis = covariance * axis;
+
+    float len = axis.norm();
+    if (len < epsilon) {
+      axis = vec3f(1.0f, 1.0f, 1.0f);
+      break;
+    }
+    axis /= len;
+  }
+
+  float minProj = infinity, maxProj = -infinity;
+
+  for (int t = 0; t < 16; t++) {
+    float proj = (texels[t] - mean).dot(axis);
+    minProj = fminf(minProj, proj);
+    maxProj = fmaxf(maxProj, proj);
+  }
+
+  uint16_t  c0 = pack565(mean + maxProj * axis);
+  uint16_t  c1 = pack565(mean + minProj * axis);
+
+  // c0 > c1 selects the 4 color mode
+  if (c0 < c1)
+    std::swap(c0, c1);
+
+  block[0] = c0 & 255;  block[1] = c0 >> 8;
+  block[2] = c1 & 255;  block[3] = c1 >> 8;
+
+  int       palette[4][3];
+  uint32_t  indices = 0;
+
+  bc1Palette(block, palette);
+
+  for (int t = 0; t < 16; t++) {
+    int   best = 0;
+    float bestDist = infinity;
+    int   numColors = c0 > c1 ? 4 : 3;
+
+    for (int k = 0; k < numColors; k++) {
+      float dist = (texels[t] - vec3f(palette[k][0], palette[k][1], palette[k][2])).squaredNorm();
+      if (dist < bestDist) {
+        bestDist = dist;
+        best = k;
+      }
+    }
+
+    indices |= best << (2 * t);
+  }
+
+  memcpy(block + 4, &indices, 4);
+}
+
+// values: 16 values in 0 to 255
+void encodeBC4(const float values[16], uint8_t* block) {
+  float minValue = 255.0f, maxValue = 0;
+
+  for (int t = 0; t < 16; t++) {
+    minValue = fminf(minValue, values[t]);
+    maxValue = fmaxf(maxValue, values[t]);
+  }
+
+  block[0] = static_cast<uint8_t>(clamp(maxValue + 0.5f, 0, 255.0f));
+  block[1] = static_cast<uint8_t>(clamp(minValue + 0.5f, 0, 255.0f));
+
+  int       palette[8];
+  uint64_t  bits = 0;
+
+  bc4Palette(block, palette);
+
+  for (int t = 0; t < 16; t++) {
+    int   best = 0;
+    float bestDist = infinity;
+
+    for (int k = 0; k < 8; k++) {
+      float dist = fabsf(values[t] - palette[k]);
+      if (dist < bestDist) {
+        bestDist = dist;
+        best = k;
+      }
+    }
+
+    bits |= static_cast<uint64_t>(best) << (3 * t);
+  }
+
+  for (int b = 0; b < 6; b++)
+    block[2 + b] = (bits >> (8 * b)) & 255;
+}
+
+struct bcLevel {
+  int                   width, height;
+  int                   blocksX, blocksY;
+  std::vector<uint8_t>  blocks;
+};
+
+class bcImage : public texture {
+  public:
+    bcImage(const char* filename, bcFormat fmt, bool useBlockCache = true) :
+            format(fmt), width(0), height(0), blockCache(useBlockCache), id(nextId()) {
+      imagePNG  source(filename, fmt == bcFormat::bc1 || fmt == bcFormat::bc5 ? 3 : 1,
+                        textureLayout::linear);
+
+      compress(source);
+    }
+    bcImage(const imagePNG& source, bcFormat fmt, bool useBlockCache = true) :
+            format(fmt), width(0), height(0), blockCache(useBlockCache), id(nextId()) {
+      compress(source);
+    }
+
+    virtual color3f value(float u, float v, const vec3f& p) const override {
+      if (levels.empty())
+        return color3f(1.0f, 0, 1.0f);
+
+      u = clamp(u, 0, 1.0f);
+      v = 1.0f - clamp(v, 0, 1.0f);
+
+      auto  i = std::min(static_cast<int>(u * width), width - 1);
+      auto  j = std::min(static_cast<int>(v * height), height - 1);
+
+      return texel(0, i, j);
+    }
+
+    virtual color3f value(float u, float v, const vec3f& p, float footprint) const override {
+      if (levels.empty())
+        return color3f(1.0f, 0, 1.0f);
+
+      u = clamp(u, 0, 1.0f);
+      v = 1.0f - clamp(v, 0, 1.0f);
+
+      return trilinearSample<color3f>(u, v, footprint, width, height, levels.size(),
+                                      [this](int l, int i, int j) { return texel(l, i, j); });
+    }
+
+    virtual bool resolution(int& w, int& h) const override {
+      w = width;
+      h = height;
+      return !levels.empty();
+    }
+
+    size_t memoryBytes() const {
+      size_t  bytes = 0;
+
+      for (const auto& level : levels)
+        bytes += level.blocks.size();
+
+      return bytes;
+    }
+
+  private:
+    static const int  cacheSize = 64;
+
+    struct decodedBlock {
+      uint64_t  imageId = 0;
+      uint64_t  key = ~0ull;
+      uint8_t   texels[16][3];
+    };
+
+    static uint64_t nextId() {
+      static std::atomic<uint64_t> counter{1};
+      return counter++;
+    }
+
+    int blockBytes() const { return format == bcFormat::bc5 ? 16 : 8; }
+
+    // rebuild z in the same 0 to 255 encoding as the source normal map
+    static uint8_t normalZ(uint8_t nx, uint8_t ny) {
+      float x = (nx - 128.0f) / 128.0f;
+      float y = (ny - 128.0f) / 128.0f;
+
+      return static_cast<uint8_t>(clamp(128.0f + 128.0f * sqrtf(fmaxf(1.0f - x * x - y * y, 0)), 0, 255.0f));
+    }
+
+    void compress(const imagePNG& source);
+    void decodeTexel(const uint8_t* block, int t, uint8_t rgb[3]) const;
+    void decodeBlock(const uint8_t* block, uint8_t texels[16][3]) const;
+
+    inline color3f texel(int level, int i, int j) const {
+      const bcLevel&  bc = levels[level];
+      int             bx = i >> 2, by = j >> 2;
+      int             t = ((j & 3) << 2) | (i & 3);
+      const uint8_t*  block = &bc.blocks[(static_cast<size_t>(by) * bc.blocksX + bx) * blockBytes()];
+
+      if (!blockCache) {
+        uint8_t rgb[3];
+
+        decodeTexel(block, t, rgb);
+        return color3f(rgb[0], rgb[1], rgb[2]);
+      }
+
+      static thread_local decodedBlock  cache[cacheSize];
+      uint64_t                          key = (static_cast<uint64_t>(level) << 48) |
+                                              (static_cast<uint64_t>(by) << 24) | bx;
+      decodedBlock&                     entry = cache[(bx + by * 7 + level * 13 + id * 31) & (cacheSize - 1)];
+
+      if (entry.imageId != id || entry.key != key) {
+        decodeBlock(block, entry.texels);
+
+        entry.imageId = id;
+        entry.key = key;
+      }
+
+      return color3f(entry.texels[t][0], entry.texels[t][1], entry.texels[t][2]);
+    }
+
+  private:
+    bcFormat              format;
+    int                   width, height;
+    bool                  blockCache;
+    uint64_t              id;
+    std::vector<bcLevel>  levels;
+};
+
+void bcImage::compress(const imagePNG& source) {
+  const auto& mips = source.levels();
+  int         bpp = source.bytesPerPixel();
+
+  if (mips.empty())
+    return;
+
+  width = mips[0].width;
+  height = mips[0].height;
+
+  for (const auto& mip : mips) {
+    bcLevel level;
+
+    level.width = mip.width;
+    level.height = mip.height;
+    level.blocksX = (mip.width + 3) >> 2;
+    level.blocksY = (mip.height + 3) >> 2;
+    level.blocks.resize(static_cast<size_t>(level.blocksX) * level.blocksY * blockBytes());
+
+    for (int by = 0; by < level.blocksY; by++) {
+      for (int bx = 0; bx < level.blocksX; bx++) {
+        vec3f     texels[16];
+        float     channel0[16], channel1[16];
+        uint8_t*  block = &level.blocks[(static_cast<size_t>(by) * level.blocksX + bx) * blockBytes()];
+
+        // edge blocks repeat the last row/column
+        for (int t = 0; t < 16; t++) {
+          int             i = std::min(bx * 4 + (t & 3), mip.width - 1);
+          int             j = std::min(by * 4 + (t >> 2), mip.height - 1);
+          const uint8_t*  pixel = &mip.texels[mip.texelIndex(i, j) * bpp];
+
+          texels[t] = bpp >= 3 ? vec3f(pixel[0], pixel[1], pixel[2]) : vec3f(pixel[0], pixel[0], pixel[0]);
+          channel0[t] = texels[t](0);
+          channel1[t] = texels[t](1);
+        }
+
+        if (format == bcFormat::bc1)
+          encodeBC1(texels, block);
+        else if (format == bcFormat::bc4)
+          encodeBC4(channel0, block);
+        else {
+          encodeBC4(channel0, block);
+          encodeBC4(channel1, block + 8);
+        }
+      }
+    }
+
+    levels.push_back(std::move(level));
+  }
+}
+
+void bcImage::decodeBlock(const uint8_t* block, uint8_t texels[16][3]) const {
+  if (format == bcFormat::bc1) {
+    int       palette[4][3];
+    uint32_t  indices;
+
+    bc1Palette(block, palette);
+    memcpy(&indices, block + 4, 4);
+
+    for (int t = 0; t < 16; t++) {
+      int index = (indices >> (2 * t)) & 3;
+      texels[t][0] = palette[index][0];
+      texels[t][1] = palette[index][1];
+      texels[t][2] = palette[index][2];
+    }
+  }
+  else if (format == bcFormat::bc4) {
+    uint8_t values[16];
+
+    decodeBC4Block(block, values);
+    for (int t = 0; t < 16; t++)
+      texels[t][0] = texels[t][1] = texels[t][2] = values[t];
+  }
+  else {
+    uint8_t x[16], y[16];
+
+    decodeBC4Block(block, x);
+    decodeBC4Block(block + 8, y);
+
+    for (int t = 0; t < 16; t++) {
+      texels[t][0] = x[t];
+      texels[t][1] = y[t];
+      texels[t][2] = normalZ(x[t], y[t]);
+    }
+  }
+}
+
+void bcImage::decodeTexel(const uint8_t* block, int t, uint8_t rgb[3]) const {
+  if (format == bcFormat::bc1) {
+    int       palette[4][3];
+    uint32_t  indices;
+
+    bc1Palette(block, palette);
+    memcpy(&indices, block + 4, 4);
+
+    int index = (indices >> (2 * t)) & 3;
+    rgb[0] = palette[index][0];
+    rgb[1] = palette[index][1];
+    rgb[2] = palette[index][2];
+  }
+  else if (format == bcFormat::bc4) {
+    int palette[8];
+
+    bc4Palette(block, palette);
+    rgb[0] = rgb[1] = rgb[2] = palette[bc4Index(block, t)];
+  }
+  else {
+    int palette[8];
+
+    bc4Palette(block, palette);
+    rgb[0] = palette[bc4Index(block, t)];
+    bc4Palette(block + 8, palette);
+    rgb[1] = palette[bc4Index(block + 8, t)];
+
+    rgb[2] = normalZ(rgb[0], rgb[1]);
+  }
+}
+
+#endif
@@ -0,0 +1,2546 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "texture.h"
+#include "texturecache.h"
+#include "bcn.h"
+#include "settings.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "lightbvh.h"
+#include "camera.h"
+#include "render.h"
+#include "envmap.h"
+#include "simd.h"
+#include "pbrbatch.h"
+#include "guiding.h"
+#include "checkpoint.h"
+#include "daemon.h"
+#include "animation.h"
+
+#include "stb_image_write.h"
+
+using benchClock = std::chrono::steady_clock;
+
+inline double secondsSince(benchClock::time_point start) {
+  return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+/******************************************************************************
+ * texture lookups: row-major vs tiled storage
+ *
+ *  coherent: uv walks 16x16 texel patches, like a primary ray tile on a surface
+ *  column:   uv walks straight down the texture, worst case for row-major
+ *  random:   uniform uv, like incoherent secondary rays
+ ******************************************************************************/
+
+void benchTextureLookup() {
+  const int             size = 4096;
+  const int             bpp = 3;
+  const int             numLookups = 1 << 24;
+  std::vector<uint8_t>  pixels(static_cast<size_t>(size) * size * bpp);
+  std::mt19937          generator(1234);
+
+  for (auto& p : pixels)
+    p = static_cast<uint8_t>(generator());
+
+  std::vector<vec2f>  coherent, column, random;
+  std::uniform_real_distribution<float> distribution(0, 1.0f);
+
+  coherent.reserve(numLookups);
+  column.reserve(numLookups);
+  random.reserve(numLookups);
+
+  while (coherent.size() < numLookups) {
+    float u0 = distribution(generator), v0 = distribution(generator);
+
+    for (int j = 0; j < 16; j++)
+      for (int i = 0; i < 16; i++)
+        coherent.push_back(vec2f(u0 + static_cast<float>(i) / size, v0 + static_cast<float>(j) / size));
+  }
+
+  for (int n = 0; n < numLookups; n++) {
+    column.push_back(vec2f(static_cast<float>((n / size) % size) / size, static_cast<float>(n % size) / size));
+    random.push_back(vec2f(distribution(generator), distribution(generator)));
+  }
+
+  imagePNG  linearImg(pixels.data(), size, size, bpp, textureLayout::linear);
+  imagePNG  tiledImg(pixels.data(), size, size, bpp, textureLayout::tiled);
+  vec3f     p(0, 0, 0);
+
+  auto run = [&](const char* name, const imagePNG& img, const std::vector<vec2f>& uvs, float footprint) {
+    color3f sum(0, 0, 0);
+    auto    start = benchClock::now();
+
+    for (const auto& uv : uvs)
+      sum += img.value(uv(0), uv(1), p, footprint);
+
+    double  seconds = secondsSince(start);
+
+    std::cout << "  " << name << ": " << uvs.size() / seconds * 1e-6 << " Mlookups/s"
+              << " (checksum " << sum.sum() << ")\n";
+  };
+
+  std::cout << "texture lookup " << size << "x" << size << ", " << numLookups << " lookups\n";
+
+  for (float footprint : {0.0f, 4.0f / size}) {
+    std::cout << (footprint == 0 ? "bilinear, level 0\n" : "trilinear, levels 2-3\n");
+    run("coherent linear", linearImg, coherent, footprint);
+    run("coherent tiled ", tiledImg, coherent, footprint);
+    run("column linear  ", linearImg, column, footprint);
+    run("column tiled   ", tiledImg, column, footprint);
+    run("random linear  ", linearImg, random, footprint);
+    run("random tiled   ", tiledImg, random, footprint);
+  }
+}
+
+/******************************************************************************
+ * texture cache: fully decoded vs tiles faulted in on demand
+ *
+ *  Lookups are confined to a region of the texture, as when only part of a
+ *  large texture is visible, and split across all hardware threads.
+ ******************************************************************************/
+
+void benchTextureCache() {
+  const int             size = 4096;
+  const int             bpp = 3;
+  const int             lookupsPerThread = 1 << 22;
+  const int             numThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<uint8_t>  pixels(static_cast<size_t>(size) * size * bpp);
+  std::mt19937          generator(1234);
+
+  for (auto& p : pixels)
+    p = static_cast<uint8_t>(generator());
+
+  std::string tiledFilename = "bench-texcache.srtx";
+  size_t      decodedBytes = 0;
+
+  {
+    imagePNG  source(pixels.data(), size, size, bpp, textureLayout::tiled);
+
+    for (const auto& mip : source.levels())
+      decodedBytes += mip.texels.size();
+
+    if (!writeTiledTexture(source, tiledFilename))
+      return;
+  }
+
+  for (size_t budgetMB : {4, 64}) {
+    textureCache  cache(budgetMB * 1024 * 1024);
+    cachedImage   img(tiledFilename, cache);
+
+    auto          worker = [&](int thread, float footprint) {
+      std::mt19937                          rng(thread);
+      std::uniform_real_distribution<float> distribution(0.25f, 0.5f);
+      color3f                               sum(0, 0, 0);
+
+      for (int n = 0; n < lookupsPerThread; n++)
+        sum += img.value(distribution(rng), distribution(rng), vec3f(0, 0, 0), footprint);
+
+      return sum.sum();
+    };
+
+    std::cout << "texture cache, " << budgetMB << " MB budget, " << numThreads << " threads\n";
+
+    for (float footprint : {0.0f, 4.0f / size}) {
+      auto    start = benchClock::now();
+
+      parallelThreads(numThreads, [&](int t) { worker(t, footprint); });
+
+      double  seconds = secondsSince(start);
+
+      std::cout << "  " << (footprint == 0 ? "bilinear " : "trilinear") << ": "
+                << numThreads * static_cast<double>(lookupsPerThread) / seconds * 1e-6 << " Mlookups/s\n";
+    }
+
+    std::cout << "  ";
+    cache.printStats(std::cout);
+  }
+
+  std::cout << "fully decoded texture: " << decodedBytes / 1024 << " KB\n";
+
+  // 3 and 1 channel tiles sharing one cache, so evictions free tiles of the other size
+  std::string maskFilename = "bench-texcache-mask.srtx";
+  const int   maskBpp = 1;
+
+  {
+    std::vector<uint8_t>  mask(static_cast<size_t>(size) * size * maskBpp);
+
+    for (auto& p : mask)
+      p = static_cast<uint8_t>(generator());
+
+    imagePNG  source(mask.data(), size, size, maskBpp, textureLayout::tiled);
+
+    if (!writeTiledTexture(source, maskFilename)) {
+      remove(tiledFilename.c_str());
+      return;
+    }
+  }
+
+  {
+    const size_t  budgetMB = 4;
+    textureCache  cache(budgetMB * 1024 * 1024);
+    cachedImage   color(tiledFilename, cache), mask(maskFilename, cache);
+    size_t        maxResident = 0;
+
+    auto          worker = [&](int thread) {
+      std::mt19937                          rng(thread);
+      std::uniform_real_distribution<float> distribution(0, 1);
+      color3f                               sum(0, 0, 0);
+
+      for (int n = 0; n < lookupsPerThread; n++) {
+        const texture&  img = n & 1 ? static_cast<const texture&>(mask) : color;
+
+        sum += img.value(distribution(rng), distribution(rng), vec3f(0, 0, 0));
+
+        if (thread == 0 && (n & 0xfff) == 0)
+          maxResident = std::max(maxResident, cache.residentBytes());
+      }
+
+      return sum.sum();
+    };
+
+    auto    start = benchClock::now();
+
+    parallelThreads(numThreads, worker);
+
+    double  seconds = secondsSince(start);
+
+    std::cout << "texture cache, " << budgetMB << " MB budget, " << bpp << " and " << maskBpp
+              << " channel textures, " << numThreads << " threads\n";
+    std::cout << "  bilinear : " << numThreads * static_cast<double>(lookupsPerThread) / seconds * 1e-6
+              << " Mlookups/s, at most " << maxResident / 1024 << " KB resident"
+              << (cache.peakBytes() > cache.capacityBytes() ? " (over budget)" : "") << "\n  ";
+    cache.printStats(std::cout);
+  }
+
+  remove(tiledFilename.c_str());
+  remove(maskFilename.c_str());
+}
+
+/******************************************************************************
+ * block compression: memory, PSNR vs the source and lookup throughput
+ ******************************************************************************/
+
+double psnr(const texture& reference, const texture& compressed, int w, int h, int channels) {
+  double  squaredError = 0;
+  vec3f   p(0, 0, 0);
+
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++) {
+      float   u = (i + 0.5f) / w;
+      float   v = 1.0f - (j + 0.5f) / h;
+      color3f d = reference.value(u, v, p) - compressed.value(u, v, p);
+
+      for (int c = 0; c < channels; c++)
+        squaredError += d[c] * d[c];
+    }
+  }
+
+  double  mse = squaredError / (static_cast<double>(w) * h * channels);
+
+  return mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : infinity;
+}
+
+void benchBlockCompression() {
+  const int             size = 2048;
+  const int             numLookups = 1 << 23;
+  std::vector<uint8_t>  color(static_cast<size_t>(size) * size * 3);
+  std::vector<uint8_t>  normals(static_cast<size_t>(size) * size * 3);
+  std::mt19937          generator(1234);
+
+  // smooth color gradients with some grain, normals of a bumpy height field
+  for (int j = 0; j < size; j++) {
+    for (int i = 0; i < size; i++) {
+      uint8_t*  c = &color[(static_cast<size_t>(j) * size + i) * 3];
+      uint8_t*  n = &normals[(static_cast<size_t>(j) * size + i) * 3];
+      float     x = static_cast<float>(i) / size, y = static_cast<float>(j) / size;
+      int       grain = static_cast<int>(generator() % 16) - 8;
+
+      c[0] = static_cast<uint8_t>(clamp(128.0f + 100.0f * sinf(6.0f * x) * cosf(4.0f * y) + grain, 0, 255.0f));
+      c[1] = static_cast<uint8_t>(clamp(255.0f * x * y + grain, 0, 255.0f));
+      c[2] = static_cast<uint8_t>(clamp(64.0f + 128.0f * y + grain, 0, 255.0f));
+
+      vec3f     normal = unitVector(vec3f(0.4f * cosf(40.0f * x) + 0.01f * grain,
+                                          0.4f * sinf(30.0f * y) - 0.01f * grain, 1.0f));
+      n[0] = static_cast<uint8_t>(clamp(128.0f + 127.0f * normal(0), 0, 255.0f));
+      n[1] = static_cast<uint8_t>(clamp(128.0f + 127.0f * normal(1), 0, 255.0f));
+      n[2] = static_cast<uint8_t>(clamp(128.0f + 127.0f * normal(2), 0, 255.0f));
+    }
+  }
+
+  std::vector<uint8_t>  scalar(static_cast<size_t>(size) * size);
+
+  for (size_t t = 0; t < scalar.size(); t++)
+    scalar[t] = color[t * 3 + 1];
+
+  imagePNG  colorImg(color.data(), size, size, 3, textureLayout::tiled);
+  imagePNG  normalImg(normals.data(), size, size, 3, textureLayout::tiled);
+  imagePNG  scalarImg(scalar.data(), size, size, 1, textureLayout::tiled);
+
+  struct testCase {
+    const char*     name;
+    const imagePNG& source;
+    bcFormat        format;
+    int             channels;
+  } cases[] = {
+    {"BC1 color ", colorImg, bcFormat::bc1, 3},
+    {"BC4 scalar", scalarImg, bcFormat::bc4, 1},
+    {"BC5 normal", normalImg, bcFormat::bc5, 2},
+  };
+
+  std::vector<vec2f>                    random, coherent;
+  std::uniform_real_distribution<float> distribution(0, 1.0f);
+
+  for (int n = 0; n < numLookups; n++)
+    random.push_back(vec2f(distribution(generator), distribution(generator)));
+
+  while (coherent.size() < numLookups) {
+    float u0 = distribution(generator), v0 = distribution(generator);
+
+    for (int j = 0; j < 16; j++)
+      for (int i = 0; i < 16; i++)
+        coherent.push_back(vec2f(u0 + 0.5f * i / size, v0 + 0.5f * j / size));
+  }
+
+  auto  lookups = [&](const texture& tex, const std::vector<vec2f>& uvs) {
+    color3f sum(0, 0, 0);
+    auto    start = benchClock::now();
+
+    for (const auto& uv : uvs)
+      sum += tex.value(uv(0), uv(1), vec3f(0, 0, 0), 0);
+
+    return std::make_pair(uvs.size() / secondsSince(start) * 1e-6, sum.sum());
+  };
+
+  std::cout << "block compression " << size << "x" << size << "\n";
+
+  for (const auto& test : cases) {
+    auto    start = benchClock::now();
+    bcImage compressed(test.source, test.format, true);
+    double  encodeSeconds = secondsSince(start);
+    bcImage uncached(test.source, test.format, false);
+    size_t  sourceBytes = 0;
+
+    for (const auto& mip : test.source.levels())
+      sourceBytes += static_cast<size_t>(mip.width) * mip.height * test.source.bytesPerPixel();
+
+    std::cout << "  " << test.name << ": " << sourceBytes / 1024 << " KB -> "
+              << compressed.memoryBytes() / 1024 << " KB ("
+              << static_cast<double>(sourceBytes) / compressed.memoryBytes() << "x), PSNR "
+              << psnr(test.source, compressed, size, size, test.channels) << " dB, encode "
+              << encodeSeconds << " s\n";
+
+    for (const auto* uvs : {&coherent, &random}) {
+      std::cout << "    " << (uvs == &coherent ? "coherent" : "random  ")
+                << " bilinear Mlookups/s: raw " << lookups(test.source, *uvs).first
+                << ", bc + block cache " << lookups(compressed, *uvs).first
+                << ", bc uncached " << lookups(uncached, *uvs).first << "\n";
+    }
+  }
+
+  // a pbr material reads its albedo, normal and scalar maps at the same uv, the blocks of
+  // all three have to share the per-thread block cache
+  bcImage colorBC(colorImg, bcFormat::bc1, true), colorUncached(colorImg, bcFormat::bc1, false);
+  bcImage normalBC(normalImg, bcFormat::bc5, true), normalUncached(normalImg, bcFormat::bc5, false);
+  bcImage scalarBC(scalarImg, bcFormat::bc4, true), scalarUncached(scalarImg, bcFormat::bc4, false);
+
+  auto  materialLookups = [&](const texture& a, const texture& n, const texture& s,
+                              const std::vector<vec2f>& uvs) {
+    color3f sum(0, 0, 0);
+    auto    start = benchClock::now();
+
+    for (const auto& uv : uvs) {
+      sum += a.value(uv(0), uv(1), vec3f(0, 0, 0), 0);
+      sum += n.value(uv(0), uv(1), vec3f(0, 0, 0), 0);
+      sum += s.value(uv(0), uv(1), vec3f(0, 0, 0), 0);
+    }
+
+    return std::make_pair(3 * uvs.size() / secondsSince(start) * 1e-6, sum.sum());
+  };
+
+  std::cout << "  BC1 + BC5 + BC4 at the same uv:\n";
+
+  for (const auto* uvs : {&coherent, &random}) {
+    std::cout << "    " << (uvs == &coherent ? "coherent" : "random  ")
+              << " bilinear Mlookups/s: raw " << materialLookups(colorImg, normalImg, scalarImg, *uvs).first
+              << ", bc + block cache " << materialLookups(colorBC, normalBC, scalarBC, *uvs).first
+              << ", bc uncached " << materialLookups(colorUncached, normalUncached, scalarUncached, *uvs).first
+              << "\n";
+  }
+}
+
+/******************************************************************************
+ * rendering benchmarks share a small scene of pbr spheres under a sky and one
+ * small bright light, rendered at low resolution
+ ******************************************************************************/
+
+struct benchScene {
+  materialTable     materials;
+  hittableList      world;
+  hittableList      lights;
+  environmentLight  background;
+  camera            cam;
+  int               width, height, maxBounce;
+};
+
+benchScene makeBenchScene(int width = 64, int height = 36) {
+  materialTable materials;
+  hittableList  objects;
+  auto          checkerTex = make_shared<checker>(color3f(0.2f, 0.3f, 0.1f), color3f(0.9f, 0.9f, 0.9f));
+  auto          solid = [](float r, float g, float b) { return make_shared<solidColor>(255.0f * r, 255.0f * g, 255.0f * b); };
+
+  objects.add(make_shared<sphere>(vec3f(0, -1000.0f, 0), vec3f(0, -1000.0f, 0), 0, 1.0f, 1000.0f,
+                                  materials.add(pbrMetallicRoughness(checkerTex, vec4f(1.0f, 1.0f, 1.0f, 1.0f), 0, 0.8f))));
+  objects.add(make_shared<sphere>(vec3f(-2.2f, 1.0f, 0), vec3f(-2.2f, 1.0f, 0), 0, 1.0f, 1.0f,
+                                  materials.add(pbrMetallicRoughness(solid(1.0f, 0.78f, 0.34f), vec4f(1.0f, 1.0f, 1.0f, 1.0f), 1.0f, 0.2f))));
+  objects.add(make_shared<sphere>(vec3f(0, 1.0f, 0), vec3f(0, 1.0f, 0), 0, 1.0f, 1.0f,
+                                  materials.add(pbrMetallicRoughness(solid(0.7f, 0.1f, 0.1f), vec4f(1.0f, 1.0f, 1.0f, 1.0f), 0, 0.3f))));
+  objects.add(make_shared<sphere>(vec3f(2.2f, 1.0f, 0), vec3f(2.2f, 1.0f, 0), 0, 1.0f, 1.0f,
+                                  materials.add(pbrMetallicRoughness(solid(0.9f, 0.9f, 0.9f), vec4f(1.0f, 1.0f, 1.0f, 1.0f), 1.0f, 0.5f))));
+  objects.add(make_shared<sphere>(vec3f(-4.0f, 4.0f, 4.0f), vec3f(-4.0f, 4.0f, 4.0f), 0, 1.0f, 0.5f,
+                                  materials.add(diffuseLight(color3f(80.0f, 70.0f, 50.0f)))));
+
+  hittableList  lights = buildLights(objects, materials);
+  benchScene    scene = {materials, hittableList(make_shared<bvhNode>(objects, 0, 1)), lights, color3f(0.3f, 0.4f, 0.5f),
+                        camera(vec3f(0, 2.5f, 7.0f), vec3f(0, 1.0f, 0), vec3f(0, 1.0f, 0), 50.0f,
+                                static_cast<float>(width) / height, 0, 7.0f, 0, 1.0f),
+                        width, height, 4};
+  scene.cam.setImageHeight(height);
+
+  return scene;
+}
+
+// pixels hold sums over numSamples samples
+double rmse(const std::vector<color3f>& pixels, int numSamples,
+            const std::vector<color3f>& reference, int referenceSamples) {
+  double  sum = 0;
+
+  for (size_t p = 0; p < pixels.size(); p++)
+    sum += (pixels[p] / numSamples - reference[p] / referenceSamples).squaredNorm();
+
+  return sqrt(sum / (3.0 * pixels.size()));
+}
+
+// render 1 spp passes until the time budget is spent, returns samples per pixel
+int renderForTime(benchScene& scene, double seconds, std::vector<color3f>& pixels) {
+  auto  start = benchClock::now();
+  int   numSamples = 0;
+
+  pixels.assign(scene.width * scene.height, color3f(0, 0, 0));
+
+  while (secondsSince(start) < seconds) {
+    renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height, 1,
+                scene.maxBounce, pixels, nullptr, numSamples);
+    numSamples++;
+  }
+
+  return numSamples;
+}
+
+/******************************************************************************
+ * bsdf sampling: cosine vs lobe selection + GGX VNDF at equal time
+ ******************************************************************************/
+
+void benchBSDFSampling() {
+  const int             referenceSamples = 1024;
+  const double          budget = 2.0;
+  benchScene            scene = makeBenchScene();
+  std::vector<color3f>  reference;
+
+  // bsdf sampling alone, light sampling would hide most of the difference
+  settings.nextEventEstimation = false;
+
+  std::cout << "bsdf sampling, " << scene.width << "x" << scene.height << ", reference "
+            << referenceSamples << " spp\n";
+
+  settings.bsdf = bsdfSampling::importance;
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              referenceSamples, scene.maxBounce, reference);
+
+  for (auto mode : {bsdfSampling::cosine, bsdfSampling::importance}) {
+    std::vector<color3f>  pixels;
+
+    settings.bsdf = mode;
+    int numSamples = renderForTime(scene, budget, pixels);
+
+    std::cout << "  " << (mode == bsdfSampling::cosine ? "cosine    " : "importance") << ": "
+              << numSamples << " spp in " << budget << " s, RMSE "
+              << rmse(pixels, numSamples, reference, referenceSamples) << "\n";
+  }
+
+  settings.bsdf = bsdfSampling::importance;
+  settings.nextEventEstimation = true;
+}
+
+/******************************************************************************
+ * light selection: uniform vs light BVH as the number of lights grows, same
+ * total power spread over 1 to 10000 lights
+ ******************************************************************************/
+
+// rough spheres on a ground plane at night, lit by numLights small lights of constant total power
+// spread over a wide area above and out of view
+benchScene makeManyLightScene(int numLights, int width = 64, int height = 36) {
+  const float                           radius = 0.05f;
+  std::mt19937                          generator(7);
+  std::uniform_real_distribution<float> uniform(0, 1.0f);
+  materialTable                         materials;
+  hittableList                          objects;
+  pbrMetallicRoughness                  groundMat(color3f(0.5f, 0.5f, 0.5f));
+  pbrMetallicRoughness                  roughMat(color3f(0.7f, 0.3f, 0.2f));
+
+  groundMat.roughness = roughMat.roughness = 1.0f;
+
+  auto                                  ground = materials.add(groundMat);
+  auto                                  rough = materials.add(roughMat);
+  auto                                  lightMat = materials.add(diffuseLight(
+                                          color3f(8000.0f, 7000.0f, 5000.0f) * (0.0025f / (radius * radius * numLights))));
+
+  objects.add(make_shared<sphere>(vec3f(0, -1000.0f, 0), vec3f(0, -1000.0f, 0), 0, 1.0f, 1000.0f, ground));
+
+  for (float x : {-2.2f, 0.0f, 2.2f})
+    objects.add(make_shared<sphere>(vec3f(x, 1.0f, 0), vec3f(x, 1.0f, 0), 0, 1.0f, 1.0f, rough));
+
+  for (int i = 0; i < numLights; i++) {
+    vec3f center(-40.0f + 80.0f * uniform(generator), 10.0f + 3.0f * uniform(generator),
+                  -20.0f + 80.0f * uniform(generator));
+
+    objects.add(make_shared<sphere>(center, center, 0, 1.0f, radius, lightMat));
+  }
+
+  hittableList  lights = buildLights(objects, materials);
+  benchScene    scene = {materials, hittableList(make_shared<bvhNode>(objects, 0, 1)), lights, color3f(0, 0, 0),
+                        camera(vec3f(0, 2.5f, 7.0f), vec3f(0, 1.0f, 0), vec3f(0, 1.0f, 0), 50.0f,
+                                static_cast<float>(width) / height, 0, 7.0f, 0, 1.0f),
+                        width, height, 2};
+  scene.cam.setImageHeight(height);
+
+  return scene;
+}
+
+// per pixel standard deviation of a numSamples estimate relative to the mean pixel value,
+// from two independent renders
+double relativeNoise(benchScene& scene, int numSamples, double& seconds) {
+  std::vector<color3f>  a, b;
+  double                mean = 0;
+  auto                  start = benchClock::now();
+
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              numSamples, scene.maxBounce, a);
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              numSamples, scene.maxBounce, b);
+  seconds = secondsSince(start) / 2;
+
+  for (size_t p = 0; p < a.size(); p++)
+    mean += (a[p] + b[p]).sum() / (6.0 * numSamples);
+
+  mean /= a.size();
+
+  return rmse(a, numSamples, b, numSamples) / sqrt(2.0) / mean;
+}
+
+void benchManyLights() {
+  const int numSamples = 16;
+
+  std::cout << "light selection, direct lighting at " << numSamples
+            << " spp, noise = per pixel standard deviation / mean\n";
+
+  for (int numLights : {1, 10, 100, 1000, 10000}) {
+    std::cout << "  " << numLights << " light(s)\n";
+
+    for (auto mode : {lightSampling::uniform, lightSampling::tree}) {
+      double  seconds;
+
+      settings.lightSelection = mode;
+      benchScene scene = makeManyLightScene(numLights);
+      double  noise = relativeNoise(scene, numSamples, seconds);
+
+      std::cout << "    " << (mode == lightSampling::uniform ? "uniform  " : "light bvh") << ": noise "
+                << noise << ", " << seconds << " s\n";
+    }
+  }
+
+  settings.lightSelection = lightSampling::tree;
+}
+
+/******************************************************************************
+ * environment lighting: a sky with a small sun, sampled through bsdf only vs
+ * the alias table + MIS, and the cost of building / loading the table
+ ******************************************************************************/
+
+// equirectangular sky gradient with a sun 2 degrees across, 40 degrees above the horizon
+std::vector<float> makeSunSky(int width, int height) {
+  std::vector<float>  rgb(3 * width * height);
+  vec3f               sunDir = unitVector(vec3f(-0.5f, 0.64f, 0.58f));
+
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      float   phi = 2.0f * pi * (i + 0.5f) / width - pi;
+      float   theta = pi * (j + 0.5f) / height;
+      vec3f   dir(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+      float   up = fmaxf(dir(1), 0);
+      color3f sky = dir(1) > 0 ? color3f(0.3f, 0.45f, 0.8f) * (0.3f + 0.7f * up) : color3f(0.1f, 0.1f, 0.1f);
+
+      if (dir.dot(sunDir) > cosf(deg2rad(1.0f)))
+        sky = color3f(50000.0f, 45000.0f, 40000.0f);
+
+      for (int c = 0; c < 3; c++)
+        rgb[3 * (j * width + i) + c] = sky(c);
+    }
+  }
+
+  return rgb;
+}
+
+void benchEnvironment() {
+  const int             referenceSamples = 1024;
+  const int             numSamples = 16;
+  const int             skyWidth = 1024, skyHeight = 512;
+  std::vector<float>    sky = makeSunSky(skyWidth, skyHeight);
+  auto                  start = benchClock::now();
+  auto                  environment = make_shared<environmentLight>(sky.data(), skyWidth, skyHeight);
+  double                buildSeconds = secondsSince(start);
+
+  std::cout << "environment lighting, " << skyWidth << "x" << skyHeight << " sky\n";
+  std::cout << "  alias table build: " << buildSeconds * 1000.0 << " ms on "
+            << std::max(1u, std::thread::hardware_concurrency()) << " thread(s)\n";
+
+  // cached table through a file round trip
+  const char* filename = "bench_sky.hdr";
+
+  if (stbi_write_hdr(filename, skyWidth, skyHeight, 3, sky.data())) {
+    remove("bench_sky.hdr.srta");
+
+    for (const char* pass : {"cold", "cached"}) {
+      start = benchClock::now();
+      environmentLight  loaded(filename);
+      std::cout << "  load " << pass << ": " << secondsSince(start) * 1000.0 << " ms\n";
+    }
+
+    remove(filename);
+    remove("bench_sky.hdr.srta");
+  }
+
+  benchScene            scene = makeBenchScene();
+  hittableList          objects;
+  std::vector<color3f>  reference;
+
+  // the bench scene without its light, lit by the sky only
+  pbrMetallicRoughness  groundMat(color3f(0.5f, 0.5f, 0.5f));
+  pbrMetallicRoughness  roughMat(color3f(0.7f, 0.3f, 0.2f));
+
+  groundMat.roughness = roughMat.roughness = 1.0f;
+
+  auto  ground = scene.materials.add(groundMat);
+  auto  rough = scene.materials.add(roughMat);
+  auto  glossy = scene.materials.add(pbrMetallicRoughness(make_shared<solidColor>(230.0f, 230.0f, 230.0f),
+                                                            vec4f(1.0f, 1.0f, 1.0f, 1.0f), 1.0f, 0.3f));
+
+  objects.add(make_shared<sphere>(vec3f(0, -1000.0f, 0), vec3f(0, -1000.0f, 0), 0, 1.0f, 1000.0f, ground));
+  objects.add(make_shared<sphere>(vec3f(-1.2f, 1.0f, 0), vec3f(-1.2f, 1.0f, 0), 0, 1.0f, 1.0f, rough));
+  objects.add(make_shared<sphere>(vec3f(1.2f, 1.0f, 0), vec3f(1.2f, 1.0f, 0), 0, 1.0f, 1.0f, glossy));
+  scene.world = hittableList(make_shared<bvhNode>(objects, 0, 1));
+
+  settings.environmentSampling = true;
+  scene.lights = buildLights(objects, scene.materials, environment);
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, *environment, scene.width, scene.height,
+              referenceSamples, scene.maxBounce, reference);
+
+  for (bool environmentSampling : {false, true}) {
+    std::vector<color3f>  pixels;
+
+    settings.environmentSampling = environmentSampling;
+    scene.lights = buildLights(objects, scene.materials, environment);
+
+    start = benchClock::now();
+    renderPass(scene.world, scene.materials, scene.lights, scene.cam, *environment, scene.width, scene.height,
+                numSamples, scene.maxBounce, pixels);
+    double seconds = secondsSince(start);
+
+    std::cout << "  " << (environmentSampling ? "alias table + MIS" : "bsdf only        ") << ": "
+              << numSamples << " spp in " << seconds << " s, RMSE "
+              << rmse(pixels, numSamples, reference, referenceSamples) << "\n";
+  }
+
+  settings.environmentSampling = true;
+}
+
+/******************************************************************************
+ * material dispatch: hit records carrying a materialId into the scene's table
+ * vs the previous shared_ptr<material> copied on every candidate hit with a
+ * virtual call, on 1 and all hardware threads
+ ******************************************************************************/
+
+// the previous scheme, kept here for comparison
+struct legacyMaterial {
+  virtual ~legacyMaterial() {}
+  virtual color3f emitted(float u, float v, const vec3f& p) const = 0;
+};
+
+struct legacyLight : public legacyMaterial {
+  legacyLight(const color3f& c) : emit(c) {}
+  virtual color3f emitted(float u, float v, const vec3f& p) const override { return emit; }
+
+  color3f emit;
+};
+
+struct legacyHitRecord {
+  hitRecord                   record;
+  shared_ptr<legacyMaterial>  matPtr;
+};
+
+void benchMaterialDispatch() {
+  const int                               numSpheres = 32;
+  const int                               numMaterials = 8;
+  const int                               raysPerThread = 1 << 17;
+  materialTable                           materials;
+  hittableList                            world;
+  std::vector<shared_ptr<sphere>>         spheres;
+  std::vector<shared_ptr<legacyMaterial>> legacyMaterials;
+
+  for (int m = 0; m < numMaterials; m++) {
+    color3f c(m + 1.0f, 1.0f, 1.0f);
+
+    materials.add(diffuseLight(c));
+    legacyMaterials.push_back(make_shared<legacyLight>(c));
+  }
+
+  // overlapping spheres along -z, farthest first so every one is a candidate hit
+  for (int i = numSpheres - 1; i >= 0; i--) {
+    vec3f center(0, 0, -2.0f - 0.5f * i);
+
+    spheres.push_back(make_shared<sphere>(center, center, 0, 1.0f, 1.0f, i % numMaterials));
+    world.add(spheres.back());
+  }
+
+  auto  current = [&](int thread, double* result) {
+    std::mt19937                          rng(thread);
+    std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+    float                                 sum = 0;
+
+    for (int n = 0; n < raysPerThread; n++) {
+      hitRecord record;
+      ray       r(vec3f(offset(rng), offset(rng), 0), vec3f(0, 0, -1.0f));
+
+      if (world.hit(r, 0.001f, infinity, record))
+        sum += materials.emitted(record.matId, record.uv(0), record.uv(1), record.p)(0);
+    }
+
+    *result = sum;
+  };
+
+  // hittableList::hit as it was, with the material handle copied into each candidate record
+  auto  legacy = [&](int thread, double* result) {
+    std::mt19937                          rng(thread);
+    std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+    float                                 sum = 0;
+
+    for (int n = 0; n < raysPerThread; n++) {
+      legacyHitRecord record, tempRecord;
+      ray             r(vec3f(offset(rng), offset(rng), 0), vec3f(0, 0, -1.0f));
+      bool            hit = false;
+      float           closest = infinity;
+
+      for (size_t i = 0; i < spheres.size(); i++) {
+        if (spheres[i]->hit(r, 0.001f, closest, tempRecord.record)) {
+          tempRecord.matPtr = legacyMaterials[spheres[i]->matId];
+          hit = true;
+          closest = tempRecord.record.t;
+          record = tempRecord;
+        }
+      }
+
+      if (hit)
+        sum += record.matPtr->emitted(record.record.uv(0), record.record.uv(1), record.record.p)(0);
+    }
+
+    *result = sum;
+  };
+
+  std::vector<int>  threadCounts = {1};
+  int               hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  if (hardwareThreads > 1)
+    threadCounts.push_back(hardwareThreads);
+
+  std::cout << "material dispatch, " << numSpheres << " candidate hits per ray\n";
+
+  for (int numThreads : threadCounts) {
+    std::cout << "  " << numThreads << " thread(s)\n";
+
+    for (bool useLegacy : {true, false}) {
+      std::vector<double> results(numThreads);
+      auto                start = benchClock::now();
+
+      parallelThreads(numThreads, [&](int t) {
+        if (useLegacy)
+          legacy(t, &results[t]);
+        else
+          current(t, &results[t]);
+      });
+
+      double  seconds = secondsSince(start);
+      double  hits = static_cast<double>(numThreads) * raysPerThread * numSpheres;
+
+      std::cout << "    " << (useLegacy ? "shared_ptr + virtual" : "materialId + visit  ") << ": "
+                << seconds / hits * 1e9 << " ns per candidate hit\n";
+    }
+  }
+}
+
+/******************************************************************************
+ * next event estimation: bsdf sampling only vs light sampling + MIS at equal
+ * sample count
+ ******************************************************************************/
+
+void benchNextEvent() {
+  const int             referenceSamples = 1024;
+  const int             numSamples = 16;
+  benchScene            scene = makeBenchScene();
+  std::vector<color3f>  reference;
+
+  std::cout << "next event estimation, " << scene.width << "x" << scene.height << ", "
+            << scene.lights.objects.size() << " light(s), reference " << referenceSamples << " spp\n";
+
+  settings.nextEventEstimation = true;
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              referenceSamples, scene.maxBounce, reference);
+
+  for (bool nextEvent : {false, true}) {
+    std::vector<color3f>  pixels;
+
+    settings.nextEventEstimation = nextEvent;
+    auto start = benchClock::now();
+    renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+                numSamples, scene.maxBounce, pixels);
+    double seconds = secondsSince(start);
+
+    std::cout << "  " << (nextEvent ? "light + bsdf (MIS)" : "bsdf only         ") << ": "
+              << numSamples << " spp in " << seconds << " s, RMSE "
+              << rmse(pixels, numSamples, reference, referenceSamples) << "\n";
+  }
+
+  settings.nextEventEstimation = true;
+}
+
+/******************************************************************************
+ * batched pbr shading: vexp2 and kernel error against the scalar reference,
+ * shading throughput scalar vs SIMD, and the batched render mode
+ ******************************************************************************/
+
+// random unit vector on the side of n
+inline vec3f randomAbove(const vec3f& n) {
+  vec3f v = randomUnitVector();
+
+  return v.dot(n) < 0 ? vec3f(-v) : v;
+}
+
+void benchBatchShading() {
+  const int                 numQueries = 1 << 16;
+  const int                 numRounds = 32;
+  const int                 numSamples = 64;
+  const int                 referenceSamples = 1024;
+  pbrMetallicRoughness      reference(color3f(1.0f, 1.0f, 1.0f));
+  std::vector<pbrSurface>   surfaces(numQueries);
+  std::vector<vec3f>        views(numQueries), lightDirs(numQueries);
+  pbrShadingBatch           batch;
+
+  std::cout << "batched pbr shading, " << simdName(simdLevel()) << ", " << simdLanes(simdLevel()) << " lane(s)\n";
+
+  // vexp2 over its whole range, scalar and SIMD
+  {
+    const int           n = 1 << 20;
+    std::vector<float>  x(n), y(n);
+    double              scalarError = 0, vectorError = 0;
+
+    for (int i = 0; i < n; i++)
+      x[i] = -126.0f + 252.0f * i / (n - 1);
+
+    vexp2(x.data(), y.data(), n);
+
+    for (int i = 0; i < n; i++) {
+      double  exact = exp2(static_cast<double>(x[i]));
+
+      scalarError = std::max(scalarError, fabs(vexp2(x[i]) / exact - 1.0));
+      vectorError = std::max(vectorError, fabs(y[i] / exact - 1.0));
+    }
+
+    std::cout << "  vexp2 max relative error on [-126, 126]: scalar " << scalarError << ", SIMD " << vectorError << "\n";
+  }
+
+  for (int i = 0; i < numQueries; i++) {
+    surfaces[i].normal = randomUnitVector();
+    surfaces[i].baseColor = randomVec3f();
+    surfaces[i].metallic = randomFloat();
+    surfaces[i].roughness = randomFloat(minRoughness, 1.0f);
+    surfaces[i].occlusion = randomFloat(0.5f, 1.0f);
+    views[i] = randomAbove(surfaces[i].normal);
+    lightDirs[i] = randomAbove(surfaces[i].normal);
+  }
+
+  for (auto mode : {bsdfSampling::cosine, bsdfSampling::importance}) {
+    double  valueError = 0, pdfError = 0;
+
+    settings.bsdf = mode;
+
+    // largest error relative to the value, or to 1 for tiny values
+    auto    relativeError = [](double a, double b) {
+      return fabs(a - b) / std::max(1.0, fabs(b));
+    };
+
+    batch.clear();
+
+    for (int i = 0; i < numQueries; i++)
+      batch.add(surfaces[i], views[i], lightDirs[i]);
+
+    batch.evaluate(mode);
+
+    for (int i = 0; i < numQueries; i++) {
+      color3f f = reference.evalBRDF(surfaces[i], views[i], lightDirs[i]) * surfaces[i].normal.dot(lightDirs[i]);
+      float   pdf = reference.scatterPdf(surfaces[i], views[i], lightDirs[i]);
+
+      for (int c = 0; c < 3; c++)
+        valueError = std::max(valueError, relativeError(batch.value(i)(c), f(c)));
+
+      pdfError = std::max(pdfError, relativeError(batch.pdf(i), pdf));
+    }
+
+    // time both on the same queries, inputs already resolved
+    auto    start = benchClock::now();
+    float   sum = 0;
+
+    for (int round = 0; round < numRounds; round++) {
+      for (int i = 0; i < numQueries; i++) {
+        sum += reference.evalBRDF(surfaces[i], views[i], lightDirs[i])(0) * surfaces[i].normal.dot(lightDirs[i]);
+        sum += reference.scatterPdf(surfaces[i], views[i], lightDirs[i]);
+      }
+    }
+
+    double  scalarSeconds = secondsSince(start);
+
+    double  hits = static_cast<double>(numQueries) * numRounds;
+
+    std::cout << "  " << (mode == bsdfSampling::cosine ? "cosine    " : "importance") << ": scalar "
+              << hits / scalarSeconds * 1e-6 << " Mhits/s, batch";
+
+    // every instruction set up to the widest this cpu has
+    for (auto isa : {simdISA::scalar, simdISA::avx2, simdISA::avx512}) {
+      if (simdLanes(isa) > simdLanes(simdLevel()))
+        break;
+
+      start = benchClock::now();
+
+      for (int round = 0; round < numRounds; round++) {
+        batch.evaluate(mode, isa);
+        sum += batch.value(round)(0) + batch.pdf(round);
+      }
+
+      std::cout << " " << simdName(isa) << " " << hits / secondsSince(start) * 1e-6;
+    }
+
+    std::cout << " Mhits/s, max error f * cos " << valueError << ", pdf " << pdfError
+              << (sum == 0 ? " " : "") << "\n";
+  }
+
+  settings.bsdf = bsdfSampling::importance;
+
+  // whole frames, the batched mode converges to the same image
+  benchScene            scene = makeBenchScene();
+  std::vector<color3f>  referencePixels;
+
+  settings.batchShading = false;
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              referenceSamples, scene.maxBounce, referencePixels);
+
+  for (bool batched : {false, true}) {
+    std::vector<color3f>  pixels;
+
+    settings.batchShading = batched;
+    auto start = benchClock::now();
+    renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+                numSamples, scene.maxBounce, pixels);
+    double seconds = secondsSince(start);
+
+    std::cout << "  render " << (batched ? "batched" : "scalar ") << ": " << numSamples << " spp in "
+              << seconds << " s, RMSE " << rmse(pixels, numSamples, referencePixels, referenceSamples) << "\n";
+  }
+
+  settings.batchShading = false;
+}
+
+/******************************************************************************
+ * pbr surface kernels: surfaceAt and scatter throughput per feature
+ * combination, with the features looked up on every hit vs the kernel picked
+ * by specialize()
+ ******************************************************************************/
+
+void benchMaterialVariants() {
+  const int               numHits = 1 << 14;
+  const int               numRounds = 16;
+  auto                    solid = [](float r, float g, float b) { return make_shared<solidColor>(255.0f * r, 255.0f * g, 255.0f * b); };
+  auto                    albedoTex = solid(0.8f, 0.5f, 0.3f);
+  auto                    normalTex = solid(0.5f, 0.55f, 1.0f);
+  auto                    mrTex = solid(1.0f, 0.6f, 0.8f);
+  vec4f                   white(1.0f, 1.0f, 1.0f, 1.0f);
+  sphere                  target(vec3f(0, 0, -3.0f), vec3f(0, 0, -3.0f), 0, 1.0f, 1.0f, 0);
+  std::vector<ray>        rays;
+  std::vector<hitRecord>  records;
+
+  // camera rays onto a unit sphere, the same hits for every variant
+  while (static_cast<int>(records.size()) < numHits) {
+    hitRecord record;
+    ray       r(vec3f(0, 0, 0), unitVector(vec3f(randomFloat(-0.3f, 0.3f), randomFloat(-0.3f, 0.3f), -1.0f)), 0,
+                0, 0.001f);
+
+    if (target.hit(r, 0.001f, infinity, record)) {
+      rays.push_back(r);
+      records.push_back(record);
+    }
+  }
+
+  struct variant {
+    const char*           name;
+    pbrMetallicRoughness  mat;
+  };
+
+  std::vector<variant>  variants = {
+    {"constant                   ", pbrMetallicRoughness(nullptr, vec4f(0.8f, 0.5f, 0.3f, 1.0f), 0.5f, 0.4f)},
+    {"albedo                     ", pbrMetallicRoughness(albedoTex, white, 0.5f, 0.4f)},
+    {"albedo * factor            ", pbrMetallicRoughness(albedoTex, vec4f(0.9f, 0.9f, 0.9f, 1.0f), 0.5f, 0.4f)},
+    {"albedo + normal            ", pbrMetallicRoughness(albedoTex, normalTex)},
+    {"albedo + normal + mr       ", pbrMetallicRoughness(albedoTex, normalTex, mrTex, white, 1.0f, 1.0f)},
+    {"albedo + normal + m + r + o", pbrMetallicRoughness(albedoTex, normalTex, mrTex, mrTex, white)}
+  };
+
+  variants.back().mat.occlusionMap = mrTex;
+
+  std::cout << "pbr surface kernels, M hits/s with per hit lookup -> specialized\n";
+
+  for (auto& v : variants) {
+    double  surfaceRates[2], scatterRates[2];
+    float   sum = 0;
+
+    for (bool specialized : {false, true}) {
+      pbrMetallicRoughness  mat = v.mat;
+
+      if (specialized)
+        mat.specialize();
+
+      auto  start = benchClock::now();
+
+      for (int round = 0; round < numRounds; round++) {
+        for (int i = 0; i < numHits; i++)
+          sum += mat.surfaceAt(rays[i], records[i]).roughness;
+      }
+
+      surfaceRates[specialized] = static_cast<double>(numHits) * numRounds / secondsSince(start) * 1e-6;
+      start = benchClock::now();
+
+      for (int round = 0; round < numRounds; round++) {
+        for (int i = 0; i < numHits; i++) {
+          color3f attenuation;
+          ray     scattered;
+          float   pdf;
+
+          if (mat.scatter(rays[i], records[i], attenuation, scattered, pdf))
+            sum += attenuation(0);
+        }
+      }
+
+      scatterRates[specialized] = static_cast<double>(numHits) * numRounds / secondsSince(start) * 1e-6;
+    }
+
+    std::cout << "  " << v.name << " (0x" << std::hex << v.mat.features() << std::dec << "): surfaceAt "
+              << surfaceRates[0] << " -> " << surfaceRates[1] << ", scatter " << scatterRates[0] << " -> "
+              << scatterRates[1] << (sum == 0 ? " " : "") << "\n";
+  }
+}
+
+/******************************************************************************
+ * material bake: error of the packed shading map against the per-map path it
+ * replaces, for noise maps at mixed resolutions with factors other than 1, and
+ * the surfaceAt throughput of both
+ ******************************************************************************/
+
+void benchMaterialBake() {
+  const int     numHits = 1 << 16;
+  std::mt19937  generator(1234);
+
+  auto  noiseMap = [&](int size, int bpp) {
+    std::vector<uint8_t>  pixels(static_cast<size_t>(size) * size * bpp);
+
+    for (auto& p : pixels)
+      p = static_cast<uint8_t>(generator());
+
+    return make_shared<imagePNG>(pixels.data(), size, size, bpp);
+  };
+
+  // tangent space normals within 60 degrees of the surface normal
+  auto  normalMap = [&](int size) {
+    std::vector<uint8_t>  pixels(static_cast<size_t>(size) * size * 3);
+
+    for (size_t i = 0; i < pixels.size(); i += 3) {
+      vec3f n = unitVector(vec3f(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f), 1.2f));
+
+      for (int c = 0; c < 3; c++)
+        pixels[i + c] = static_cast<uint8_t>(clamp(n(c) * 128.0f + 128.5f, 0, 255.0f));
+    }
+
+    return make_shared<imagePNG>(pixels.data(), size, size, 3);
+  };
+
+  pbrMetallicRoughness  perMap(noiseMap(256, 3), normalMap(256), noiseMap(128, 3),
+                                vec4f(0.9f, 0.7f, 0.5f, 1.0f), 0.8f, 0.6f);
+  perMap.occlusionMap = noiseMap(64, 1);
+  perMap.specialize();
+
+  pbrMetallicRoughness  baked = perMap;
+
+  if (!baked.bake())
+    return;
+
+  sphere  target(vec3f(0, 0, -3.0f), vec3f(0, 0, -3.0f), 0, 1.0f, 1.0f, 0);
+
+  std::cout << "material bake, 256 albedo + normal, 128 metallic/roughness, 64 occlusion, "
+            << "mean / max abs error vs per-map, normal error in degrees\n";
+
+  for (float spread : {0.0f, 0.004f, 0.03f}) {
+    std::vector<ray>        rays;
+    std::vector<hitRecord>  records;
+
+    while (static_cast<int>(records.size()) < numHits) {
+      hitRecord record;
+      ray       r(vec3f(0, 0, 0), unitVector(vec3f(randomFloat(-0.3f, 0.3f), randomFloat(-0.3f, 0.3f), -1.0f)), 0,
+                  0, spread);
+
+      if (target.hit(r, 0.001f, infinity, record)) {
+        rays.push_back(r);
+        records.push_back(record);
+      }
+    }
+
+    float   sumError[5] = {}, maxError[5] = {};
+    float   footprint = 0;
+
+    for (int i = 0; i < numHits; i++) {
+      pbrSurface  reference = perMap.surfaceAt(rays[i], records[i]);
+      pbrSurface  packed = baked.surfaceAt(rays[i], records[i]);
+      float       error[5] = {(packed.baseColor - reference.baseColor).cwiseAbs().maxCoeff(),
+                              acosf(clamp(packed.normal.dot(reference.normal), -1.0f, 1.0f)) * 180.0f / pi,
+                              fabsf(packed.metallic - reference.metallic),
+                              fabsf(packed.roughness - reference.roughness),
+                              fabsf(packed.occlusion - reference.occlusion)};
+
+      for (int k = 0; k < 5; k++) {
+        sumError[k] += error[k];
+        maxError[k] = fmaxf(maxError[k], error[k]);
+      }
+
+      footprint += records[i].uvFootprint(rays[i]);
+    }
+
+    double  rates[2];
+    float   sum = 0;
+
+    for (int b = 0; b < 2; b++) {
+      const pbrMetallicRoughness& mat = b ? baked : perMap;
+      auto                        start = benchClock::now();
+
+      for (int round = 0; round < 8; round++) {
+        for (int i = 0; i < numHits; i++)
+          sum += mat.surfaceAt(rays[i], records[i]).roughness;
+      }
+
+      rates[b] = 8.0 * numHits / secondsSince(start) * 1e-6;
+    }
+
+    const char* names[5] = {"albedo", "normal", "metallic", "roughness", "occlusion"};
+
+    std::cout << "  mean footprint " << footprint / numHits * 256 << " albedo texels:";
+
+    for (int k = 0; k < 5; k++)
+      std::cout << " " << names[k] << " " << sumError[k] / numHits << " / " << maxError[k];
+
+    std::cout << "\n    surfaceAt M hits/s per-map " << rates[0] << " -> baked " << rates[1]
+              << (sum == 0 ? " " : "") << "\n";
+  }
+}
+
+/******************************************************************************
+ * path guiding: closed room lit by a light tucked above a shade, so most of
+ * the room only sees it through the ceiling. Progressive renders, unguided
+ * and guided by a tree trained on their own first passes, and the time each
+ * takes to reach RMSE targets against a long unguided reference
+ ******************************************************************************/
+
+benchScene makeRoomScene(int width = 64, int height = 36) {
+  materialTable materials;
+  hittableList  objects;
+  auto          rough = [&](float r, float g, float b) {
+    return materials.add(pbrMetallicRoughness(nullptr, vec4f(r, g, b, 1.0f), 0, 0.9f));
+  };
+  auto          ball = [&](const vec3f& center, float radius, materialId mat) {
+    objects.add(make_shared<sphere>(center, center, 0, 1.0f, radius, mat));
+  };
+
+  // walls are huge spheres around a 6 x 3 x 6 room
+  const float   wall = 1000.0f;
+  materialId    white = rough(0.8f, 0.8f, 0.8f);
+
+  ball(vec3f(0, -wall, 0), wall, white);
+  ball(vec3f(0, 3.0f + wall, 0), wall, white);
+  ball(vec3f(-3.0f - wall, 0, 0), wall, rough(0.7f, 0.2f, 0.2f));
+  ball(vec3f(3.0f + wall, 0, 0), wall, rough(0.2f, 0.6f, 0.2f));
+  ball(vec3f(0, 0, -3.0f - wall), wall, white);
+  ball(vec3f(0, 0, 3.0f + wall), wall, white);
+
+  ball(vec3f(-1.0f, 0.6f, -1.0f), 0.6f, rough(0.3f, 0.4f, 0.8f));
+  ball(vec3f(1.0f, 0.8f, 0), 0.8f, rough(0.9f, 0.8f, 0.6f));
+
+  // lamp in a corner, shaded from below
+  ball(vec3f(2.0f, 2.5f, -2.0f), 0.15f, materials.add(diffuseLight(color3f(400.0f, 380.0f, 340.0f))));
+  ball(vec3f(2.0f, 1.8f, -2.0f), 0.55f, rough(0.5f, 0.5f, 0.5f));
+
+  hittableList  lights = buildLights(objects, materials);
+  benchScene    scene = {materials, hittableList(make_shared<bvhNode>(objects, 0, 1)), lights, color3f(0, 0, 0),
+                        camera(vec3f(0, 1.5f, 2.9f), vec3f(0, 1.2f, 0), vec3f(0, 1.0f, 0), 70.0f,
+                                static_cast<float>(width) / height, 0, 3.0f, 0, 1.0f),
+                        width, height, 6};
+  scene.cam.setImageHeight(height);
+
+  return scene;
+}
+
+void benchPathGuiding() {
+  const int             referenceSamples = 8192;
+  const int             maxSamples = 1024;
+  const int             maxPassSamples = 64;
+  const size_t          guideBytes = 16 << 20;
+  const float           targets[] = {0.4f, 0.2f, 0.1f};
+  const int             numTargets = sizeof(targets) / sizeof(targets[0]);
+  benchScene            scene = makeRoomScene();
+  aabb                  room(vec3f(-3.0f, 0, -3.0f), vec3f(3.0f, 3.0f, 3.0f));
+  film                  reference(scene.width, scene.height);
+  std::vector<color3f>  referencePixels;
+
+  std::cout << "path guiding, " << scene.width << "x" << scene.height << ", " << scene.maxBounce
+            << " bounces, reference " << referenceSamples << " spp\n";
+
+  renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, reference, referenceSamples,
+              scene.maxBounce);
+  reference.gather(referencePixels);
+
+  double  reached[2][numTargets] = {};
+
+  for (int guided = 0; guided < 2; guided++) {
+    film                  image(scene.width, scene.height);
+    sdTree                guide(room, guideBytes, 1000.0f);
+    std::vector<color3f>  pixels;
+    double                measuring = 0;    // RMSE between passes, not counted
+    double                error = 0;
+    renderBudget          noBudget;
+
+    double  seconds = renderProgressive(scene.world, scene.materials, scene.lights, scene.cam, scene.background,
+                                        image, maxSamples, maxPassSamples, noBudget, scene.maxBounce, nullptr,
+                                        [&](double elapsed, double) {
+      auto  start = benchClock::now();
+      int   numSamples = image.gather(pixels);
+
+      error = rmse(pixels, numSamples, referencePixels, referenceSamples);
+
+      for (int t = 0; t < numTargets; t++) {
+        if (reached[guided][t] == 0 && error <= targets[t])
+          reached[guided][t] = elapsed - measuring;
+      }
+
+      measuring += secondsSince(start);
+    }, guided ? &guide : nullptr);
+
+    std::cout << "  " << (guided ? "guided  " : "unguided") << ": " << maxSamples << " spp in " << seconds - measuring
+              << " s, RMSE " << error;
+
+    for (int t = 0; t < numTargets; t++) {
+      std::cout << (t ? ", " : "; RMSE ") << targets[t] << " after ";
+
+      if (reached[guided][t] > 0)
+        std::cout << reached[guided][t] << " s";
+      else
+        std::cout << "never";
+    }
+
+    if (guided) {
+      std::cout << " (" << guide.numLeaves() << " leaves, " << guide.memoryUsed() / 1024 << " of "
+                << guideBytes / 1024 << " KiB)";
+    }
+
+    std::cout << "\n";
+  }
+
+  for (int t = 0; t < numTargets; t++) {
+    if (reached[0][t] > 0 && reached[1][t] > 0) {
+      std::cout << "  time to RMSE " << targets[t] << ": guided takes " << reached[1][t] / reached[0][t]
+                << "x the unguided time\n";
+    }
+  }
+}
+
+/******************************************************************************
+ * caustics: glass and mirror balls on a floor under a small light. RMSE and
+ * time at equal sample counts for path tracing vs progressive photon mapping
+ * in 8 passes, against a long path traced reference
+ ******************************************************************************/
+
+benchScene makeCausticScene(int width = 64, int height = 36) {
+  materialTable materials;
+  hittableList  objects;
+  auto          ball = [&](const vec3f& center, float radius, materialId mat) {
+    objects.add(make_shared<sphere>(center, center, 0, 1.0f, radius, mat));
+  };
+
+  ball(vec3f(0, -1000.0f, 0), 1000.0f, materials.add(pbrMetallicRoughness(nullptr, vec4f(0.8f, 0.8f, 0.8f, 1.0f), 0, 0.9f)));
+  ball(vec3f(-0.4f, 0.6f, 0), 0.6f, materials.add(dielectric(1.5f)));
+  ball(vec3f(1.2f, 0.5f, -0.8f), 0.5f, materials.add(metal(color3f(0.9f, 0.8f, 0.6f), 0)));
+  ball(vec3f(-1.5f, 3.0f, 0.5f), 0.15f, materials.add(diffuseLight(color3f(600.0f, 560.0f, 500.0f))));
+
+  hittableList  lights = buildLights(objects, materials);
+  benchScene    scene = {materials, hittableList(make_shared<bvhNode>(objects, 0, 1)), lights, color3f(0, 0, 0),
+                        camera(vec3f(0, 2.2f, 3.5f), vec3f(0, 0.3f, 0), vec3f(0, 1.0f, 0), 60.0f,
+                                static_cast<float>(width) / height, 0, 3.0f, 0, 1.0f),
+                        width, height, 8};
+  scene.cam.setImageHeight(height);
+
+  return scene;
+}
+
+void benchCaustics() {
+  const int             referenceSamples = 4096;
+  benchScene            scene = makeCausticScene();
+  std::vector<color3f>  reference;
+
+  std::cout << "caustics, " << scene.width << "x" << scene.height << ", reference " << referenceSamples << " spp\n";
+
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              referenceSamples, scene.maxBounce, reference);
+
+  for (int numSamples : {16, 64, 256}) {
+    std::vector<color3f>  pixels;
+    auto                  start = benchClock::now();
+
+    renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width,
+                scene.height, numSamples, scene.maxBounce, pixels);
+
+    double                seconds = secondsSince(start);
+    double                error = rmse(pixels, numSamples, reference, referenceSamples);
+    causticMap            caustics(100000, 0.1f);
+
+    pixels.clear();
+    start = benchClock::now();
+    renderCaustics(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width,
+                    scene.height, numSamples, numSamples / 8, scene.maxBounce, caustics, pixels);
+
+    std::cout << "  " << numSamples << " spp: path traced " << seconds << " s, RMSE " << error
+              << "; photon mapped " << secondsSince(start) << " s, RMSE "
+              << rmse(pixels, numSamples, reference, referenceSamples) << " (" << caustics.size()
+              << " caustic photons, final radius " << caustics.radius() << ")\n";
+
+    // the same passes through renderProgressive, as main renders them
+    film          image(scene.width, scene.height);
+    causticMap    progressive(100000, 0.1f);
+    renderBudget  noBudget;
+
+    start = benchClock::now();
+    progressive.emit(scene.world, scene.materials);
+    renderProgressive(scene.world, scene.materials, scene.lights, scene.cam, scene.background, image, numSamples,
+                      numSamples / 8, noBudget, scene.maxBounce, &progressive, [](double, double) {});
+
+    int   filmSamples = image.gather(pixels);
+
+    std::cout << "    progressive film: " << secondsSince(start) << " s, RMSE "
+              << rmse(pixels, filmSamples, reference, referenceSamples) << ", final radius " << progressive.radius()
+              << "\n";
+  }
+}
+
+/******************************************************************************
+ * sampler convergence: error at 1, 2, 4, ... 256 spp for independent vs
+ * Owen-scrambled Sobol samples and the fitted rate, error ~ spp^slope. A few
+ * pixels that catch the small light through glossy bounces dominate RMSE at
+ * these counts, so the median pixel error is plotted and fitted alongside.
+ * The shared scene with direct light only, where every sample uses the same
+ * few dimensions, then the full shared scene and the room
+ ******************************************************************************/
+
+// root of the median squared pixel error, pixels hold sums over numSamples samples
+double medianError(const std::vector<color3f>& pixels, int numSamples,
+                    const std::vector<color3f>& reference, int referenceSamples) {
+  std::vector<double> errors(pixels.size());
+
+  for (size_t p = 0; p < pixels.size(); p++)
+    errors[p] = (pixels[p] / numSamples - reference[p] / referenceSamples).squaredNorm() / 3.0;
+
+  std::nth_element(errors.begin(), errors.begin() + errors.size() / 2, errors.end());
+
+  return sqrt(errors[errors.size() / 2]);
+}
+
+// least squares slope of log2 error over log2 spp, for errors at 1, 2, 4, ... spp
+double convergenceRate(const std::vector<double>& errors) {
+  double  n = errors.size(), sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+  for (size_t i = 0; i < errors.size(); i++) {
+    double  y = log2(errors[i]);
+
+    sx += i;
+    sy += y;
+    sxx += i * i;
+    sxy += i * y;
+  }
+
+  return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+void benchSamplers() {
+  const int     maxSamples = 256;
+  pixelSampling previous = settings.sampler;
+
+  for (int test = 0; test < 3; test++) {
+    const char*           names[3] = {"bench scene, direct light", "bench scene", "room"};
+    benchScene            scene = test == 2 ? makeRoomScene() : makeBenchScene();
+    std::vector<color3f>  reference;
+    std::vector<double>   errors[2], medians[2];
+
+    // camera hit and one light sample, cheap enough for a reference far below Sobol's error
+    if (test == 0)
+      scene.maxBounce = 2;
+
+    int                   referenceSamples = test == 0 ? 8192 : 2048;
+
+    // independent, Sobol errors would otherwise correlate with the reference's first samples
+    settings.sampler = pixelSampling::independent;
+    renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+                referenceSamples, scene.maxBounce, reference);
+
+    for (int sobolSamples = 0; sobolSamples < 2; sobolSamples++) {
+      std::vector<color3f>  pixels;
+      int                   done = 0;
+
+      settings.sampler = sobolSamples ? pixelSampling::sobol : pixelSampling::independent;
+
+      for (int numSamples = 1; numSamples <= maxSamples; numSamples *= 2) {
+        renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width,
+                    scene.height, numSamples - done, scene.maxBounce, pixels, nullptr, done);
+        done = numSamples;
+        errors[sobolSamples].push_back(rmse(pixels, numSamples, reference, referenceSamples));
+        medians[sobolSamples].push_back(medianError(pixels, numSamples, reference, referenceSamples));
+      }
+    }
+
+    // log scale, bars grow 4 characters per halving of the median error at 1 spp
+    auto  bar = [&](double error, char c) {
+      return std::string(std::max(0, static_cast<int>(4.0 * log2(medians[0][0] / error))), c);
+    };
+
+    std::cout << names[test] << ", reference " << referenceSamples << " independent spp\n"
+              << "  spp   RMSE independent / sobol    median independent / sobol\n";
+
+    for (size_t i = 0; i < errors[0].size(); i++) {
+      std::cout << "  " << std::setw(3) << (1 << i) << "  " << std::setw(11) << errors[0][i] << " "
+                << std::setw(11) << errors[1][i] << "  " << std::setw(11) << medians[0][i] << " "
+                << std::setw(11) << medians[1][i] << "  " << bar(medians[0][i], '-') << "\n"
+                << std::string(67, ' ') << bar(medians[1][i], '=') << "\n";
+    }
+
+    std::cout << "  rate: RMSE independent spp^" << convergenceRate(errors[0]) << ", sobol spp^"
+              << convergenceRate(errors[1]) << "; median independent spp^" << convergenceRate(medians[0])
+              << ", sobol spp^" << convergenceRate(medians[1]) << "\n";
+  }
+
+  settings.sampler = previous;
+}
+
+/******************************************************************************
+ * denoiser: RMSE and median pixel error of the noisy and denoised shared
+ * scene against a high spp reference, and denoise time with and without
+ * SIMD, also for the AOVs tiled up to 1280x720
+ ******************************************************************************/
+
+void benchDenoiser() {
+  const int             referenceSamples = 512;
+  benchScene            scene = makeBenchScene(192, 108);
+  std::vector<color3f>  reference;
+
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              referenceSamples, scene.maxBounce, reference);
+
+  std::cout << "denoiser, " << scene.width << "x" << scene.height << ", reference " << referenceSamples << " spp, "
+            << simdName(simdLevel()) << ", " << simdLanes(simdLevel()) << " lanes\n";
+
+  for (int numSamples : {4, 16, 64}) {
+    std::vector<color3f>  pixels, denoised;
+    aovBuffers            aovs;
+    double                seconds[2];
+    denoiseSettings       params;
+
+    renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+                numSamples, scene.maxBounce, pixels, nullptr, 0, &aovs);
+
+    for (int simd = 0; simd < 2; simd++) {
+      auto  start = benchClock::now();
+
+      params.isa = simd ? simdLevel() : simdISA::scalar;
+      denoise(pixels, numSamples, aovs, scene.width, scene.height, denoised, params);
+      seconds[simd] = secondsSince(start);
+    }
+
+    std::cout << "  " << numSamples << " spp: RMSE " << rmse(pixels, numSamples, reference, referenceSamples)
+              << " -> " << rmse(denoised, 1, reference, referenceSamples) << ", median "
+              << medianError(pixels, numSamples, reference, referenceSamples) << " -> "
+              << medianError(denoised, 1, reference, referenceSamples) << ", " << seconds[0] * 1000.0
+              << " ms scalar, " << seconds[1] * 1000.0 << " ms SIMD\n";
+
+    if (numSamples != 64)
+      continue;
+
+    // throughput at a typical output size
+    const int             width = 1280, height = 720;
+    std::vector<color3f>  tiledPixels(width * height);
+    aovBuffers            tiledAOVs;
+
+    tiledAOVs.resize(width * height);
+
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        int p = y * width + x;
+        int q = (y % scene.height) * scene.width + x % scene.width;
+
+        tiledPixels[p] = pixels[q];
+        tiledAOVs.albedo[p] = aovs.albedo[q];
+        tiledAOVs.normal[p] = aovs.normal[q];
+        tiledAOVs.depth[p] = aovs.depth[q];
+        tiledAOVs.luminance2[p] = aovs.luminance2[q];
+      }
+    }
+
+    for (int simd = 0; simd < 2; simd++) {
+      auto  start = benchClock::now();
+
+      params.isa = simd ? simdLevel() : simdISA::scalar;
+      denoise(tiledPixels, numSamples, tiledAOVs, width, height, denoised, params);
+      seconds[simd] = secondsSince(start);
+    }
+
+    std::cout << "  " << width << "x" << height << ": " << seconds[0] * 1000.0 << " ms scalar, "
+              << seconds[1] * 1000.0 << " ms SIMD on " << std::thread::hardware_concurrency() << " threads\n";
+  }
+}
+
+/******************************************************************************
+ * film: the row-major renderPass vs tiles of the float film handed to all
+ * threads, at equal samples, then film output time and size per format
+ ******************************************************************************/
+
+void benchFilm() {
+  const int             numSamples = 8;
+  benchScene            scene = makeBenchScene(320, 180);
+  std::vector<color3f>  pixels;
+  film                  image(scene.width, scene.height);
+
+  std::cout << "film, " << scene.width << "x" << scene.height << ", " << numSamples << " spp, "
+            << filmTileSize << "x" << filmTileSize << " tiles, " << std::max(1u, std::thread::hardware_concurrency())
+            << " thread(s)\n";
+
+  auto  start = benchClock::now();
+
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              numSamples, scene.maxBounce, pixels);
+  std::cout << "  renderPass: " << secondsSince(start) << " s\n";
+
+  start = benchClock::now();
+  renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, image, numSamples,
+              scene.maxBounce);
+
+  // same per pixel sample sequences, so both should agree up to summation order
+  float maxDifference = 0;
+
+  for (int y = 0; y < scene.height; y++) {
+    for (int x = 0; x < scene.width; x++) {
+      color3f difference = image.sum(x, y) - pixels[y * scene.width + x];
+
+      maxDifference = std::max(maxDifference, difference.cwiseAbs().maxCoeff());
+    }
+  }
+
+  std::cout << "  renderFilm: " << secondsSince(start) << " s, max difference " << maxDifference << "\n";
+
+  std::vector<uint8_t>  target(scene.width * scene.height * 4);
+  const char*           filenames[3] = {"bench_film.exr", "bench_film_float.exr", "bench_film.pfm"};
+
+  for (int format = 0; format < 4; format++) {
+    start = benchClock::now();
+
+    if (format == 0)
+      image.writeEXR(filenames[0]);
+    else if (format == 1)
+      image.writeEXR(filenames[1], false);
+    else if (format == 2)
+      image.writePFM(filenames[2]);
+    else
+      image.toTarget(target.data(), 4);
+
+    double  seconds = secondsSince(start);
+
+    if (format == 3) {
+      std::cout << "  8 bit target: " << seconds * 1000.0 << " ms\n";
+      break;
+    }
+
+    FILE* file = fopen(filenames[format], "rb");
+    long  size = 0;
+
+    if (file) {
+      fseek(file, 0, SEEK_END);
+      size = ftell(file);
+      fclose(file);
+    }
+
+    std::cout << "  " << filenames[format] << ": " << seconds * 1000.0 << " ms, " << size / 1024 << " KB\n";
+    remove(filenames[format]);
+  }
+}
+
+/******************************************************************************
+ * checkpoints: time of a pass-by-pass render without and with a checkpoint
+ * after every pass, and a resumed render vs an uninterrupted one
+ ******************************************************************************/
+
+void benchCheckpoints() {
+  const int             numPasses = 16;
+  const char*           filename = "bench_film.srtc";
+  benchScene            scene = makeBenchScene(320, 180);
+  film                  plain(scene.width, scene.height, true), checkpointed(plain);
+
+  std::cout << "checkpoints, " << scene.width << "x" << scene.height << " with AOVs, " << numPasses
+            << " passes of 1 spp\n";
+
+  auto  start = benchClock::now();
+
+  for (int pass = 0; pass < numPasses; pass++)
+    renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, plain, 1, scene.maxBounce);
+
+  double  plainSeconds = secondsSince(start);
+  double  snapshotSeconds = 0;
+  int     numSaves = 0;
+
+  {
+    checkpointWriter  writer(filename);
+
+    start = benchClock::now();
+
+    for (int pass = 0; pass < numPasses; pass++) {
+      renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, checkpointed, 1,
+                  scene.maxBounce);
+
+      auto  saveStart = benchClock::now();
+
+      numSaves += writer.save(checkpointed, numPasses);
+      snapshotSeconds += secondsSince(saveStart);
+    }
+
+    writer.wait();
+
+    std::cout << "  no checkpoints: " << plainSeconds << " s\n";
+    std::cout << "  checkpoint every pass: " << secondsSince(start) << " s, " << writer.numWritten() << " of "
+              << numSaves << " accepted saves written, " << numPasses - numSaves << " skipped, "
+              << snapshotSeconds / numPasses * 1000.0 << " ms render thread time per save\n";
+  }
+
+  // stop halfway, resume from the file and finish
+  film  halfway(scene.width, scene.height, true), resumed(scene.width, scene.height, true);
+  int   targetSamples = 0;
+
+  for (int pass = 0; pass < numPasses / 2; pass++)
+    renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, halfway, 1, scene.maxBounce);
+
+  writeCheckpoint(filename, halfway, numPasses, generatorSeeds());
+
+  start = benchClock::now();
+
+  if (!readCheckpoint(filename, resumed, targetSamples)) {
+    remove(filename);
+    return;
+  }
+
+  double  readSeconds = secondsSince(start);
+
+  while (static_cast<int>(resumed.maxCount()) < targetSamples)
+    renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, resumed, 1, scene.maxBounce);
+
+  float maxDifference = 0;
+
+  for (int y = 0; y < scene.height; y++) {
+    for (int x = 0; x < scene.width; x++)
+      maxDifference = std::max(maxDifference, (resumed.sum(x, y) - plain.sum(x, y)).cwiseAbs().maxCoeff());
+  }
+
+  std::cout << "  resumed at " << numPasses / 2 << " spp (read in " << readSeconds * 1000.0 << " ms): max difference "
+            << maxDifference << " to the uninterrupted render\n";
+
+  remove(filename);
+}
+
+/******************************************************************************
+ * progressive: time until the first low resolution preview and after every
+ * pass of 1, 1, 2, 4, ... spp with its RMSE, vs one pass of all samples
+ ******************************************************************************/
+
+void benchProgressive() {
+  const int             referenceSamples = 256;
+  const int             targetSamples = 64;
+  const int             previewScale = 8;
+  benchScene            scene = makeBenchScene(160, 90);
+  std::vector<color3f>  reference, pixels;
+  std::vector<uint8_t>  target(scene.width * scene.height * 4);
+
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              referenceSamples, scene.maxBounce, reference);
+
+  std::cout << "progressive, " << scene.width << "x" << scene.height << ", " << targetSamples << " spp, reference "
+            << referenceSamples << " spp\n";
+
+  film  single(scene.width, scene.height);
+  auto  start = benchClock::now();
+
+  renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, single, targetSamples,
+              scene.maxBounce);
+  single.toTarget(target.data(), 4);
+  std::cout << "  single pass: " << secondsSince(start) << " s\n";
+
+  film  image(scene.width, scene.height);
+  film  preview(scene.width / previewScale, scene.height / previewScale);
+
+  start = benchClock::now();
+  renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, preview, 1, scene.maxBounce);
+  preview.toTarget(target.data(), 4, scene.width, scene.height);
+  std::cout << "  1/" << previewScale << " preview: " << secondsSince(start) * 1000.0 << " ms\n";
+
+  for (int done = 0; done < targetSamples; done = image.maxCount()) {
+    renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, image,
+                progressivePassSamples(done, targetSamples, targetSamples), scene.maxBounce);
+    image.toTarget(target.data(), 4);
+
+    int   numSamples = image.gather(pixels);
+
+    std::cout << "  " << std::setw(3) << numSamples << " spp after " << secondsSince(start) << " s, RMSE "
+              << rmse(pixels, numSamples, reference, referenceSamples) << "\n";
+  }
+}
+
+/******************************************************************************
+ * budget: spp and time predicted after 2 spp vs reached for time budgets,
+ * and the film's error estimate vs the luminance error against a reference
+ ******************************************************************************/
+
+// RMS luminance error of image's means relative to the reference's mean luminance
+float relativeLuminanceError(const film& image, const std::vector<color3f>& reference, int referenceSamples) {
+  double  sum2 = 0, mean = 0;
+
+  for (int y = 0; y < image.height(); y++) {
+    for (int x = 0; x < image.width(); x++) {
+      float l = luminance(color3f(reference[y * image.width() + x] / referenceSamples));
+      float d = luminance(image.mean(x, y)) - l;
+
+      sum2 += d * d;
+      mean += l;
+    }
+  }
+
+  return static_cast<float>(sqrt(sum2 / mean / mean * image.width() * image.height()));
+}
+
+void benchBudget() {
+  const int             referenceSamples = 256;
+  benchScene            scene = makeBenchScene(160, 90);
+  std::vector<color3f>  reference;
+
+  renderPass(scene.world, scene.materials, scene.lights, scene.cam, scene.background, scene.width, scene.height,
+              referenceSamples, scene.maxBounce, reference);
+
+  std::cout << "budgets, " << scene.width << "x" << scene.height << ", reference " << referenceSamples << " spp\n";
+
+  for (int test = 0; test < 4; test++) {
+    renderBudget      budget;
+    budgetPrediction  prediction = {0, 0, 0, false};
+    film              image(scene.width, scene.height);
+    int               targetSamples = unlimitedSamples;
+
+    if (test < 2)
+      budget.seconds = test ? 4.0 : 1.0;
+    else if (test == 2)
+      budget.error = 0.1f;
+    else {
+      // a target the budget can't reach
+      budget.seconds = 1.0;
+      targetSamples = 256;
+    }
+
+    double  seconds = renderProgressive(scene.world, scene.materials, scene.lights, scene.cam, scene.background,
+                                        image, targetSamples, 64, budget, scene.maxBounce, nullptr,
+                                        [&](double elapsed, double secondsPerSample) {
+      if (budget.seconds > 0 && image.maxCount() == 2)
+        prediction = predictBudget(image, budget, targetSamples, elapsed, secondsPerSample);
+    });
+
+    if (budget.seconds > 0)
+      std::cout << "  " << budget.seconds << " s" << (targetSamples < unlimitedSamples ? " for 256 spp" : "")
+                << ": predicted " << prediction.samples << " spp in " << prediction.seconds << " s"
+                << (targetSamples < unlimitedSamples && !prediction.reachesTarget ? " (short of target)" : "")
+                << ", reached ";
+    else
+      std::cout << "  error " << budget.error << ": reached ";
+
+    std::cout << image.maxCount() << " spp in " << seconds << " s, estimated error " << image.relativeError()
+              << ", measured " << relativeLuminanceError(image, reference, referenceSamples) << "\n";
+  }
+}
+
+/******************************************************************************
+ * shards: a frame split across worker processes by tiles and by sample
+ * ranges, each writing a partial film, merged and compared to one process
+ ******************************************************************************/
+
+void benchShards() {
+  const int             numSamples = 16;
+  const int             numWorkers = 4;
+  benchScene            scene = makeBenchScene(160, 90);
+  film                  single(scene.width, scene.height);
+  auto                  start = benchClock::now();
+
+  renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, single, numSamples,
+              scene.maxBounce);
+
+  std::cout << "shards, " << scene.width << "x" << scene.height << ", " << numSamples << " spp, " << numWorkers
+            << " worker processes\n";
+  std::cout << "  one process: " << secondsSince(start) << " s\n";
+
+  for (bool bySamples : {false, true}) {
+    std::vector<std::string>  filenames;
+    std::vector<pid_t>        workers;
+    bool                      ok = true;
+
+    start = benchClock::now();
+
+    for (int i = 0; i < numWorkers; i++) {
+      filenames.push_back("bench_shard" + std::to_string(i) + ".srtc");
+
+      pid_t pid = fork();
+
+      if (pid == 0) {
+        film        partial(scene.width, scene.height);
+        renderShard shard;
+        int         shardSamples = splitShard(shard, i, numWorkers, bySamples, numSamples);
+
+        partial.setShard(shard);
+        renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, partial, shardSamples,
+                    scene.maxBounce);
+        _exit(writeCheckpoint(filenames[i], partial, shardSamples, generatorSeeds()) ? 0 : 1);
+      }
+
+      workers.push_back(pid);
+    }
+
+    for (pid_t pid : workers) {
+      int status = 0;
+
+      ok = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+    }
+
+    double  renderSeconds = secondsSince(start);
+    film    merged(0, 0);
+
+    start = benchClock::now();
+    ok = ok && mergeFilms(filenames, merged);
+
+    for (const auto& filename : filenames)
+      remove(filename.c_str());
+
+    if (!ok) {
+      std::cout << "  " << (bySamples ? "samples" : "tiles") << ": a worker failed\n";
+      continue;
+    }
+
+    // same sample indices per pixel as the single process, only summed in a different order
+    float     maxDifference = 0;
+    uint32_t  minCount = numSamples, maxCount = 0;
+
+    for (int y = 0; y < scene.height; y++) {
+      for (int x = 0; x < scene.width; x++) {
+        maxDifference = std::max(maxDifference, (merged.mean(x, y) - single.mean(x, y)).cwiseAbs().maxCoeff());
+        minCount = std::min(minCount, merged.count(x, y));
+        maxCount = std::max(maxCount, merged.count(x, y));
+      }
+    }
+
+    std::cout << "  " << (bySamples ? "samples" : "tiles") << ": " << renderSeconds << " s, merged in "
+              << secondsSince(start) * 1000.0 << " ms, " << minCount << " to " << maxCount
+              << " spp per pixel, max difference " << maxDifference << " to one process\n";
+  }
+}
+
+/******************************************************************************
+ * daemon: 100 short jobs, each loading its scene and building the BVH, vs
+ * sent to a render daemon over a localhost socket that keeps the scene
+ * resident. The scene file names a procedural sphere field standing in for a
+ * glTF file, so loading costs a BVH build over some thousand primitives
+ ******************************************************************************/
+
+bool loadSphereField(const std::string& filename, residentScene& scene) {
+  FILE*   file = fopen(filename.c_str(), "r");
+  int     numSpheres = 0;
+  unsigned seed = 0;
+
+  if (!file)
+    return false;
+
+  bool  ok = fscanf(file, "spheres %d %u", &numSpheres, &seed) == 2;
+
+  fclose(file);
+
+  if (!ok)
+    return false;
+
+  std::mt19937                          generator(seed);
+  std::uniform_real_distribution<float> uniform(0, 1.0f);
+  hittableList                          objects;
+  auto                                  checkerTex = make_shared<checker>(color3f(0.2f, 0.3f, 0.1f),
+                                                                          color3f(0.9f, 0.9f, 0.9f));
+
+  objects.add(make_shared<sphere>(vec3f(0, -1000.0f, 0), vec3f(0, -1000.0f, 0), 0, 1.0f, 1000.0f,
+                                  scene.materials.add(pbrMetallicRoughness(checkerTex))));
+
+  for (int i = 0; i < numSpheres; i++) {
+    vec3f center(20.0f * uniform(generator) - 10.0f, 0.1f, 20.0f * uniform(generator) - 10.0f);
+    auto  albedo = make_shared<solidColor>(255.0f * uniform(generator), 255.0f * uniform(generator),
+                                            255.0f * uniform(generator));
+
+    objects.add(make_shared<sphere>(center, center, 0, 1.0f, 0.1f,
+                                    scene.materials.add(pbrMetallicRoughness(albedo, vec4f(1.0f, 1.0f, 1.0f, 1.0f),
+                                                                            uniform(generator), 0.5f))));
+  }
+
+  scene.lights = buildLights(objects, scene.materials);
+  scene.world.add(make_shared<bvhNode>(objects, 0, 1));
+
+  return true;
+}
+
+// method path on 127.0.0.1:port, false if the connection fails or the status isn't 200
+bool httpRequest(int port, const std::string& method, const std::string& path, std::string& response) {
+  sockaddr_in address = {};
+  int         connection = socket(AF_INET, SOCK_STREAM, 0);
+  std::string request = method + " " + path + " HTTP/1.0\r\nContent-Length: 0\r\n\r\n";
+  char        buffer[4096];
+  ssize_t     size;
+
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(static_cast<uint16_t>(port));
+  response.clear();
+
+  if (connection < 0 || connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      send(connection, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+    if (connection >= 0)
+      close(connection);
+
+    return false;
+  }
+
+  while ((size = recv(connection, buffer, sizeof(buffer), 0)) > 0)
+    response.append(buffer, size);
+
+  close(connection);
+
+  return response.compare(0, 12, "HTTP/1.0 200") == 0;
+}
+
+void benchDaemon() {
+  const int           numJobs = 100;
+  const int           numSpheres = 4000;
+  const int           width = 64, height = 36, numSamples = 1;
+  const std::string   sceneFilename = "bench_daemon.scene";
+  const std::string   outputFilename = "bench_daemon.pfm";
+  std::vector<double> cold, daemon;
+  FILE*               file = fopen(sceneFilename.c_str(), "w");
+
+  if (!file) {
+    std::cout << "daemon: can't write " << sceneFilename << "\n";
+    return;
+  }
+
+  fprintf(file, "spheres %d 1\n", numSpheres);
+  fclose(file);
+
+  // each job looks at the field from another angle
+  auto  jobEye = [](int i) {
+    float angle = 2.0f * pi * i / numJobs;
+
+    return vec3f(8.0f * std::sin(angle), 3.0f, 8.0f * std::cos(angle));
+  };
+
+  std::cout << "daemon, " << numJobs << " jobs of " << width << "x" << height << ", " << numSamples << " spp, "
+            << numSpheres << " spheres\n";
+
+  auto  start = benchClock::now();
+
+  for (int i = 0; i < numJobs; i++) {
+    auto          jobStart = benchClock::now();
+    residentScene scene;
+    film          image(width, height);
+    camera        cam(jobEye(i), vec3f(0, 0, 0), vec3f(0, 1.0f, 0), 70.0f, static_cast<float>(width) / height, 0,
+                      10.0f, 0, 1.0f);
+
+    loadSphereField(sceneFilename, scene);
+    cam.setImageHeight(height);
+    renderFilm(scene.world, scene.materials, scene.lights, cam, scene.background, image, numSamples, 4);
+    image.writePFM(outputFilename);
+    cold.push_back(secondsSince(jobStart));
+  }
+
+  std::cout << "  load per job: " << secondsSince(start) << " s\n";
+
+  {
+    renderDaemon  renderer(".", loadSphereField);
+    int           port = renderer.listen(0);
+    std::thread   server([&renderer] { renderer.serve(); });
+    std::string   response;
+    int           failed = 0;
+
+    start = benchClock::now();
+
+    for (int i = 0; i < numJobs && port > 0; i++) {
+      auto        jobStart = benchClock::now();
+      vec3f       eye = jobEye(i);
+      std::string path = "/render?scene=" + sceneFilename + "&out=" + outputFilename + "&width=" +
+                          std::to_string(width) + "&height=" + std::to_string(height) + "&spp=" +
+                          std::to_string(numSamples) + "&eye=" + std::to_string(eye(0)) + "," +
+                          std::to_string(eye(1)) + "," + std::to_string(eye(2)) + "&lookat=0,0,0";
+
+      failed += !httpRequest(port, "POST", path, response);
+      daemon.push_back(secondsSince(jobStart));
+    }
+
+    double  seconds = secondsSince(start);
+
+    if (port > 0)
+      httpRequest(port, "POST", "/stop", response);
+
+    server.join();
+
+    std::cout << "  daemon:       " << seconds << " s, " << renderer.numResident() << " scene resident, "
+              << failed << " failed\n";
+  }
+
+  remove(sceneFilename.c_str());
+  remove(outputFilename.c_str());
+
+  auto  median = [](std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    return values.empty() ? 0 : values[values.size() / 2];
+  };
+
+  std::cout << "  median job: " << median(cold) * 1000.0 << " ms cold, " << median(daemon) * 1000.0
+            << " ms through the daemon, first daemon job " << (daemon.empty() ? 0 : daemon[0]) * 1000.0 << " ms\n";
+}
+
+/******************************************************************************
+ * sequence: 24 frames of a camera orbit with 3 instances of a sphere cluster
+ * moving through the bench scene. Re-creating the moving spheres in world
+ * space and rebuilding their BVH every frame, run serially, vs instances
+ * over one object space BVH, serially and pipelined
+ ******************************************************************************/
+
+void benchSequence() {
+  const int             numFrames = 24;
+  const int             numSamples = 4;
+  const int             numClusterSpheres = 1500;
+  const int             numInstances = 3;
+  const float           fps = 24.0f;
+  benchScene            scene = makeBenchScene(160, 90);
+  cameraPath            path = cameraPath::orbit(vec3f(0, 1.0f, 0), 7.0f, 1.5f, 50.0f, numFrames / fps);
+  std::vector<transformPath> motions(numInstances);
+  std::vector<std::pair<vec3f, materialId>> cluster;
+  std::mt19937          generator(7);
+  std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+  hittableList          clusterObjects;
+  const float           clusterRadius = 0.04f;
+
+  for (int i = 0; i < numClusterSpheres; i++) {
+    vec3f       center(uniform(generator), uniform(generator), uniform(generator));
+    materialId  mat = scene.materials.add(pbrMetallicRoughness(
+                        make_shared<solidColor>(127.5f + 127.5f * center(0), 127.5f + 127.5f * center(1), 200.0f),
+                        vec4f(1.0f, 1.0f, 1.0f, 1.0f), 0, 0.5f));
+
+    cluster.emplace_back(0.5f * center, mat);
+    clusterObjects.add(make_shared<sphere>(0.5f * center, 0.5f * center, 0, 1.0f, clusterRadius, mat));
+  }
+
+  // each instance circles the middle sphere once, spinning and pulsing
+  for (int i = 0; i < numInstances; i++) {
+    for (int k = 0; k <= 4; k++) {
+      float angle = 2.0f * pi * (k / 4.0f + static_cast<float>(i) / numInstances);
+
+      motions[i].add({k * numFrames / fps / 4.0f, vec3f(2.5f * std::sin(angle), 1.2f + 0.3f * i, 2.5f * std::cos(angle)),
+                      quatf(Eigen::AngleAxisf(angle, vec3f::UnitY())), 0.8f + 0.2f * (k % 2)});
+    }
+  }
+
+  std::cout << "sequence, " << numFrames << " frames of " << scene.width << "x" << scene.height << ", "
+            << numSamples << " spp, " << numInstances << " instances of " << numClusterSpheres << " spheres\n";
+
+  auto  report = [](const char* name, const std::vector<sequenceTiming>& timings, double seconds) {
+    double  setup = 0, render = 0, encode = 0;
+
+    for (const auto& t : timings) {
+      setup += t.setup;
+      render += t.render;
+      encode += t.encode;
+    }
+
+    std::cout << "  " << name << ": " << seconds << " s, per frame setup " << setup / timings.size() * 1000.0
+              << " ms, render " << render / timings.size() * 1000.0 << " ms, encode "
+              << encode / timings.size() * 1000.0 << " ms\n";
+  };
+
+  // world space geometry, what rendering each frame on its own has to build
+  auto  worldSpaceFrame = [&](int f, hittableList& world) {
+    hittableList  moving;
+
+    for (int i = 0; i < numInstances; i++) {
+      instanceTransform xf = motions[i].at(f / fps);
+
+      for (const auto& s : cluster) {
+        vec3f center = xf.toWorld(s.first);
+
+        moving.add(make_shared<sphere>(center, center, 0, 1.0f, clusterRadius * xf.scale, s.second));
+      }
+    }
+
+    world = scene.world;
+    world.add(make_shared<bvhNode>(moving, 0, 1));
+  };
+
+  {
+    std::vector<sequenceTiming> timings(numFrames);
+    auto                        start = benchClock::now();
+
+    for (int f = 0; f < numFrames; f++) {
+      auto          stageStart = benchClock::now();
+      hittableList  world;
+      cameraKey     key = path.at(f / fps);
+      camera        cam(key.eye, key.lookAt, vec3f(0, 1.0f, 0), key.fov,
+                        static_cast<float>(scene.width) / scene.height, 0, 10.0f, 0, 1.0f);
+      film          image(scene.width, scene.height);
+
+      cam.setImageHeight(scene.height);
+      worldSpaceFrame(f, world);
+      timings[f].setup = secondsSince(stageStart);
+
+      stageStart = benchClock::now();
+      renderFilm(world, scene.materials, scene.lights, cam, scene.background, image, numSamples, scene.maxBounce);
+      timings[f].render = secondsSince(stageStart);
+
+      std::vector<uint8_t>  target(4 * scene.width * scene.height);
+
+      stageStart = benchClock::now();
+      image.toTarget(target.data(), 4);
+      writePNG("bench_sequence.png", scene.width, scene.height, target.data());
+      timings[f].encode = secondsSince(stageStart);
+    }
+
+    report("world space rebuild, serial", timings, secondsSince(start));
+  }
+
+  shared_ptr<hittable>  clusterBVH = make_shared<bvhNode>(clusterObjects, 0, 1);
+
+  for (bool pipelined : {false, true}) {
+    animatedScene sequence(scene.world, scene.lights, path);
+
+    for (const auto& motion : motions)
+      sequence.addInstance(clusterBVH, motion);
+
+    auto  start = benchClock::now();
+    auto  timings = renderSequence(sequence, scene.materials, scene.background, scene.width, scene.height, numFrames,
+                                    fps, numSamples, scene.maxBounce, "bench_sequence.png", pipelined);
+
+    if (timings.empty()) {
+      std::cout << "  can't write bench_sequence.png\n";
+      return;
+    }
+
+    report(pipelined ? "instances, pipelined       " : "instances, serial          ", timings, secondsSince(start));
+  }
+
+  // instances have to find the same surfaces as world space geometry. Sample indices are the same,
+  // rounding in the transforms only sends the odd path elsewhere
+  animatedScene         sequence(scene.world, scene.lights, path);
+  film                  instanced(scene.width, scene.height), worldSpace(scene.width, scene.height);
+  hittableList          world;
+  float                 maxDifference = 0;
+  int                   numDifferent = 0;
+
+  for (const auto& motion : motions)
+    sequence.addInstance(clusterBVH, motion);
+
+  sequenceFrame frame = sequence.setup(numFrames / 2, numFrames / 2 / fps, scene.width, scene.height);
+
+  worldSpaceFrame(numFrames / 2, world);
+  renderFilm(*frame.world, scene.materials, scene.lights, frame.cam, scene.background, instanced, numSamples,
+              scene.maxBounce);
+  renderFilm(world, scene.materials, scene.lights, frame.cam, scene.background, worldSpace, numSamples,
+              scene.maxBounce);
+
+  for (int y = 0; y < scene.height; y++) {
+    for (int x = 0; x < scene.width; x++) {
+      float difference = (instanced.mean(x, y) - worldSpace.mean(x, y)).cwiseAbs().maxCoeff();
+
+      numDifferent += difference > 1e-3f;
+      maxDifference = std::max(maxDifference, difference);
+    }
+  }
+
+  remove("bench_sequence.png");
+  std::cout << "  frame " << numFrames / 2 << " instanced vs world space: " << numDifferent << " of "
+            << scene.width * scene.height << " pixels differ, by up to " << maxDifference << "\n";
+}
+
+/******************************************************************************
+ * encode: PNG and EXR output of 720p, 4K and 16K frames. stb_image_write and
+ * one deflate thread over a whole 8 bit frame, with zlib's match search and
+ * with run lengths, vs bands streamed through pngStream's parallel chunks and
+ * exrStream. The image is a smooth gradient
+ * with a few bits of per pixel noise, about what a path traced frame
+ * compresses like, generated a band at a time for the streamed runs
+ ******************************************************************************/
+
+void benchEncode() {
+  const int   bandRows = 2 * filmTileSize;
+  const int   sizes[3][2] = {{1280, 720}, {3840, 2160}, {15360, 8640}};
+
+  auto  fillRows = [](uint8_t* rows, int width, int height, int firstRow, int numRows) {
+    uint32_t  state = 0x9e3779b9u * (firstRow + 1);
+
+    for (int y = 0; y < numRows; y++) {
+      for (int x = 0; x < width; x++) {
+        uint8_t*  p = &rows[4 * (static_cast<size_t>(y) * width + x)];
+
+        state = state * 1664525u + 1013904223u;
+        p[0] = static_cast<uint8_t>(200 * x / width + (state >> 29));
+        p[1] = static_cast<uint8_t>(200 * (firstRow + y) / height + ((state >> 26) & 7));
+        p[2] = static_cast<uint8_t>(96 + ((state >> 23) & 7));
+        p[3] = 255;
+      }
+    }
+  };
+
+  auto  fileSize = [](const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    long  size = 0;
+
+    if (file) {
+      fseek(file, 0, SEEK_END);
+      size = ftell(file);
+      fclose(file);
+    }
+
+    return size / (1024.0 * 1024.0);
+  };
+
+  std::cout << "encode, PNG and EXR, " << std::thread::hardware_concurrency() << " hardware threads\n";
+
+  for (const auto& size : sizes) {
+    int                   width = size[0], height = size[1];
+    std::vector<uint8_t>  frame(4 * static_cast<size_t>(width) * height);
+    double                frameMB = frame.size() / (1024.0 * 1024.0);
+
+    fillRows(frame.data(), width, height, 0, height);
+    std::cout << "  " << width << "x" << height << ", " << frameMB << " MB of 8 bit pixels\n";
+
+    auto  start = benchClock::now();
+
+    stbi_write_png("bench_encode.png", width, height, 4, frame.data(), 4 * width);
+    std::cout << "    stb, whole frame:         " << secondsSince(start) << " s, "
+              << fileSize("bench_encode.png") << " MB\n";
+
+    for (bool matchSearch : {true, false}) {
+      pngStream png("bench_encode.png", width, height, 1, matchSearch);
+
+      start = benchClock::now();
+      png.writeRows(frame.data(), height);
+      png.finish();
+      std::cout << (matchSearch ? "    zlib default, one thread: " : "    run lengths, one thread:  ")
+                << secondsSince(start) << " s, " << fileSize("bench_encode.png") << " MB\n";
+    }
+
+    frame = std::vector<uint8_t>();
+
+    {
+      pngStream             png("bench_encode.png", width, height);
+      std::vector<uint8_t>  band(4 * static_cast<size_t>(width) * bandRows);
+
+      start = benchClock::now();
+
+      for (int y = 0; y < height; y += bandRows) {
+        int numRows = std::min(bandRows, height - y);
+
+        fillRows(band.data(), width, height, y, numRows);
+        png.writeRows(band.data(), numRows);
+      }
+
+      png.finish();
+      std::cout << "    streamed, all threads:    " << secondsSince(start) << " s, "
+                << fileSize("bench_encode.png") << " MB, " << band.size() / (1024.0 * 1024.0)
+                << " MB band + up to " << std::max(2u, std::thread::hardware_concurrency())
+                << " 1 MB chunks in flight\n";
+    }
+
+    {
+      exrStream             exr("bench_encode.exr", width, height);
+      std::vector<uint8_t>  band(4 * static_cast<size_t>(width) * bandRows);
+      std::vector<color3f>  linear(static_cast<size_t>(width) * bandRows);
+
+      start = benchClock::now();
+
+      for (int y = 0; y < height; y += bandRows) {
+        int numRows = std::min(bandRows, height - y);
+
+        fillRows(band.data(), width, height, y, numRows);
+
+        for (size_t p = 0; p < static_cast<size_t>(width) * numRows; p++)
+          linear[p] = color3f(band[4 * p], band[4 * p + 1], band[4 * p + 2]) / 255.0f;
+
+        exr.writeRows(linear.data(), numRows);
+      }
+
+      exr.finish();
+      std::cout << "    EXR half, streamed bands: " << secondsSince(start) << " s, "
+                << fileSize("bench_encode.exr") << " MB\n";
+    }
+
+    remove("bench_encode.png");
+    remove("bench_encode.exr");
+  }
+}
+
+/******************************************************************************
+ * schedule: the bench scene with a dense cluster of small metal spheres low
+ * in the frame, so the expensive tiles come last in index order. A 1 spp
+ * pre-pass measures tile costs, then 16 spp passes run with whole tiles in
+ * index order and as planned from the pre-pass, with per thread timelines.
+ * The same tile costs are replayed on 8 simulated threads, for machines with
+ * fewer cores than that
+ ******************************************************************************/
+
+// dynamic dispatch as in renderFilm: each item goes to the thread that frees up first
+std::vector<workSpan> simulateSchedule(const std::vector<tileWork>& items, const std::vector<double>& itemSeconds,
+                                        int numThreads) {
+  std::vector<double>   freeAt(numThreads, 0);
+  std::vector<workSpan> spans;
+
+  for (size_t w = 0; w < items.size(); w++) {
+    int thread = static_cast<int>(std::min_element(freeAt.begin(), freeAt.end()) - freeAt.begin());
+
+    spans.push_back({thread, static_cast<uint32_t>(w), freeAt[thread], freeAt[thread] + itemSeconds[w]});
+    freeAt[thread] += itemSeconds[w];
+  }
+
+  return spans;
+}
+
+// a row per thread over [0, scale) seconds, # where it's busy, and its utilization of the pass
+void printTimeline(const std::vector<workSpan>& spans, int numThreads, double scale) {
+  const int           columns = 60;
+  double              end = 0;
+  std::vector<double> busy(numThreads, 0);
+  std::vector<std::vector<double>>  covered(numThreads, std::vector<double>(columns, 0));
+
+  for (const auto& span : spans) {
+    end = std::max(end, span.end);
+    busy[span.thread] += span.end - span.start;
+
+    for (int c = 0; c < columns; c++) {
+      double  from = scale * c / columns, to = scale * (c + 1) / columns;
+
+      covered[span.thread][c] += std::max(0.0, std::min(to, span.end) - std::max(from, span.start));
+    }
+  }
+
+  double  total = 0;
+
+  for (int t = 0; t < numThreads; t++) {
+    std::string row;
+
+    for (int c = 0; c < columns; c++)
+      row += covered[t][c] > 0.5 * scale / columns ? '#' : scale * c / columns < end ? '.' : ' ';
+
+    total += busy[t];
+    std::cout << "      thread " << std::setw(2) << t << " |" << row << "| " << std::setw(3)
+              << static_cast<int>(100.0 * busy[t] / end + 0.5) << "%\n";
+  }
+
+  std::cout << "      pass " << end << " s, mean utilization " << static_cast<int>(100.0 * total / (end * numThreads) + 0.5)
+            << "%\n";
+}
+
+void benchSchedule() {
+  const int             numSamples = 16;
+  const int             simulatedThreads = 8;
+  benchScene            scene = makeBenchScene(320, 180);
+  hittableList          cluster;
+  std::mt19937          generator(11);
+  std::uniform_real_distribution<float> uniform(0, 1.0f);
+  auto                  chrome = scene.materials.add(metal(color3f(0.9f, 0.9f, 0.9f), 0.05f));
+
+  for (int i = 0; i < 2000; i++) {
+    vec3f center(1.2f + 2.4f * uniform(generator), 0.05f + 0.6f * uniform(generator), 0.8f + 1.6f * uniform(generator));
+
+    cluster.add(make_shared<sphere>(center, center, 0, 1.0f, 0.05f, chrome));
+  }
+
+  scene.world.add(make_shared<bvhNode>(cluster, 0, 1));
+
+  film          prepass(scene.width, scene.height);
+  tileSchedule  measured;
+  auto          start = benchClock::now();
+
+  renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, prepass, 1, scene.maxBounce,
+              nullptr, &measured);
+
+  double        prepassSeconds = secondsSince(start);
+  tileSchedule  indexOrder, costOrder = measured;
+  film          before(scene.width, scene.height), after(scene.width, scene.height);
+  double        minCost = infinity, maxCost = 0;
+
+  for (double cost : measured.tileCost) {
+    minCost = std::min(minCost, cost);
+    maxCost = std::max(maxCost, cost);
+  }
+
+  std::cout << "schedule, " << scene.width << "x" << scene.height << ", " << numSamples << " spp, "
+            << prepass.numTiles() << " tiles, " << measured.numThreads << " hardware threads\n";
+  std::cout << "  1 spp pre-pass: " << prepassSeconds << " s, tile costs " << minCost * 1000.0 << " to "
+            << maxCost * 1000.0 << " ms per sample, " << costOrder.items.size() << " work items planned\n";
+
+  renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, before, numSamples,
+              scene.maxBounce, nullptr, &indexOrder);
+  renderFilm(scene.world, scene.materials, scene.lights, scene.cam, scene.background, after, numSamples,
+              scene.maxBounce, nullptr, &costOrder);
+
+  double  scale = 0;
+
+  for (const auto& span : indexOrder.timeline)
+    scale = std::max(scale, span.end);
+
+  std::cout << "    whole tiles in index order:\n";
+  printTimeline(indexOrder.timeline, indexOrder.numThreads, scale);
+  std::cout << "    planned from the pre-pass:\n";
+  printTimeline(costOrder.timeline, costOrder.numThreads, scale);
+
+  // the index order pass's own measurements stand in for true costs, the plan only knows the pre-pass
+  std::vector<tileWork> wholeTiles = indexOrderWork(before);
+  std::vector<double>   wholeSeconds, plannedSeconds;
+
+  planTiles(measured, before, simulatedThreads);
+
+  for (const auto& work : wholeTiles)
+    wholeSeconds.push_back(indexOrder.tileCost[work.tile] * numSamples);
+
+  for (const auto& work : measured.items) {
+    plannedSeconds.push_back(indexOrder.tileCost[work.tile] * numSamples * (work.rowEnd - work.rowBegin) /
+                              before.tile(work.tile).height);
+  }
+
+  auto    simulatedBefore = simulateSchedule(wholeTiles, wholeSeconds, simulatedThreads);
+  auto    simulatedAfter = simulateSchedule(measured.items, plannedSeconds, simulatedThreads);
+
+  scale = 0;
+
+  for (const auto& span : simulatedBefore)
+    scale = std::max(scale, span.end);
+
+  std::cout << "  " << simulatedThreads << " simulated threads\n";
+  std::cout << "    whole tiles in index order:\n";
+  printTimeline(simulatedBefore, simulatedThreads, scale);
+  std::cout << "    planned from the pre-pass, " << measured.items.size() << " work items:\n";
+  printTimeline(simulatedAfter, simulatedThreads, scale);
+}
+
+// returns process exit code, usage: sexy-raytracer --bench <name>
+int runBenchmark(const std::string& name) {
+  if (name == "texture")
+    benchTextureLookup();
+  else if (name == "texcache")
+    benchTextureCache();
+  else if (name == "bc")
+    benchBlockCompression();
+  else if (name == "bsdf")
+    benchBSDFSampling();
+  else if (name == "nee")
+    benchNextEvent();
+  else if (name == "lights")
+    benchManyLights();
+  else if (name == "env")
+    benchEnvironment();
+  else if (name == "materials")
+    benchMaterialDispatch();
+  else if (name == "shading")
+    benchBatchShading();
+  else if (name == "variants")
+    benchMaterialVariants();
+  else if (name == "bake")
+    benchMaterialBake();
+  else if (name == "guiding")
+    benchPathGuiding();
+  else if (name == "caustics")
+    benchCaustics();
+  else if (name == "sampler")
+    benchSamplers();
+  else if (name == "denoise")
+    benchDenoiser();
+  else if (name == "film")
+    benchFilm();
+  else if (name == "checkpoint")
+    benchCheckpoints();
+  else if (name == "progressive")
+    benchProgressive();
+  else if (name == "budget")
+    benchBudget();
+  else if (name == "shards")
+    benchShards();
+  else if (name == "daemon")
+    benchDaemon();
+  else if (name == "sequence")
+    benchSequence();
+  else if (name == "encode")
+    benchEncode();
+  else if (name == "schedule")
+    benchSchedule();
+  else {
+    std::cerr << "Unknown benchmark '" << name << "', expected one of: texture texcache bc bsdf nee lights env materials shading variants bake guiding caustics sampler denoise film checkpoint progressive budget shards daemon sequence encode schedule\n";
+    return 1;
+  }
+
+  return 0;
+}
+
+#endif
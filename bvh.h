@@ -25,6 +25,9 @@ class bvhNode : public hittable {
     // indexed tree for compute shaders
     virtual int   populateVector(class shared_ptr<hittableVector> hittableVector) const override;
 
+    virtual void  collectLights(const materialTable& materials,
+                                std::vector<shared_ptr<hittable>>& lights) const override;
+
   public:
     shared_ptr<hittable>  left;
     shared_ptr<hittable>  right;
@@ -109,6 +112,20 @@ bool bvhNode::boundingBox(float time0, float time1, aabb &outputBox) const {
   return true;
 }
 
+void bvhNode::collectLights(const materialTable& materials,
+                              std::vector<shared_ptr<hittable>>& lights) const {
+  for (const auto& child : {left, right}) {
+    if (child->isEmitter(materials))
+      lights.push_back(child);
+    else
+      child->collectLights(materials, lights);
+
+    // single object leaves store it on both sides
+    if (left == right)
+      break;
+  }
+}
+
 int bvhNode::populateVector(shared_ptr<hittableVector> hittableVector) const {
   hittableIndexed entry;
   int             index = hittableVector->objects.size();
@@ -35,6 +35,14 @@ class camera {
       lensRadius = aperture / 2.0f;
       t0 = time0;
       t1 = time1;
+
+      halfHeight = h;
+      pixelSpread = 0;
+    }
+
+    // angle subtended by one pixel, starts each ray cone for texture filtering
+    void setImageHeight(int imageHeight) {
+      pixelSpread = atanf(2.0f * halfHeight / imageHeight);
     }
 
     ray getRay(float s, float t) {
@@ -43,7 +51,7 @@ class camera {
 
       return ray(origin + offset,
                   lleft + s * horizontal + t * vertical - origin - offset,
-                  randomFloat(t0, t1));
+                  randomFloat(t0, t1), 0, pixelSpread);
 
       // no focus distance version
       //return ray(origin, lleft + s * horizontal + t * vertical - origin);
@@ -58,6 +66,8 @@ class camera {
     vec3f   hor;
     vec3f   vert;
     float   lensRadius;
+    float   halfHeight;
+    float   pixelSpread;
     float   t0;
     float   t1;
 };
@@ -0,0 +1,280 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "film.h"
+
+// save main's film every checkpointInterval seconds, resumed with --resume
+#define USE_CHECKPOINTS   1
+
+/******************************************************************************
+ * checkpoints
+ *
+ *  A checkpoint is the whole float film plus what the samplers need to carry
+ *  on where they stopped. Sobol samples are a function of pixel and sample
+ *  index, and every pixel's next index is its sample count, already in the
+ *  film. Independent samples come from per-thread generators seeded from a
+ *  global counter, which is saved too, so resumed threads get unused seeds.
+ *
+ *    header      magic "SRTC", version, width, height, hasAOVs, target
+ *                samples, next generator seed
+ *    tiles       sum, squared luminance, count and, with AOVs, albedo,
+ *                normal and depth of every tile in film order
+ *
+ *  Files are written to a .tmp name, flushed to disk and renamed over the
+ *  previous checkpoint, and the directory is flushed after the rename, so a
+ *  crash at any point leaves a complete one.
+ *
+ *  Worker processes rendering shards of a frame write their partial films in
+ *  the same format, mergeFilms() sums them into the frame.
+ *
+ *  checkpointWriter does the writing on its own thread. save() copies the
+ *  film between passes, a memcpy of the tiles, and returns; a save that comes
+ *  while the last one is still being written is skipped rather than waited
+ *  for, so render threads never block on the disk.
+ ******************************************************************************/
+
+struct srtcHeader {
+  char      magic[4];
+  uint32_t  version;
+  int32_t   width, height;
+  int32_t   hasAOVs;
+  int32_t   targetSamples;
+  uint32_t  generatorSeed;
+};
+
+template <typename T>
+bool writeTileArray(FILE* file, const tileVector<T>& values) {
+  return fwrite(values.data(), sizeof(T), values.size(), file) == values.size();
+}
+
+template <typename T>
+bool readTileArray(FILE* file, tileVector<T>& values) {
+  return fread(values.data(), sizeof(T), values.size(), file) == values.size();
+}
+
+// a rename is only on disk once the directory holding it is
+bool syncParentDirectory(const std::string& filename) {
+  size_t      slash = filename.find_last_of('/');
+  std::string directory = slash == std::string::npos ? "." : filename.substr(0, std::max<size_t>(slash, 1));
+  int         fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+
+  if (fd < 0)
+    return false;
+
+  bool  ok = fsync(fd) == 0;
+
+  close(fd);
+  return ok;
+}
+
+bool writeCheckpoint(const std::string& filename, const film& image, int targetSamples, uint32_t generatorSeed) {
+  std::string tmpFilename = filename + ".tmp";
+  FILE*       file = fopen(tmpFilename.c_str(), "wb");
+  srtcHeader  header = {{'S', 'R', 'T', 'C'}, 2, image.width(), image.height(), image.hasAOVs(),
+                        targetSamples, generatorSeed};
+
+  if (!file) {
+    std::cerr << "ERROR: Could not write checkpoint '" << filename << "'\n";
+    return false;
+  }
+
+  bool  ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  for (size_t t = 0; ok && t < image.numTiles(); t++) {
+    const filmTile& tile = image.tile(t);
+
+    ok = writeTileArray(file, tile.sum) && writeTileArray(file, tile.luminance2) && writeTileArray(file, tile.count);
+
+    if (ok && image.hasAOVs())
+      ok = writeTileArray(file, tile.albedo) && writeTileArray(file, tile.normal) && writeTileArray(file, tile.depth);
+  }
+
+  // on disk before it replaces the last good checkpoint
+  ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  fclose(file);
+
+  if (!ok || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    std::cerr << "ERROR: Could not write checkpoint '" << filename << "'\n";
+    remove(tmpFilename.c_str());
+    return false;
+  }
+
+  if (!syncParentDirectory(filename)) {
+    std::cerr << "ERROR: Could not flush the directory of checkpoint '" << filename << "'\n";
+    return false;
+  }
+
+  return true;
+}
+
+// image must already have the size and AOVs the checkpoint was written with
+bool readCheckpoint(const std::string& filename, film& image, int& targetSamples) {
+  FILE*       file = fopen(filename.c_str(), "rb");
+  srtcHeader  header;
+
+  if (!file)
+    return false;
+
+  bool  ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, "SRTC", 4) == 0 && header.version == 2 &&
+              header.width == image.width() && header.height == image.height() &&
+              (header.hasAOVs != 0) == image.hasAOVs();
+
+  for (size_t t = 0; ok && t < image.numTiles(); t++) {
+    filmTile& tile = image.tile(t);
+
+    ok = readTileArray(file, tile.sum) && readTileArray(file, tile.luminance2) && readTileArray(file, tile.count);
+
+    if (ok && image.hasAOVs())
+      ok = readTileArray(file, tile.albedo) && readTileArray(file, tile.normal) && readTileArray(file, tile.depth);
+  }
+
+  // nothing may follow the last tile
+  ok = ok && fgetc(file) == EOF;
+  fclose(file);
+
+  if (!ok) {
+    std::cerr << "ERROR: Could not read film '" << filename << "'\n";
+    image.clear();
+    return false;
+  }
+
+  targetSamples = header.targetSamples;
+  generatorSeeds() = header.generatorSeed;
+
+  return true;
+}
+
+// a film of the size and AOVs the file was written with
+bool readFilm(const std::string& filename, film& image) {
+  FILE*       file = fopen(filename.c_str(), "rb");
+  srtcHeader  header;
+  int         targetSamples;
+
+  if (!file || fread(&header, sizeof(header), 1, file) != 1) {
+    std::cerr << "ERROR: Could not read film '" << filename << "'\n";
+
+    if (file)
+      fclose(file);
+
+    return false;
+  }
+
+  fclose(file);
+  image = film(header.width, header.height, header.hasAOVs != 0);
+
+  return readCheckpoint(filename, image, targetSamples);
+}
+
+// the partial films of a frame's shards summed, all must have the same size and AOVs
+bool mergeFilms(const std::vector<std::string>& filenames, film& merged) {
+  if (filenames.empty() || !readFilm(filenames[0], merged))
+    return false;
+
+  for (size_t i = 1; i < filenames.size(); i++) {
+    film  partial(0, 0);
+
+    if (!readFilm(filenames[i], partial))
+      return false;
+
+    if (partial.width() != merged.width() || partial.height() != merged.height() ||
+        partial.hasAOVs() != merged.hasAOVs()) {
+      std::cerr << "ERROR: Film '" << filenames[i] << "' doesn't match '" << filenames[0] << "'\n";
+      return false;
+    }
+
+    merged.merge(partial);
+  }
+
+  return true;
+}
+
+class checkpointWriter {
+  public:
+    checkpointWriter(const std::string& checkpointFilename) : filename(checkpointFilename) {
+      worker = std::thread([this] { run(); });
+    }
+
+    ~checkpointWriter() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+      }
+
+      wake.notify_one();
+      worker.join();
+    }
+
+    // snapshot image for the writer thread, false if the last checkpoint is still being written
+    bool  save(const film& image, int targetSamples) {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      if (pending)
+        return false;
+
+      snapshot = image;
+      snapshotTarget = targetSamples;
+      snapshotSeed = generatorSeeds();
+      pending = true;
+      wake.notify_one();
+
+      return true;
+    }
+
+    // blocks until the last save() is on disk
+    void  wait() {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      done.wait(lock, [this] { return !pending; });
+    }
+
+    int   numWritten() const { return written; }
+
+  private:
+    void  run() {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      while (true) {
+        wake.wait(lock, [this] { return pending || quit; });
+
+        if (!pending)
+          return;
+
+        // the snapshot isn't touched by save() while pending, write it unlocked
+        lock.unlock();
+        bool  ok = writeCheckpoint(filename, snapshot, snapshotTarget, snapshotSeed);
+        lock.lock();
+
+        written += ok;
+        pending = false;
+        done.notify_all();
+      }
+    }
+
+  private:
+    std::string             filename;
+    film                    snapshot{0, 0};
+    int                     snapshotTarget = 0;
+    uint32_t                snapshotSeed = 0;
+    bool                    pending = false;
+    bool                    quit = false;
+    std::atomic<int>        written{0};
+    std::mutex              mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::thread             worker;
+};
+
+#endif
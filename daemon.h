@@ -0,0 +1,611 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "hittablelist.h"
+#include "material.h"
+#include "model.h"
+#include "bvh.h"
+#include "lightbvh.h"
+#include "envmap.h"
+#include "camera.h"
+#include "film.h"
+#include "render.h"
+
+/******************************************************************************
+ * render daemon
+ *
+ *  sexy-raytracer --serve <port> keeps running and takes render jobs over
+ *  HTTP on 127.0.0.1, so glTF parsing, texture decoding and BVH builds are
+ *  paid once per scene instead of once per image:
+ *
+ *    POST /render  scene=<file>&out=<file>&width=&height=&spp=&bounces=
+ *                  &eye=x,y,z&lookat=x,y,z&fov=
+ *    GET /status   resident scenes and jobs done
+ *    POST /stop    finish queued jobs and exit
+ *
+ *  e.g. curl -d 'scene=../data/scene.gltf&out=a.png' localhost:8080/render.
+ *  Parameters come as a form body or a query string. The output format
+ *  follows the extension: .exr, .pfm, anything else PNG.
+ *
+ *  Any web page a local browser has open can send requests to 127.0.0.1, so
+ *  whatever changes state takes a POST, requests carrying an Origin header
+ *  are refused, and images only go to relative paths without .. under the
+ *  daemon's output directory.
+ *
+ *  Scenes stay resident keyed by a hash of the scene file's contents, so an
+ *  edited file is reloaded under its new hash; the least recently used are
+ *  dropped past maxResident scenes. Every connection gets a thread
+ *  that parses the request, queues the job and waits for its result; a
+ *  single dispatcher runs jobs in arrival order, each spread over all
+ *  hardware threads in tiles by renderFilm. A job that fails or throws is
+ *  answered with a 500 and the daemon carries on.
+ *
+ *  Past maxConnections open connections new ones get a 503 right away, and
+ *  a client that stops sending or reading times out after
+ *  connectionTimeout seconds. Stopping cuts off connections still sending
+ *  their request, those waiting for a job get its result first.
+ ******************************************************************************/
+
+struct residentScene {
+  materialTable     materials;
+  hittableList      world;
+  hittableList      lights;
+  environmentLight  background{color3f(0.53f, 0.81f, 0.92f)};
+};
+
+// fills scene from a file, returns false if it can't be loaded
+using sceneLoader = std::function<bool(const std::string& filename, residentScene& scene)>;
+
+// the meshes of a glTF file under main's sky
+bool loadGLTFScene(const std::string& filename, residentScene& scene) {
+  shared_ptr<model> gltf = model::create(filename);
+  hittableList      objects;
+
+  if (!gltf->init(scene.materials))
+    return false;
+
+  for (const auto& mesh : gltf->meshes) {
+    for (const auto& tri : mesh->triangles)
+      objects.add(tri);
+  }
+
+  if (objects.objects.empty())
+    return false;
+
+  scene.lights = buildLights(objects, scene.materials);
+  scene.world.add(make_shared<bvhNode>(objects, 0, 1));
+
+  return true;
+}
+
+// FNV-1a of a file's contents
+bool hashFile(const std::string& filename, uint64_t& hash) {
+  FILE*     file = fopen(filename.c_str(), "rb");
+  uint8_t   buffer[65536];
+  size_t    size;
+
+  if (!file)
+    return false;
+
+  hash = 0xcbf29ce484222325ull;
+
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    for (size_t i = 0; i < size; i++)
+      hash = (hash ^ buffer[i]) * 0x100000001b3ull;
+  }
+
+  fclose(file);
+
+  return true;
+}
+
+// larger jobs are refused rather than left to overflow, exhaust memory or hold the dispatcher for days
+const int maxJobSide = 16384;
+const int maxJobPixels = 8192 * 8192;
+const int maxJobSamples = 1 << 16;
+const int maxJobBounces = 64;
+
+// open connections and how long a connection may stall
+const int maxConnections = 64;
+const int connectionTimeout = 10;
+
+struct renderJob {
+  std::string scene;
+  std::string output;
+  int         width = 320;
+  int         height = 180;
+  int         samples = 16;
+  int         maxBounce = 4;
+  vec3f       eye{0, 3.0f, 5.0f};
+  vec3f       lookAt{0, 2.5f, 0};
+  float       fov = 70.0f;
+};
+
+struct jobResult {
+  bool        ok;
+  std::string message;
+  double      seconds;
+};
+
+// %xx escapes and + of a query string value
+std::string urlDecode(const std::string& value) {
+  std::string result;
+
+  for (size_t i = 0; i < value.size(); i++) {
+    if (value[i] == '%' && i + 2 < value.size()) {
+      result += static_cast<char>(strtol(value.substr(i + 1, 2).c_str(), nullptr, 16));
+      i += 2;
+    }
+    else
+      result += value[i] == '+' ? ' ' : value[i];
+  }
+
+  return result;
+}
+
+// relative, and without .. components that could leave the directory it's relative to
+bool isContainedPath(const std::string& path) {
+  if (path.empty() || path[0] == '/')
+    return false;
+
+  for (size_t begin = 0; begin <= path.size();) {
+    size_t  end = std::min(path.find('/', begin), path.size());
+
+    if (path.compare(begin, end - begin, "..") == 0 && end - begin == 2)
+      return false;
+
+    begin = end + 1;
+  }
+
+  return true;
+}
+
+// a /render query string or form body, error says what's wrong when it returns false
+bool parseRenderJob(const std::string& query, renderJob& job, std::string& error) {
+  size_t  begin = 0;
+
+  while (begin < query.size()) {
+    size_t      end = query.find('&', begin);
+    std::string pair = query.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+    size_t      equals = pair.find('=');
+    std::string key = pair.substr(0, equals);
+    std::string value = equals == std::string::npos ? "" : urlDecode(pair.substr(equals + 1));
+
+    begin = end == std::string::npos ? query.size() : end + 1;
+
+    if (key == "scene")
+      job.scene = value;
+    else if (key == "out")
+      job.output = value;
+    else if (key == "width")
+      job.width = atoi(value.c_str());
+    else if (key == "height")
+      job.height = atoi(value.c_str());
+    else if (key == "spp")
+      job.samples = atoi(value.c_str());
+    else if (key == "bounces")
+      job.maxBounce = atoi(value.c_str());
+    else if (key == "fov")
+      job.fov = static_cast<float>(atof(value.c_str()));
+    else if (key == "eye" || key == "lookat") {
+      vec3f&  v = key == "eye" ? job.eye : job.lookAt;
+
+      if (sscanf(value.c_str(), "%f,%f,%f", &v(0), &v(1), &v(2)) != 3) {
+        error = key + " needs x,y,z";
+        return false;
+      }
+    }
+    else if (!key.empty()) {
+      error = "unknown parameter '" + key + "'";
+      return false;
+    }
+  }
+
+  if (job.scene.empty() || job.output.empty())
+    error = "scene and out are required";
+  else if (!isContainedPath(job.output))
+    error = "out must be a relative path without ..";
+  else if (job.width < 2 || job.height < 2 || job.samples < 1 || job.maxBounce < 1)
+    error = "width, height, spp and bounces must be positive";
+  else if (job.width > maxJobSide || job.height > maxJobSide ||
+            static_cast<int64_t>(job.width) * job.height > maxJobPixels)
+    error = "at most " + std::to_string(maxJobSide) + " pixels a side and " + std::to_string(maxJobPixels) +
+            " in all";
+  else if (job.samples > maxJobSamples || job.maxBounce > maxJobBounces)
+    error = "at most " + std::to_string(maxJobSamples) + " spp and " + std::to_string(maxJobBounces) + " bounces";
+
+  return error.empty();
+}
+
+class renderDaemon {
+  public:
+    // images are written under outputDir, at most maxScenes scenes stay loaded
+    renderDaemon(const std::string& outputDir = ".", sceneLoader sceneLoad = loadGLTFScene, size_t maxScenes = 4) :
+                  loader(sceneLoad), outputDirectory(outputDir), maxResident(maxScenes) {
+      dispatcher = std::thread([this] { run(); });
+    }
+
+    ~renderDaemon() {
+      stop();
+      dispatcher.join();
+
+      std::unique_lock<std::mutex> lock(mutex);
+
+      idle.wait(lock, [this] { return numConnections == 0; });
+    }
+
+    // queues a job, jobs run one at a time in submission order
+    std::future<jobResult>  submit(const renderJob& job) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::promise<jobResult>     promise;
+      std::future<jobResult>      result = promise.get_future();
+
+      if (stopping)
+        promise.set_value({false, "stopping", 0});
+      else {
+        queue.emplace_back(job, std::move(promise));
+        wake.notify_one();
+      }
+
+      return result;
+    }
+
+    // binds 127.0.0.1:port, 0 picks a free port. Returns the port or -1
+    int   listen(int port);
+
+    // answers HTTP requests until /stop or stop()
+    void  serve();
+
+    // refuses new jobs, the queued ones still run
+    void  stop();
+
+    size_t  numResident() {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      return scenes.size();
+    }
+
+  private:
+    void                            run();
+    jobResult                       execute(const renderJob& job);
+    void                            answer(int connection);
+    void                            respond(int connection, int status, const std::string& body);
+    shared_ptr<const residentScene> scene(const std::string& filename, bool& loaded, std::string& error);
+
+  private:
+    sceneLoader                                           loader;
+    std::string                                           outputDirectory;
+    size_t                                                maxResident;
+    std::list<std::pair<uint64_t, shared_ptr<const residentScene>>> scenes;   // most recently used first
+    std::deque<std::pair<renderJob, std::promise<jobResult>>> queue;
+    int                                                   jobsDone = 0;
+    bool                                                  stopping = false;
+    int                                                   listenSocket = -1;
+    std::mutex                                            mutex;
+    int                                                   numConnections = 0;
+    std::set<int>                                         reading;    // connections still receiving their request
+    std::condition_variable                               wake;
+    std::condition_variable                               idle;
+    std::thread                                           dispatcher;
+};
+
+shared_ptr<const residentScene> renderDaemon::scene(const std::string& filename, bool& loaded, std::string& error) {
+  uint64_t  hash;
+
+  loaded = false;
+
+  if (!hashFile(filename, hash)) {
+    error = "can't read scene '" + filename + "'";
+    return nullptr;
+  }
+
+  // only the dispatcher loads scenes, the lock just guards against numResident()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto                        found = std::find_if(scenes.begin(), scenes.end(),
+                                                      [hash](const auto& s) { return s.first == hash; });
+
+    if (found != scenes.end()) {
+      scenes.splice(scenes.begin(), scenes, found);
+      return found->second;
+    }
+  }
+
+  auto  resident = make_shared<residentScene>();
+
+  if (!loader(filename, *resident)) {
+    error = "can't load scene '" + filename + "'";
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  loaded = true;
+  scenes.emplace_front(hash, resident);
+
+  while (scenes.size() > maxResident)
+    scenes.pop_back();
+
+  return resident;
+}
+
+jobResult renderDaemon::execute(const renderJob& job) {
+  auto        start = std::chrono::steady_clock::now();
+  bool        loaded;
+  std::string error;
+  auto        resident = scene(job.scene, loaded, error);
+
+  if (!resident)
+    return {false, error, 0};
+
+  camera      cam(job.eye, job.lookAt, vec3f(0, 1.0f, 0), job.fov, static_cast<float>(job.width) / job.height, 0,
+                  10.0f, 0, 1.0f);
+  film        image(job.width, job.height);
+  std::string output = outputDirectory + "/" + job.output;
+  std::string extension = job.output.substr(std::min(job.output.size(), job.output.rfind('.') + 1));
+  bool        ok;
+
+  cam.setImageHeight(job.height);
+  renderFilm(resident->world, resident->materials, resident->lights, cam, resident->background, image, job.samples,
+              job.maxBounce);
+
+  if (extension == "exr")
+    ok = image.writeEXR(output);
+  else if (extension == "pfm")
+    ok = image.writePFM(output);
+  else {
+    std::vector<uint8_t>  target(4 * static_cast<size_t>(job.width) * job.height);
+
+    image.toTarget(target.data(), 4);
+    ok = writePNG(output, job.width, job.height, target.data());
+  }
+
+  double  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (!ok)
+    return {false, "can't write '" + output + "'", seconds};
+
+  return {true, std::to_string(job.samples) + " spp in " + std::to_string(seconds) + " s, scene " +
+                (loaded ? "loaded" : "resident"), seconds};
+}
+
+void renderDaemon::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+    wake.wait(lock, [this] { return !queue.empty() || stopping; });
+
+    if (queue.empty())
+      return;
+
+    auto  job = std::move(queue.front());
+
+    queue.pop_front();
+    lock.unlock();
+
+    // a failing job must not take the daemon and its resident scenes down with it
+    try {
+      job.second.set_value(execute(job.first));
+    }
+    catch (const std::exception& e) {
+      job.second.set_value({false, std::string("job failed: ") + e.what(), 0});
+    }
+    catch (...) {
+      job.second.set_value({false, "job failed", 0});
+    }
+
+    lock.lock();
+    jobsDone++;
+  }
+}
+
+void renderDaemon::stop() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  stopping = true;
+  wake.notify_one();
+
+  // unblocks accept() in serve()
+  if (listenSocket >= 0)
+    shutdown(listenSocket, SHUT_RDWR);
+
+  // and recv() of requests still coming in, answer() closes them
+  for (int connection : reading)
+    shutdown(connection, SHUT_RD);
+}
+
+int renderDaemon::listen(int port) {
+  sockaddr_in address = {};
+  socklen_t   length = sizeof(address);
+  int         reuse = 1;
+
+  listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(static_cast<uint16_t>(port));
+
+  if (listenSocket < 0 || setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+      bind(listenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      ::listen(listenSocket, 64) != 0 ||
+      getsockname(listenSocket, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+    std::cerr << "ERROR: Could not listen on port " << port << "\n";
+
+    if (listenSocket >= 0)
+      close(listenSocket);
+
+    listenSocket = -1;
+    return -1;
+  }
+
+  return ntohs(address.sin_port);
+}
+
+void renderDaemon::serve() {
+  while (true) {
+    int connection = accept(listenSocket, nullptr, nullptr);
+
+    if (connection < 0)
+      break;
+
+    timeval timeout = {connectionTimeout, 0};
+    bool    accepted;
+
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      accepted = numConnections < maxConnections && !stopping;
+
+      if (accepted) {
+        numConnections++;
+        reading.insert(connection);
+      }
+    }
+
+    if (!accepted) {
+      respond(connection, 503, "error: too many connections");
+      continue;
+    }
+
+    std::thread([this, connection] { answer(connection); }).detach();
+  }
+
+  close(listenSocket);
+  listenSocket = -1;
+}
+
+void renderDaemon::answer(int connection) {
+  const size_t  maxRequest = 65536;
+  std::string   request;
+  char          buffer[4096];
+  ssize_t       size;
+
+  // the headers, then a form body of Content-Length bytes
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < maxRequest &&
+          (size = recv(connection, buffer, sizeof(buffer), 0)) > 0)
+    request.append(buffer, size);
+
+  size_t      headerEnd = std::min(request.find("\r\n\r\n"), request.size());
+  std::string headers = request.substr(0, headerEnd);
+  size_t      lengthField;
+
+  // header names are case insensitive
+  for (auto& c : headers)
+    c = tolower(c);
+
+  lengthField = headers.find("\r\ncontent-length:");
+
+  size_t      contentLength = lengthField == std::string::npos ? 0 :
+                              std::min<size_t>(strtoul(headers.c_str() + lengthField + 17, nullptr, 10), maxRequest);
+  size_t      bodyStart = std::min(headerEnd + 4, request.size());
+
+  while (request.size() < bodyStart + contentLength && (size = recv(connection, buffer, sizeof(buffer), 0)) > 0)
+    request.append(buffer, size);
+
+  // stop() no longer needs to cut this one off, a job it queues still gets answered
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    reading.erase(connection);
+  }
+
+  std::string line = request.substr(0, request.find("\r\n"));
+  std::string method = line.substr(0, line.find(' '));
+  size_t      pathStart = line.find(' ') + 1;
+  std::string target = line.substr(pathStart, line.find(' ', pathStart) - pathStart);
+  std::string path = target.substr(0, target.find('?'));
+  std::string query = target.find('?') == std::string::npos ? "" : target.substr(target.find('?') + 1);
+  std::string form = request.substr(bodyStart, contentLength);
+  bool        changesState = path == "/render" || path == "/stop";
+  int         status = 200;
+  std::string body;
+
+  if (!form.empty())
+    query += (query.empty() ? "" : "&") + form;
+
+  if (headerEnd == request.size() || request.size() < bodyStart + contentLength) {
+    status = 400;
+    body = "error: incomplete request";
+  }
+  else if (method != "GET" && method != "POST") {
+    status = 405;
+    body = "error: only GET and POST are supported";
+  }
+  else if (headers.find("\r\norigin:") != std::string::npos) {
+    status = 403;
+    body = "error: requests from web pages are refused";
+  }
+  else if (changesState && method != "POST") {
+    status = 405;
+    body = "error: " + path + " takes a POST";
+  }
+  else if (path == "/render") {
+    renderJob   job;
+    std::string error;
+
+    if (!parseRenderJob(query, job, error)) {
+      status = 400;
+      body = "error: " + error;
+    }
+    else {
+      jobResult result = submit(job).get();
+
+      status = result.ok ? 200 : 500;
+      body = (result.ok ? "ok: " : "error: ") + result.message;
+    }
+  }
+  else if (path == "/status") {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    body = std::to_string(scenes.size()) + " scenes resident, " + std::to_string(jobsDone) + " jobs done, " +
+            std::to_string(queue.size()) + " queued";
+  }
+  else if (path == "/stop") {
+    stop();
+    body = "stopping";
+  }
+  else {
+    status = 404;
+    body = "error: unknown path '" + path + "'";
+  }
+
+  respond(connection, status, body);
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  numConnections--;
+  idle.notify_all();
+}
+
+// sends a plain text response and closes the connection
+void renderDaemon::respond(int connection, int status, const std::string& body) {
+  std::string response = "HTTP/1.0 " + std::to_string(status) + (status == 200 ? " OK" : " Error") +
+                          "\r\nContent-Type: text/plain\r\nContent-Length: " + std::to_string(body.size() + 1) +
+                          "\r\nConnection: close\r\n\r\n" + body + "\n";
+
+  send(connection, response.data(), response.size(), MSG_NOSIGNAL);
+  close(connection);
+}
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef __DENOISE_H__
+#define __DENOISE_H__
+
+#include <algorithm>
+#include <vector>
+
+#include "globals.h"
+#include "envmap.h"
+#include "simd.h"
+
+// keep AOVs on main's film and denoise test.png before writing it, at the same sample count.
+// test.exr stays the undenoised mean
+#define USE_DENOISER  0
+
+/******************************************************************************
+ * AOVs and denoiser
+ *
+ *  rayColor can report the albedo and shading normal of the first
+ *  non-specular hit and the distance to the first hit. renderPass sums them
+ *  per pixel next to the beauty buffer, along with the squared luminance of
+ *  every sample for a per pixel variance estimate.
+ *
+ *  The denoiser is the spatial part of SVGF (Schied et al. 2017): the
+ *  image is divided by albedo so textures survive, then filtered with
+ *  iterations of an edge-avoiding a-trous wavelet, a 5x5 B3 spline kernel
+ *  with taps 1, 2, 4, ... pixels apart. Each tap is weighted by
+ *
+ *    normal      exp(sigmaNormal * (n . n' - 1))
+ *    depth       exp(-|z - z'| / (sigmaDepth * step * z))
+ *    luminance   exp(-|l - l'| / (sigmaLuminance * stddev))
+ *
+ *  with stddev from the 3x3 blurred variance, which is filtered along with
+ *  the color so later iterations stop at smaller differences. Rows are split
+ *  across hardware threads and each row is processed as many pixels at a
+ *  time as the widest instruction set has lanes, away from the left and right
+ *  borders.
+ ******************************************************************************/
+
+// depth of first hits that left the scene, their normal is the reversed ray direction
+const float missDepth = 1e30f;
+
+struct pixelAOV {
+  color3f albedo;
+  vec3f   normal;
+  float   depth;
+};
+
+// sums over the samples of each pixel, like the beauty buffer
+struct aovBuffers {
+  std::vector<color3f>  albedo;
+  std::vector<vec3f>    normal;
+  std::vector<float>    depth;
+  std::vector<float>    luminance2;
+
+  void  resize(size_t numPixels) {
+    albedo.resize(numPixels, color3f(0, 0, 0));
+    normal.resize(numPixels, vec3f(0, 0, 0));
+    depth.resize(numPixels, 0);
+    luminance2.resize(numPixels, 0);
+  }
+
+  void  add(int pixel, const pixelAOV& aov, const color3f& radiance) {
+    float l = luminance(radiance);
+
+    albedo[pixel] += aov.albedo;
+    normal[pixel] += aov.normal;
+    depth[pixel] += aov.depth;
+    luminance2[pixel] += l * l;
+  }
+};
+
+struct denoiseSettings {
+  int     iterations = 3;
+  float   sigmaLuminance = 1.0f;
+  float   sigmaNormal = 64.0f;
+  float   sigmaDepth = 0.02f;
+  simdISA isa = simdLevel();    // narrower instruction sets for comparisons
+};
+
+// demodulated color and its variance, ping-ponged between iterations
+struct denoisePlanes {
+  std::vector<float>  r, g, b, variance;
+
+  void  resize(size_t n) {
+    r.resize(n);
+    g.resize(n);
+    b.resize(n);
+    variance.resize(n);
+  }
+};
+
+struct denoiseGuide {
+  std::vector<float>  nx, ny, nz, depth, stddev;
+};
+
+// one a-trous iteration for the pixels of row y starting at x, as many as V has lanes
+template <typename V>
+void atrousPixels(const denoisePlanes& src, const denoiseGuide& guide, denoisePlanes& dst, int x, int y,
+                  int step, int width, int height, const denoiseSettings& params) {
+  const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+  const int   lanes = sizeof(V) / sizeof(float);
+  const float log2e = 1.442695041f;
+
+  int   center = y * width + x;
+  V     n[3] = {loadLanes<V>(&guide.nx[center]), loadLanes<V>(&guide.ny[center]),
+                loadLanes<V>(&guide.nz[center])};
+  V     z = loadLanes<V>(&guide.depth[center]);
+  V     l = 0.2126f * loadLanes<V>(&src.r[center]) + 0.7152f * loadLanes<V>(&src.g[center]) +
+            0.0722f * loadLanes<V>(&src.b[center]);
+  V     invSigmaL = -log2e / (params.sigmaLuminance * loadLanes<V>(&guide.stddev[center]) + 1e-4f);
+  V     invSigmaZ = -log2e / (params.sigmaDepth * step * z + 1e-4f);
+  V     sum[3] = {0.0f, 0.0f, 0.0f};
+  V     sumVariance = 0.0f;
+  V     sumWeight = 0.0f;
+
+  for (int j = 0; j < 5; j++) {
+    int yq = y + (j - 2) * step;
+
+    if (yq < 0 || yq >= height)
+      continue;
+
+    for (int i = 0; i < 5; i++) {
+      int xq = x + (i - 2) * step;
+
+      if (xq < 0 || xq + lanes > width)
+        continue;
+
+      int q = yq * width + xq;
+      V   r = loadLanes<V>(&src.r[q]), g = loadLanes<V>(&src.g[q]), b = loadLanes<V>(&src.b[q]);
+      V   lq = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+      V   NdotN = n[0] * loadLanes<V>(&guide.nx[q]) + n[1] * loadLanes<V>(&guide.ny[q]) +
+                  n[2] * loadLanes<V>(&guide.nz[q]);
+
+      // all three edge stops in one exponential
+      V   e = (params.sigmaNormal * log2e) * (NdotN - 1.0f) + vabs(loadLanes<V>(&guide.depth[q]) - z) * invSigmaZ +
+              vabs(lq - l) * invSigmaL;
+      V   w = (kernel[i] * kernel[j]) * vexp2(e);
+
+      sum[0] = vfmadd(w, r, sum[0]);
+      sum[1] = vfmadd(w, g, sum[1]);
+      sum[2] = vfmadd(w, b, sum[2]);
+      sumVariance = vfmadd(w * w, loadLanes<V>(&src.variance[q]), sumVariance);
+      sumWeight = sumWeight + w;
+    }
+  }
+
+  // the center tap always has weight 1/(8/3)^2, so sumWeight > 0
+  V     invWeight = 1.0f / sumWeight;
+
+  storeLanes<V>(&dst.r[center], sum[0] * invWeight);
+  storeLanes<V>(&dst.g[center], sum[1] * invWeight);
+  storeLanes<V>(&dst.b[center], sum[2] * invWeight);
+  storeLanes<V>(&dst.variance[center], sumVariance * invWeight * invWeight);
+}
+
+// one a-trous iteration for row y, V lanes at a time where all horizontal taps are inside the row
+template <typename V>
+void atrousRow(const denoisePlanes& src, const denoiseGuide& guide, denoisePlanes& dst, int y,
+                int step, int width, int height, const denoiseSettings& params) {
+  const int lanes = sizeof(V) / sizeof(float);
+  int       x = 0;
+
+  for (; x < std::min(2 * step, width); x++)
+    atrousPixels<float>(src, guide, dst, x, y, step, width, height, params);
+
+  if (lanes > 1) {
+    for (; x + lanes + 2 * step <= width; x += lanes)
+      atrousPixels<V>(src, guide, dst, x, y, step, width, height, params);
+  }
+
+  for (; x < width; x++)
+    atrousPixels<float>(src, guide, dst, x, y, step, width, height, params);
+}
+
+#if SIMD_DISPATCH
+SIMD_AVX2_KERNEL void atrousRowAVX2(const denoisePlanes& src, const denoiseGuide& guide, denoisePlanes& dst,
+                                    int y, int step, int width, int height, const denoiseSettings& params) {
+  atrousRow<floatx8>(src, guide, dst, y, step, width, height, params);
+}
+
+SIMD_AVX512_KERNEL void atrousRowAVX512(const denoisePlanes& src, const denoiseGuide& guide, denoisePlanes& dst,
+                                        int y, int step, int width, int height, const denoiseSettings& params) {
+  atrousRow<floatx16>(src, guide, dst, y, step, width, height, params);
+}
+#endif
+
+// pixels hold sums over numSamples samples, output gets the denoised mean
+void denoise(const std::vector<color3f>& pixels, int numSamples, const aovBuffers& aovs, int width, int height,
+              std::vector<color3f>& output, const denoiseSettings& params = denoiseSettings()) {
+  int                   numPixels = width * height;
+  float                 invSamples = 1.0f / numSamples;
+  denoisePlanes         planes[2];
+  denoiseGuide          guide;
+  std::vector<color3f>  albedo(numPixels);
+
+  planes[0].resize(numPixels);
+  planes[1].resize(numPixels);
+  guide.nx.resize(numPixels);
+  guide.ny.resize(numPixels);
+  guide.nz.resize(numPixels);
+  guide.depth.resize(numPixels);
+  guide.stddev.resize(numPixels);
+
+  parallelFor(numPixels, [&](int begin, int end) {
+    for (int p = begin; p < end; p++) {
+      color3f mean = pixels[p] * invSamples;
+      float   l = luminance(mean);
+      vec3f   n = unitVector(aovs.normal[p]);
+
+      // variance of the mean, scaled like the demodulated color
+      albedo[p] = (aovs.albedo[p] * invSamples).cwiseMax(color3f(0.01f, 0.01f, 0.01f));
+      planes[0].r[p] = mean(0) / albedo[p](0);
+      planes[0].g[p] = mean(1) / albedo[p](1);
+      planes[0].b[p] = mean(2) / albedo[p](2);
+      planes[0].variance[p] = fmaxf(aovs.luminance2[p] * invSamples - l * l, 0) * invSamples /
+                              (luminance(albedo[p]) * luminance(albedo[p]));
+      guide.nx[p] = n(0);
+      guide.ny[p] = n(1);
+      guide.nz[p] = n(2);
+      guide.depth[p] = aovs.depth[p] * invSamples;
+    }
+  });
+
+  int   src = 0;
+
+  for (int iteration = 0; iteration < params.iterations; iteration++) {
+    const denoisePlanes&  in = planes[src];
+    denoisePlanes&        out = planes[1 - src];
+    int                   step = 1 << iteration;
+
+    // 3x3 gaussian of the variance for the luminance edge stop
+    parallelFor(height, [&](int begin, int end) {
+      for (int y = begin; y < end; y++) {
+        for (int x = 0; x < width; x++) {
+          float sum = 0, sumWeight = 0;
+
+          for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+              int   xq = x + dx, yq = y + dy;
+              float w = (dx == 0 ? 2.0f : 1.0f) * (dy == 0 ? 2.0f : 1.0f);
+
+              if (xq < 0 || xq >= width || yq < 0 || yq >= height)
+                continue;
+
+              sum += w * in.variance[yq * width + xq];
+              sumWeight += w;
+            }
+          }
+
+          guide.stddev[y * width + x] = sqrtf(sum / sumWeight);
+        }
+      }
+    });
+
+    parallelFor(height, [&](int begin, int end) {
+      for (int y = begin; y < end; y++) {
+#if SIMD_DISPATCH
+        if (params.isa == simdISA::avx512)
+          atrousRowAVX512(in, guide, out, y, step, width, height, params);
+        else if (params.isa == simdISA::avx2)
+          atrousRowAVX2(in, guide, out, y, step, width, height, params);
+        else
+#endif
+          atrousRow<float>(in, guide, out, y, step, width, height, params);
+      }
+    });
+
+    src = 1 - src;
+  }
+
+  output.resize(numPixels);
+
+  for (int p = 0; p < numPixels; p++)
+    output[p] = color3f(planes[src].r[p], planes[src].g[p], planes[src].b[p]).cwiseProduct(albedo[p]);
+}
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef __ENVMAP_H__
+#define __ENVMAP_H__
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "stb_image.h"
+
+#include "globals.h"
+#include "hittable.h"
+
+// light the scene with an equirectangular HDR image instead of the constant sky color
+#define USE_ENVIRONMENT_MAP   0
+
+/******************************************************************************
+ * Environment light
+ *
+ *  Equirectangular radiance, v = 0 is straight up. Image environments are
+ *  importance sampled with an alias table (Vose) over texels weighted by
+ *  luminance * sin(theta), so both sampling and pdf lookups are O(1). Texel
+ *  weights are computed on all hardware threads; the table is cached next to
+ *  the image as .srta:
+ *
+ *    header      magic "SRTA", version, width, height
+ *    entries     probability, alias, pdf per texel, row-major
+ ******************************************************************************/
+
+struct aliasEntry {
+  float     probability;    // chance of keeping this entry rather than its alias
+  uint32_t  alias;
+  float     pdf;            // normalized weight of this entry
+};
+
+struct srtaHeader {
+  char      magic[4];
+  uint32_t  version;
+  int32_t   width, height;
+};
+
+// Vose's alias method, returns false if every weight is 0
+bool buildAliasTable(const std::vector<float>& weights, std::vector<aliasEntry>& table) {
+  size_t  n = weights.size();
+  double  sum = 0;
+
+  for (float weight : weights)
+    sum += weight;
+
+  if (n == 0 || sum <= 0)
+    return false;
+
+  std::vector<float>    scaled(n);
+  std::vector<uint32_t> small, large;
+
+  table.resize(n);
+
+  for (size_t i = 0; i < n; i++) {
+    table[i].pdf = static_cast<float>(weights[i] / sum);
+    scaled[i] = static_cast<float>(weights[i] * n / sum);
+    (scaled[i] < 1.0f ? small : large).push_back(i);
+  }
+
+  while (!small.empty() && !large.empty()) {
+    uint32_t  s = small.back();
+    uint32_t  l = large.back();
+
+    small.pop_back();
+    large.pop_back();
+
+    table[s].probability = scaled[s];
+    table[s].alias = l;
+
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+    (scaled[l] < 1.0f ? small : large).push_back(l);
+  }
+
+  // leftovers are 1 up to rounding
+  for (uint32_t i : large) {
+    table[i].probability = 1.0f;
+    table[i].alias = i;
+  }
+
+  for (uint32_t i : small) {
+    table[i].probability = 1.0f;
+    table[i].alias = i;
+  }
+
+  return true;
+}
+
+class environmentLight : public hittable {
+  public:
+    // a constant color converts to a uniform environment that isn't importance sampled
+    environmentLight(const color3f& c) : constant(c), width(0), height(0), scale(1.0f) {}
+    environmentLight(const char* filename, float s = 1.0f);
+    environmentLight(const float* rgb, int w, int h, float s = 1.0f) : constant(0, 0, 0), scale(s) {
+      init(rgb, w, h, nullptr);
+    }
+
+    color3f       value(const vec3f& dir) const;
+    bool          importanceSampled() const { return !table.empty(); }
+
+    // only used for light sampling, rays that miss the scene pick up value() instead
+    virtual bool  hit(const ray& r, float tMin, float tMax, hitRecord& record) const override { return false; }
+    virtual bool  boundingBox(float time0, float time1, aabb& outputBox) const override { return false; }
+    virtual void  calcTangentBasis(const vec3f& normal, vec3f& tangent, vec3f& bitangent) const override {}
+    virtual int   populateVector(class shared_ptr<class hittableVector> hittableVector) const override {
+        return -1;
+      }
+
+    virtual float pdfValue(const vec3f& o, const vec3f& v) const override;
+    virtual vec3f random(const vec3f& o) const override;
+
+  private:
+    void          init(const float* rgb, int w, int h, const char* cacheFilename);
+    bool          readTable(const char* cacheFilename);
+    void          writeTable(const char* cacheFilename) const;
+
+    int           texelIndex(const vec3f& dir) const {
+      float y = clamp(dir(1), -1.0f, 1.0f);
+      float u = (atan2f(dir(2), dir(0)) + pi) / (2.0f * pi);
+      float v = acosf(y) / pi;
+      int   i = std::min(static_cast<int>(u * width), width - 1);
+      int   j = std::min(static_cast<int>(v * height), height - 1);
+
+      return j * width + std::max(i, 0);
+    }
+
+  private:
+    color3f                 constant;
+    int                     width, height;
+    float                   scale;
+    std::vector<color3f>    texels;
+    std::vector<aliasEntry> table;
+};
+
+environmentLight::environmentLight(const char* filename, float s) : constant(0, 0, 0), width(0), height(0), scale(s) {
+  int     w, h, n;
+  float*  rgb = stbi_loadf(filename, &w, &h, &n, 3);
+
+  if (!rgb) {
+    std::cerr << "ERROR: Could not load environment map '" << filename << "'\n";
+    return;
+  }
+
+  init(rgb, w, h, (std::string(filename) + ".srta").c_str());
+  stbi_image_free(rgb);
+}
+
+void environmentLight::init(const float* rgb, int w, int h, const char* cacheFilename) {
+  width = w;
+  height = h;
+  texels.resize(w * h);
+
+  for (int i = 0; i < w * h; i++)
+    texels[i] = color3f(rgb[3 * i + 0], rgb[3 * i + 1], rgb[3 * i + 2]);
+
+  if (cacheFilename && readTable(cacheFilename))
+    return;
+
+  // luminance over solid angle, rows near the poles cover less of the sphere
+  std::vector<float>  weights(w * h);
+
+  parallelFor(h, [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      float sinTheta = sinf(pi * (j + 0.5f) / h);
+
+      for (int i = 0; i < w; i++)
+        weights[j * w + i] = fmaxf(luminance(texels[j * w + i]), 0) * sinTheta;
+    }
+  });
+
+  if (!buildAliasTable(weights, table))
+    return;
+
+  if (cacheFilename)
+    writeTable(cacheFilename);
+}
+
+bool environmentLight::readTable(const char* cacheFilename) {
+  std::string sourceFilename = std::string(cacheFilename, strlen(cacheFilename) - strlen(".srta"));
+  struct stat srcStat, dstStat;
+
+  if (stat(cacheFilename, &dstStat) != 0 ||
+      (stat(sourceFilename.c_str(), &srcStat) == 0 && dstStat.st_mtime < srcStat.st_mtime))
+    return false;
+
+  FILE*       file = fopen(cacheFilename, "rb");
+  srtaHeader  header;
+
+  if (!file)
+    return false;
+
+  bool  ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, "SRTA", 4) == 0 && header.version == 1 &&
+              header.width == width && header.height == height;
+
+  if (ok) {
+    table.resize(width * height);
+    ok = fread(table.data(), sizeof(aliasEntry), table.size(), file) == table.size();
+  }
+
+  fclose(file);
+
+  if (!ok)
+    table.clear();
+
+  return ok;
+}
+
+void environmentLight::writeTable(const char* cacheFilename) const {
+  std::string tmpFilename = std::string(cacheFilename) + ".tmp";
+  FILE*       file = fopen(tmpFilename.c_str(), "wb");
+  srtaHeader  header = {{'S', 'R', 'T', 'A'}, 1, width, height};
+
+  if (!file) {
+    std::cerr << "ERROR: Could not write environment table '" << cacheFilename << "'\n";
+    return;
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(table.data(), sizeof(aliasEntry), table.size(), file);
+
+  bool  ok = !ferror(file);
+  fclose(file);
+
+  if (!ok || rename(tmpFilename.c_str(), cacheFilename) != 0)
+    remove(tmpFilename.c_str());
+}
+
+color3f environmentLight::value(const vec3f& dir) const {
+  if (texels.empty())
+    return constant;
+
+  return scale * texels[texelIndex(unitVector(dir))];
+}
+
+float environmentLight::pdfValue(const vec3f& o, const vec3f& v) const {
+  if (table.empty())
+    return 0;
+
+  vec3f dir = unitVector(v);
+  float sinTheta = sqrtf(fmaxf(1.0f - dir(1) * dir(1), 0));
+
+  if (sinTheta <= 0)
+    return 0;
+
+  // texel probability spread over its solid angle of sin(theta) * 2pi^2 / (w * h)
+  return table[texelIndex(dir)].pdf * width * height / (2.0f * pi * pi * sinTheta);
+}
+
+vec3f environmentLight::random(const vec3f& o) const {
+  if (table.empty())
+    return vec3f(0, 1.0f, 0);
+
+  // one entry, then keep it or take its alias
+  float   u = randomFloat() * table.size();
+  size_t  index = std::min(static_cast<size_t>(u), table.size() - 1);
+
+  if (u - index >= table[index].probability)
+    index = table[index].alias;
+
+  // uniform within the texel
+  float   phi = 2.0f * pi * ((index % width) + randomFloat()) / width - pi;
+  float   theta = pi * ((index / width) + randomFloat()) / height;
+  float   sinTheta = sinf(theta);
+
+  return vec3f(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi));
+}
+
+#endif
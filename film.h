@@ -0,0 +1,378 @@
+#ifndef __FILM_H__
+#define __FILM_H__
+
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "globals.h"
+#include "color.h"
+#include "denoise.h"
+#include "imagestream.h"
+
+/******************************************************************************
+ * float accumulation film
+ *
+ *  Radiance sums and sample counts per pixel, stored in square tiles so a
+ *  thread rendering a tile only ever writes memory it owns. Every tile buffer
+ *  is its own allocation, aligned to and padded up to a cache line, so tiles
+ *  never share a line even at their edges (hot tiles the scheduler splits
+ *  into row ranges share one where the ranges meet). Squared luminance is
+ *  summed too, for noise estimates, and with AOVs enabled the denoiser's
+ *  albedo, normal and depth.
+ *
+ *  Nothing is quantized until output, so samples can be added at any time and
+ *  pixels may hold different sample counts. Output is the per pixel mean:
+ *
+ *    toTarget    8 bit sRGB-ish target for PNG and the GL window, as before
+ *    writePFM    portable float map, 32 bit RGB, rows bottom to top
+ *    writeEXR    uncompressed scanline OpenEXR, half or float RGB
+ *
+ *  Frames too large to keep whole are rendered into a band film at a time
+ *  and streamed out through imagestream.h as bands finish.
+ ******************************************************************************/
+
+// edge length of film tiles in pixels
+const int filmTileSize = 32;
+const int cacheLineSize = 64;
+
+// allocations start on a cache line and end on one
+template <typename T>
+struct cacheLineAllocator {
+  using value_type = T;
+
+  cacheLineAllocator() = default;
+  template <typename U>
+  cacheLineAllocator(const cacheLineAllocator<U>&) {}
+
+  T*    allocate(size_t n) {
+    size_t  bytes = (n * sizeof(T) + cacheLineSize - 1) & ~static_cast<size_t>(cacheLineSize - 1);
+
+    return static_cast<T*>(::operator new(bytes, std::align_val_t(cacheLineSize)));
+  }
+
+  void  deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(cacheLineSize)); }
+};
+
+template <typename T, typename U>
+bool operator==(const cacheLineAllocator<T>&, const cacheLineAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const cacheLineAllocator<T>&, const cacheLineAllocator<U>&) { return false; }
+
+template <typename T>
+using tileVector = std::vector<T, cacheLineAllocator<T>>;
+
+struct filmTile {
+  int                   x, y;             // top left pixel in the film
+  int                   width, height;
+  tileVector<color3f>   sum;
+  tileVector<float>     luminance2;       // for variance estimates
+  tileVector<uint32_t>  count;
+
+  // AOV sums as in aovBuffers, empty when the film has no AOVs
+  tileVector<color3f>   albedo;
+  tileVector<vec3f>     normal;
+  tileVector<float>     depth;
+
+  void  add(int pixel, const color3f& radiance, const pixelAOV* aov = nullptr) {
+    float l = luminance(radiance);
+
+    sum[pixel] += radiance;
+    luminance2[pixel] += l * l;
+    count[pixel]++;
+
+    if (aov && !albedo.empty()) {
+      albedo[pixel] += aov->albedo;
+      normal[pixel] += aov->normal;
+      depth[pixel] += aov->depth;
+    }
+  }
+};
+
+// the part of a frame one of several worker processes renders: every count-th tile, or a
+// range of every pixel's sample indices. Sobol samples depend on the sample index only and
+// independent samples get a seed range per shard, so sample shards never overlap
+struct renderShard {
+  int       index = 0;
+  int       count = 1;
+  bool      bySamples = false;
+  uint32_t  firstSample = 0;      // index of every pixel's first sample in this shard
+
+  bool      ownsTile(size_t tile) const { return bySamples || static_cast<int>(tile % count) == index; }
+};
+
+// sets up shard index of count for a frame of targetSamples spp and gives this process's
+// generators the shard's own range of seeds, returns the spp the shard renders
+inline int splitShard(renderShard& shard, int index, int count, bool bySamples, int targetSamples) {
+  shard = {index, count, bySamples, 0};
+  generatorSeeds() = std::mt19937::default_seed + (static_cast<uint32_t>(index) << 24);
+
+  if (!bySamples)
+    return targetSamples;
+
+  shard.firstSample = static_cast<uint32_t>(static_cast<int64_t>(targetSamples) * index / count);
+
+  return static_cast<int>(static_cast<int64_t>(targetSamples) * (index + 1) / count) - shard.firstSample;
+}
+
+class film {
+  public:
+    film(int w, int h, bool withAOVs = false);
+
+    int       width() const { return imageWidth; }
+    int       height() const { return imageHeight; }
+    bool      hasAOVs() const { return aovsEnabled; }
+    size_t    numTiles() const { return tiles.size(); }
+
+    const renderShard&  shard() const { return shardInfo; }
+    void                setShard(const renderShard& shard) { shardInfo = shard; }
+
+    // a film may hold a band of rows of a taller frame, for frames rendered and written out band
+    // by band. Rays and sample indices follow frame rows, film coordinates stay local
+    int       firstRow() const { return bandFirstRow; }
+    int       frameHeight() const { return bandFrameHeight ? bandFrameHeight : imageHeight; }
+    void      setBand(int first, int frameRows) { bandFirstRow = first; bandFrameHeight = frameRows; }
+
+    filmTile&       tile(size_t index) { return tiles[index]; }
+    const filmTile& tile(size_t index) const { return tiles[index]; }
+
+    color3f   sum(int x, int y) const { return tileAt(x, y).sum[pixelInTile(x, y)]; }
+    uint32_t  count(int x, int y) const { return tileAt(x, y).count[pixelInTile(x, y)]; }
+    color3f   mean(int x, int y) const {
+      uint32_t  n = count(x, y);
+
+      return n ? color3f(sum(x, y) / n) : color3f(0, 0, 0);
+    }
+
+    // most samples any pixel has
+    uint32_t  maxCount() const;
+
+    // standard error of the pixel means' luminance, RMS over the image and relative to its mean
+    // luminance. Pixels need 2 samples to count
+    float     relativeError() const;
+
+    // row-major sums, scaled as if every pixel had maxCount() samples, and the AOVs the same way.
+    // Returns maxCount(), the denoiser's numSamples
+    int       gather(std::vector<color3f>& pixels, aovBuffers* aovs = nullptr) const;
+
+    void      clear();
+
+    // adds other's samples, of the same size and AOVs, so means come out weighted by sample counts
+    void      merge(const film& other);
+
+    // 8 bit gamma 2 pixels with bpp bytes each, alpha 255. A larger target is filled with the nearest
+    // film pixel, for low resolution previews
+    void      toTarget(uint8_t* data, int bpp, int targetWidth = 0, int targetHeight = 0) const;
+
+    bool      writePFM(const std::string& filename) const;
+    bool      writeEXR(const std::string& filename, bool half = true) const;
+
+  private:
+    const filmTile& tileAt(int x, int y) const { return tiles[(y / filmTileSize) * tilesX + x / filmTileSize]; }
+    int             pixelInTile(int x, int y) const {
+      return (y % filmTileSize) * tileAt(x, y).width + x % filmTileSize;
+    }
+
+  private:
+    int                   imageWidth;
+    int                   imageHeight;
+    int                   tilesX;
+    bool                  aovsEnabled;
+    renderShard           shardInfo;
+    int                   bandFirstRow = 0;
+    int                   bandFrameHeight = 0;
+    std::vector<filmTile> tiles;
+};
+
+film::film(int w, int h, bool withAOVs)
+  : imageWidth(w), imageHeight(h), tilesX((w + filmTileSize - 1) / filmTileSize), aovsEnabled(withAOVs) {
+  for (int y = 0; y < h; y += filmTileSize) {
+    for (int x = 0; x < w; x += filmTileSize) {
+      filmTile  tile;
+
+      tile.x = x;
+      tile.y = y;
+      tile.width = std::min(filmTileSize, w - x);
+      tile.height = std::min(filmTileSize, h - y);
+      tiles.push_back(std::move(tile));
+    }
+  }
+
+  clear();
+}
+
+void film::clear() {
+  for (auto& tile : tiles) {
+    size_t  n = tile.width * tile.height;
+
+    tile.sum.assign(n, color3f(0, 0, 0));
+    tile.luminance2.assign(n, 0);
+    tile.count.assign(n, 0);
+
+    if (aovsEnabled) {
+      tile.albedo.assign(n, color3f(0, 0, 0));
+      tile.normal.assign(n, vec3f(0, 0, 0));
+      tile.depth.assign(n, 0);
+    }
+  }
+}
+
+void film::merge(const film& other) {
+  for (size_t t = 0; t < tiles.size(); t++) {
+    filmTile&       tile = tiles[t];
+    const filmTile& src = other.tiles[t];
+
+    for (size_t p = 0; p < tile.count.size(); p++) {
+      tile.sum[p] += src.sum[p];
+      tile.luminance2[p] += src.luminance2[p];
+      tile.count[p] += src.count[p];
+
+      if (aovsEnabled) {
+        tile.albedo[p] += src.albedo[p];
+        tile.normal[p] += src.normal[p];
+        tile.depth[p] += src.depth[p];
+      }
+    }
+  }
+}
+
+uint32_t film::maxCount() const {
+  uint32_t  result = 0;
+
+  for (const auto& tile : tiles) {
+    for (uint32_t n : tile.count)
+      result = std::max(result, n);
+  }
+
+  return result;
+}
+
+float film::relativeError() const {
+  double  variance = 0, mean = 0;
+  size_t  numPixels = 0;
+
+  for (const auto& tile : tiles) {
+    for (size_t p = 0; p < tile.count.size(); p++) {
+      uint32_t  n = tile.count[p];
+
+      if (n < 2)
+        continue;
+
+      double    l = luminance(tile.sum[p]) / n;
+
+      // unbiased sample variance, over n again for the variance of the mean
+      variance += std::max(tile.luminance2[p] / n - l * l, 0.0) / (n - 1);
+      mean += l;
+      numPixels++;
+    }
+  }
+
+  return numPixels && mean > 0 ? static_cast<float>(sqrt(variance / numPixels) / (mean / numPixels)) : infinity;
+}
+
+int film::gather(std::vector<color3f>& pixels, aovBuffers* aovs) const {
+  uint32_t  numSamples = maxCount();
+
+  pixels.assign(imageWidth * imageHeight, color3f(0, 0, 0));
+
+  if (aovs) {
+    aovs->albedo.assign(pixels.size(), color3f(0, 0, 0));
+    aovs->normal.assign(pixels.size(), vec3f(0, 0, 0));
+    aovs->depth.assign(pixels.size(), 0);
+    aovs->luminance2.assign(pixels.size(), 0);
+  }
+
+  for (const auto& tile : tiles) {
+    for (int j = 0; j < tile.height; j++) {
+      for (int i = 0; i < tile.width; i++) {
+        int   local = j * tile.width + i;
+        int   p = (tile.y + j) * imageWidth + tile.x + i;
+
+        if (tile.count[local] == 0)
+          continue;
+
+        float scale = static_cast<float>(numSamples) / tile.count[local];
+
+        pixels[p] = tile.sum[local] * scale;
+
+        if (aovs) {
+          aovs->luminance2[p] = tile.luminance2[local] * scale;
+
+          if (aovsEnabled) {
+            aovs->albedo[p] = tile.albedo[local] * scale;
+            aovs->normal[p] = tile.normal[local] * scale;
+            aovs->depth[p] = tile.depth[local] * scale;
+          }
+        }
+      }
+    }
+  }
+
+  return static_cast<int>(numSamples);
+}
+
+void film::toTarget(uint8_t* data, int bpp, int targetWidth, int targetHeight) const {
+  int   w = targetWidth ? targetWidth : imageWidth;
+  int   h = targetHeight ? targetHeight : imageHeight;
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int   fx = x * imageWidth / w, fy = y * imageHeight / h;
+
+      writeColorTarget(data, x, y, w, h, bpp, sum(fx, fy), std::max(count(fx, fy), 1u));
+    }
+  }
+}
+
+bool film::writePFM(const std::string& filename) const {
+  FILE*               file = fopen(filename.c_str(), "wb");
+  std::vector<float>  row(imageWidth * 3);
+
+  if (!file) {
+    std::cerr << "ERROR: Could not write image '" << filename << "'\n";
+    return false;
+  }
+
+  // a negative scale marks little endian floats
+  fprintf(file, "PF\n%d %d\n-1.0\n", imageWidth, imageHeight);
+
+  for (int y = imageHeight - 1; y >= 0; y--) {
+    for (int x = 0; x < imageWidth; x++) {
+      color3f c = mean(x, y);
+
+      row[x * 3 + 0] = c(0);
+      row[x * 3 + 1] = c(1);
+      row[x * 3 + 2] = c(2);
+    }
+
+    fwrite(row.data(), sizeof(float), row.size(), file);
+  }
+
+  bool  ok = !ferror(file);
+  fclose(file);
+
+  return ok;
+}
+
+bool film::writeEXR(const std::string& filename, bool half) const {
+  exrStream             exr(filename, imageWidth, imageHeight, half);
+  std::vector<color3f>  row(imageWidth);
+
+  if (!exr.ok()) {
+    std::cerr << "ERROR: Could not write image '" << filename << "'\n";
+    return false;
+  }
+
+  for (int y = 0; y < imageHeight; y++) {
+    for (int x = 0; x < imageWidth; x++)
+      row[x] = mean(x, y);
+
+    exr.writeRows(row.data(), 1);
+  }
+
+  return exr.finish();
+}
+
+#endif
@@ -1,10 +1,16 @@
 #ifndef __GLOBALS_H__
 #define __GLOBALS_H__
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <limits>
 #include <memory>
 #include <random>
+#include <thread>
+#include <vector>
+
+#include "sampler.h"
 
 using std::shared_ptr;
 using std::make_shared;
@@ -27,9 +33,43 @@ inline float deg2rad(float degrees) {
   return degrees * pi / 180.0f;
 }
 
+// run fn(thread) on numThreads threads, thread counting up from 0
+template <typename F>
+void parallelThreads(int numThreads, F fn) {
+  std::vector<std::thread>  threads;
+
+  for (int t = 0; t < numThreads; t++)
+    threads.emplace_back(fn, t);
+
+  for (auto& thread : threads)
+    thread.join();
+}
+
+// run fn(begin, end) over [0, count) split across hardware threads
+template <typename F>
+void parallelFor(int count, F fn) {
+  int numThreads = std::max(1, std::min(count, static_cast<int>(std::thread::hardware_concurrency())));
+
+  parallelThreads(numThreads, [=](int t) { fn(count * t / numThreads, count * (t + 1) / numThreads); });
+}
+
+// seed of the next thread's generator, checkpoints save it so resumed renders don't reuse seeds
+inline std::atomic<uint32_t>& generatorSeeds() {
+  static std::atomic<uint32_t> seeds{std::mt19937::default_seed};
+
+  return seeds;
+}
+
+// one generator per thread, the first thread gets mt19937's default seed. Inside a pixelSample
+// the next low discrepancy dimension is returned instead
 inline float randomFloat() {
-  static std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-  static std::mt19937 generator;
+  sampleStream& stream = currentSampleStream();
+
+  if (stream.active)
+    return nextSample(stream);
+
+  thread_local std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+  thread_local std::mt19937 generator(generatorSeeds()++);
 
   return distribution(generator);
 }
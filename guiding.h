@@ -0,0 +1,499 @@
+#ifndef __GUIDING_H__
+#define __GUIDING_H__
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "globals.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "envmap.h"
+#include "material.h"
+
+/******************************************************************************
+ * path guiding
+ *
+ *  Practical path guiding (Mueller et al. 2017): an SD-tree learns the
+ *  incident radiance at scattering points online. A binary tree splits the
+ *  scene bounds at midpoints, cycling x, y, z; each leaf holds a quadtree over
+ *  directions in cylindrical coordinates (cos theta, phi), which map the
+ *  sphere onto the unit square with equal area.
+ *
+ *  With settings.pathGuiding, renderProgressive() trains a tree on the film's
+ *  own first passes (1, 1, 2, 4, ... spp). Every path vertex records the
+ *  radiance it received over the pdf it was sampled with, and after each pass:
+ *
+ *    spatial   leaves with more than spatialThreshold * sqrt(pass spp) records
+ *              are split, both halves start from the parent's records
+ *    direction each leaf samples from what it recorded, and its recording
+ *              quadtree is rebuilt so cells hold under quadtreeThreshold of
+ *              the flux, in parallel over leaves
+ *
+ *  Sampling and recording quadtrees of all leaves together stay under
+ *  maxBytes. pbr scattering in rayColor() draws guidingFraction of its
+ *  directions from the learned distribution and the rest from the bsdf,
+ *  weighted by the mixture pdf, and so do the MIS weights of light samples.
+ ******************************************************************************/
+
+// share of pbr scattering directions drawn from the guiding distribution
+const float guidingFraction = 0.5f;
+const float quadtreeThreshold = 0.01f;
+const int   quadtreeMaxDepth = 20;
+
+// passes a tree learns from before it only guides, 64 spp in passes of 1, 1, 2, 4, ...
+const int   guideTrainingPasses = 7;
+
+inline void atomicAdd(std::atomic<float>& a, float value) {
+  float current = a.load(std::memory_order_relaxed);
+
+  while (!a.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+}
+
+// unit direction to (cos theta, phi) scaled to [0, 1)^2, equal area
+inline vec2f dirToCanonical(const vec3f& dir) {
+  const float oneMinusEpsilon = 1.0f - epsilon;
+  float       phi = atan2f(dir(1), dir(0));
+
+  if (phi < 0)
+    phi += 2.0f * pi;
+
+  return vec2f(clamp(0.5f * (dir(2) + 1.0f), 0, oneMinusEpsilon), clamp(phi / (2.0f * pi), 0, oneMinusEpsilon));
+}
+
+inline vec3f canonicalToDir(const vec2f& p) {
+  float cosTheta = 2.0f * p(0) - 1.0f;
+  float sinTheta = sqrtf(fmaxf(1.0f - cosTheta * cosTheta, 0));
+  float phi = 2.0f * pi * p(1);
+
+  return vec3f(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+}
+
+/******************************************************************************
+ * directional quadtree
+ ******************************************************************************/
+
+class dTree {
+  public:
+    dTree(uint32_t numSamples = 0) : sampling(1), building(1), total(0), samples(numSamples) {}
+    dTree(const dTree& other) : sampling(other.sampling), building(other.building), total(other.total),
+                                samples(other.samples.load()) {}
+
+    // thread safe, radiance over the pdf its direction was sampled with
+    void      record(const vec3f& dir, float value);
+
+    // solid angle density of the learned distribution
+    float     pdf(const vec3f& dir) const;
+    vec3f     sample() const;
+
+    // false until a pass recorded some radiance
+    bool      trained() const { return total > 0; }
+    uint32_t  numSamples() const { return samples; }
+    void      halveSamples() { samples = samples / 2; }
+    size_t    memoryUsed() const { return sizeof(dTree) + (sampling.size() + building.size()) * sizeof(node); }
+    static size_t nodeBytes() { return sizeof(node); }
+
+    // sample from what source recorded, coarsest levels first up to maxNodes nodes. May be this
+    // tree, or the parent of a spatial split, as long as source isn't building at the same time
+    void      resample(const dTree& source, size_t maxNodes);
+
+    // rebuild the recording tree around the sampling one
+    void      build(size_t maxNodes);
+
+  private:
+    // quadrants are ordered x + 2 * y, child 0 marks a leaf quadrant
+    struct node {
+      node() : child{0, 0, 0, 0} {
+        for (auto& s : sum)
+          s = 0;
+      }
+      node(const node& other) { *this = other; }
+
+      node& operator=(const node& other) {
+        for (int q = 0; q < 4; q++) {
+          sum[q] = other.sum[q].load(std::memory_order_relaxed);
+          child[q] = other.child[q];
+        }
+
+        return *this;
+      }
+
+      float   total() const { return sum[0] + sum[1] + sum[2] + sum[3]; }
+
+      std::atomic<float>  sum[4];
+      uint32_t            child[4];
+    };
+
+    // quadrant of p within a node, p is rescaled to the quadrant
+    static int  quadrant(vec2f& p) {
+      int x = p(0) >= 0.5f;
+      int y = p(1) >= 0.5f;
+
+      p = 2.0f * p - vec2f(x, y);
+      return x + 2 * y;
+    }
+
+    void      refine(int src, const float fraction[4], int dst, int depth, size_t maxNodes);
+
+  private:
+    std::vector<node>     sampling, building;
+    float                 total;
+    std::atomic<uint32_t> samples;
+};
+
+void dTree::record(const vec3f& dir, float value) {
+  vec2f p = dirToCanonical(dir);
+  int   index = 0;
+
+  samples++;
+
+  if (!(value > 0) || !std::isfinite(value))
+    return;
+
+  // every node on the way holds the sum over its quadrants' subtrees
+  while (true) {
+    int q = quadrant(p);
+
+    atomicAdd(building[index].sum[q], value);
+
+    if (!building[index].child[q])
+      return;
+
+    index = building[index].child[q];
+  }
+}
+
+float dTree::pdf(const vec3f& dir) const {
+  if (!trained())
+    return 1.0f / (4.0f * pi);
+
+  vec2f p = dirToCanonical(dir);
+  float density = 1.0f;
+  int   index = 0;
+
+  while (true) {
+    const node& n = sampling[index];
+    int         q = quadrant(p);
+    float       nodeTotal = n.total();
+
+    if (nodeTotal <= 0)
+      return 0;
+
+    density *= 4.0f * n.sum[q] / nodeTotal;
+
+    if (!n.child[q])
+      return density / (4.0f * pi);
+
+    index = n.child[q];
+  }
+}
+
+// draws 3 dimensions like the bsdf warps, the one picking quadrants is rescaled at every level
+vec3f dTree::sample() const {
+  float u = randomFloat();
+  vec2f leaf(randomFloat(), randomFloat());
+
+  if (!trained())
+    return canonicalToDir(vec2f(u, leaf(0)));
+
+  vec2f origin(0, 0);
+  float size = 1.0f;
+  int   index = 0;
+
+  while (true) {
+    const node& n = sampling[index];
+    float       nodeTotal = n.total();
+    float       target = u * nodeTotal;
+    int         q = 0;
+
+    while (q < 3 && target >= n.sum[q]) {
+      target -= n.sum[q];
+      q++;
+    }
+
+    u = n.sum[q] > 0 ? std::min(target / n.sum[q], 1.0f - epsilon) : 0;
+    size *= 0.5f;
+    origin += size * vec2f(q & 1, q >> 1);
+
+    if (!n.child[q])
+      return canonicalToDir(origin + size * leaf);
+
+    index = n.child[q];
+  }
+}
+
+void dTree::resample(const dTree& source, size_t maxNodes) {
+  std::vector<std::pair<uint32_t, uint32_t>>  pending = {{0, 0}};
+
+  sampling.assign(1, source.building[0]);
+
+  // breadth first, source nodes past the budget stay leaf quadrants holding their subtree's sum
+  for (size_t i = 0; i < pending.size(); i++) {
+    uint32_t  src = pending[i].first, dst = pending[i].second;
+
+    for (int q = 0; q < 4; q++) {
+      uint32_t  child = source.building[src].child[q];
+
+      sampling[dst].child[q] = 0;
+
+      if (child && sampling.size() < maxNodes) {
+        sampling[dst].child[q] = sampling.size();
+        pending.push_back({child, static_cast<uint32_t>(sampling.size())});
+        sampling.push_back(source.building[child]);
+      }
+    }
+  }
+
+  total = sampling[0].total();
+}
+
+void dTree::build(size_t maxNodes) {
+  samples = 0;
+
+  building.assign(1, node());
+
+  if (!trained())
+    return;
+
+  float fraction[4];
+
+  for (int q = 0; q < 4; q++)
+    fraction[q] = sampling[0].sum[q] / total;
+
+  refine(0, fraction, 0, 1, maxNodes);
+}
+
+// splits quadrants of building[dst] holding more than quadtreeThreshold of the flux. src is the
+// matching sampling node, -1 below its leaves where the flux is taken as uniform
+void dTree::refine(int src, const float fraction[4], int dst, int depth, size_t maxNodes) {
+  for (int q = 0; q < 4; q++) {
+    if (fraction[q] <= quadtreeThreshold || depth >= quadtreeMaxDepth || building.size() >= maxNodes)
+      continue;
+
+    int   srcChild = src >= 0 ? static_cast<int>(sampling[src].child[q]) : 0;
+    float childFraction[4];
+
+    for (int c = 0; c < 4; c++) {
+      if (srcChild) {
+        float childTotal = sampling[srcChild].total();
+
+        childFraction[c] = childTotal > 0 ? fraction[q] * sampling[srcChild].sum[c] / childTotal : 0;
+      }
+      else
+        childFraction[c] = 0.25f * fraction[q];
+    }
+
+    uint32_t  child = building.size();
+
+    building.emplace_back();
+    building[dst].child[q] = child;
+    refine(srcChild ? srcChild : -1, childFraction, child, depth + 1, maxNodes);
+  }
+}
+
+/******************************************************************************
+ * spatial binary tree
+ ******************************************************************************/
+
+class sdTree {
+  public:
+    // points outside bounds are clamped into it, learns from trainingPasses passes
+    sdTree(const aabb& b, size_t maxBytes = 64 << 20, float threshold = 12000.0f,
+            int trainingPasses = guideTrainingPasses) :
+            bounds(b), nodes(1), trees(1), spatialThreshold(threshold), numPasses(0), maxPasses(trainingPasses) {
+      maxNodes = std::max<size_t>(maxBytes / dTree::nodeBytes(), 1024);
+      nodes[0] = {-1, {0, 0}, 0, 0};
+    }
+
+    dTree&        leafAt(const vec3f& p);
+
+    // paths record into the tree while true
+    bool          training() const { return numPasses < maxPasses; }
+
+    // end of a training pass of passSamples spp
+    void          refine(int passSamples);
+
+    size_t        numLeaves() const { return trees.size(); }
+    size_t        memoryUsed() const;
+
+  private:
+    // axis -1 marks a leaf holding trees[tree], splits cycle through x, y, z by depth
+    struct sNode {
+      int axis;
+      int child[2];
+      int tree;
+      int depth;
+    };
+
+    void          split(int index, float threshold, std::vector<int>& sources);
+
+  private:
+    aabb                bounds;
+    std::vector<sNode>  nodes;
+    std::vector<dTree>  trees;
+    float               spatialThreshold;
+    size_t              maxNodes;       // sampling and recording quadtree nodes over all leaves
+    int                 numPasses, maxPasses;
+};
+
+dTree& sdTree::leafAt(const vec3f& p) {
+  vec3f local = (p - bounds.minimum).cwiseQuotient(bounds.maximum - bounds.minimum);
+  int   index = 0;
+
+  local = local.cwiseMax(vec3f(0, 0, 0)).cwiseMin(vec3f(1.0f, 1.0f, 1.0f));
+
+  while (nodes[index].axis >= 0) {
+    int   axis = nodes[index].axis;
+    int   side = local(axis) >= 0.5f;
+
+    local(axis) = 2.0f * local(axis) - side;
+    index = nodes[index].child[side];
+  }
+
+  return trees[nodes[index].tree];
+}
+
+size_t sdTree::memoryUsed() const {
+  size_t  bytes = nodes.size() * sizeof(sNode);
+
+  for (const auto& tree : trees)
+    bytes += tree.memoryUsed();
+
+  return bytes;
+}
+
+// sources[t] is the tree whose records trees[t] starts from, new leaves are empty until resampled
+void sdTree::split(int index, float threshold, std::vector<int>& sources) {
+  // every leaf keeps at least a few hundred quadtree nodes of the budget
+  if (nodes[index].axis >= 0 || trees[nodes[index].tree].numSamples() <= threshold ||
+      (trees.size() + 1) * 256 > maxNodes)
+    return;
+
+  // both halves start from the parent's records and half their count
+  int   tree = nodes[index].tree;
+  int   depth = nodes[index].depth;
+  int   left = nodes.size();
+
+  trees[tree].halveSamples();
+  trees.emplace_back(trees[tree].numSamples());
+  sources.push_back(sources[tree]);
+
+  nodes.push_back({-1, {0, 0}, tree, depth + 1});
+  nodes.push_back({-1, {0, 0}, static_cast<int>(trees.size()) - 1, depth + 1});
+  nodes[index] = {depth % 3, {left, left + 1}, -1, depth};
+
+  split(left, threshold, sources);
+  split(left + 1, threshold, sources);
+}
+
+void sdTree::refine(int passSamples) {
+  size_t            numNodes = nodes.size();
+  std::vector<int>  sources(trees.size());
+  float             threshold = spatialThreshold * sqrtf(static_cast<float>(passSamples));
+
+  for (size_t t = 0; t < sources.size(); t++)
+    sources[t] = t;
+
+  for (size_t i = 0; i < numNodes; i++)
+    split(i, threshold, sources);
+
+  // half the budget samples, half records, every leaf the same share
+  size_t  maxTreeNodes = maxNodes / trees.size() / 2;
+
+  // leaves only write their own sampling tree while reading the recording ones, then rebuild those
+  parallelFor(trees.size(), [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+      trees[i].resample(trees[sources[i]], maxTreeNodes);
+  });
+
+  parallelFor(trees.size(), [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+      trees[i].build(maxTreeNodes);
+  });
+
+  numPasses++;
+}
+
+/******************************************************************************
+ * guided sampling
+ ******************************************************************************/
+
+// a guided path's scattering events, the radiance that reaches the camera through each is
+// recorded into its leaf once the path ends
+class guidingRecorder {
+  public:
+    guidingRecorder() : numVertices(0) {}
+
+    // throughput after scattering at the vertex, pdf of its direction
+    void  add(dTree* tree, const vec3f& dir, const color3f& throughput, float pdf) {
+      if (numVertices < maxVertices)
+        vertices[numVertices++] = {tree, dir, throughput, color3f(0, 0, 0), pdf};
+    }
+
+    // a contribution reaching the camera also reaches every vertex before it
+    void  addRadiance(const color3f& c) {
+      for (int i = 0; i < numVertices; i++) {
+        for (int k = 0; k < 3; k++) {
+          if (vertices[i].throughput(k) > 0)
+            vertices[i].radiance(k) += c(k) / vertices[i].throughput(k);
+        }
+      }
+    }
+
+    void  record() {
+      for (int i = 0; i < numVertices; i++)
+        vertices[i].tree->record(vertices[i].dir, luminance(vertices[i].radiance) / vertices[i].pdf);
+    }
+
+  private:
+    static const int  maxVertices = 32;
+
+    struct vertex {
+      dTree*  tree;
+      vec3f   dir;
+      color3f throughput;
+      color3f radiance;       // arriving along dir
+      float   pdf;
+    };
+
+    vertex  vertices[maxVertices];
+    int     numVertices;
+};
+
+// density of sampling dir from the mixture of tree and a bsdf with pdf bsdfPdf
+inline float guidedPdf(const dTree& tree, const vec3f& dir, float bsdfPdf) {
+  return guidingFraction * tree.pdf(dir) + (1.0f - guidingFraction) * bsdfPdf;
+}
+
+// materialTable::scatter from the mixture of tree and the bsdf, attenuation and pdf are the mixture's.
+// Both strategies draw the same number of dimensions after picking one
+bool guidedScatter(const materialTable& materials, const dTree& tree, const ray& rIn, const hitRecord& record,
+                    color3f& attenuation, ray& scattered, float& pdf) {
+  if (randomFloat() < guidingFraction) {
+    vec3f   dir = tree.sample();
+    color3f f;
+    float   bsdfPdf;
+
+    if (!materials.evalScatter(record.matId, rIn, record, dir, f, bsdfPdf))
+      return false;
+
+    pdf = guidedPdf(tree, dir, bsdfPdf);
+    attenuation = f / pdf;
+    scattered = ray(record.p, dir, rIn.time, record.coneWidth, scatterSpread(rIn.coneSpread, 1.0f));
+
+    return pdf > 0;
+  }
+
+  if (!materials.scatter(record.matId, rIn, record, attenuation, scattered, pdf))
+    return false;
+
+  // attenuation is f * cos / bsdf pdf, reweight to the mixture
+  float mixturePdf = guidedPdf(tree, unitVector(scattered.dir), pdf);
+
+  attenuation *= pdf / mixturePdf;
+  pdf = mixturePdf;
+
+  return true;
+}
+
+#endif
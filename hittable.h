@@ -1,10 +1,17 @@
 #ifndef __HITTABLE_H__
 #define __HITTABLE_H__
 
+#include <vector>
+
 #include "globals.h"
 #include "aabb.h"
 
-class material;
+class materialTable;
+
+// index into the scene's materialTable
+using materialId = uint32_t;
+
+const materialId noMaterial = ~0u;
 
 struct hitRecord {
   vec3f   p;
@@ -13,12 +20,36 @@ struct hitRecord {
   float   t;
   bool    frontFace;
 
-  shared_ptr<material> matPtr;
+  // ray cone width at p and uv units per world unit on the hit surface
+  float   coneWidth;
+  float   uvScale;
+
+  materialId  matId;
 
   inline void setFaceNormal(const ray &r, const vec3f &outwardNormal) {
     frontFace = r.dir.dot(outwardNormal) < 0;
     normal = frontFace ? outwardNormal : -outwardNormal;
   }
+
+  inline void setCone(const ray &r) {
+    coneWidth = r.coneWidth + r.coneSpread * t * length(r.dir);
+  }
+
+  // width of the ray cone footprint in uv space, used to pick a mip level
+  inline float uvFootprint(const ray &r) const {
+    float cosine = fabsf(r.dir.dot(normal)) / length(r.dir);
+
+    return coneWidth * uvScale / fmaxf(cosine, 0.05f);
+  }
+};
+
+// emitted power and orientation of an emitter or a group of them, used to build light trees
+struct lightBounds {
+  aabb    box;
+  vec3f   axis;
+  float   cosThetaO;    // surface normals lie within thetaO of axis
+  float   cosThetaE;    // emission spreads up to thetaE past each normal
+  float   power;
 };
 
 class hittable {
@@ -28,6 +59,19 @@ class hittable {
     virtual void  calcTangentBasis(const vec3f& normal, vec3f& tangent, vec3f& bitangent) const = 0;
     virtual int   selectBvhAxis() const { return randomInt(0, 2); }
 
+    // light sampling: solid angle pdf of direction v from o, and a direction towards the surface
+    virtual float pdfValue(const vec3f& o, const vec3f& v) const { return 0; }
+    virtual vec3f random(const vec3f& o) const { return vec3f(1.0f, 0, 0); }
+
+    // emissive primitives are gathered into a separate list for direct light sampling
+    virtual bool  isEmitter(const materialTable& materials) const { return false; }
+    virtual void  collectLights(const materialTable& materials, std::vector<shared_ptr<hittable>>& lights) const {}
+    virtual bool  emitterBounds(const materialTable& materials, lightBounds& bounds) const { return false; }
+
+    // a photon leaving a uniformly chosen point of an emitter in a cosine weighted direction,
+    // carrying the emitter's whole power
+    virtual bool  emitPhoton(const materialTable& materials, ray& photon, color3f& power) const { return false; }
+
     // indexed tree for compute shaders
     virtual int   populateVector(class shared_ptr<class hittableVector> hittableVector) const = 0;
 };
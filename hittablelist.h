@@ -5,6 +5,7 @@
 #include "hittable.h"
 #include "aabb.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -25,6 +26,12 @@ class hittableList : public hittable {
     virtual int  populateVector(class shared_ptr<class hittableVector> hittableVector) const override {
         return -1;
       };
+
+    // pick one object uniformly, pdf is the average over all objects
+    virtual float pdfValue(const vec3f& o, const vec3f& v) const override;
+    virtual vec3f random(const vec3f& o) const override;
+    virtual void  collectLights(const materialTable& materials,
+                                std::vector<shared_ptr<hittable>>& lights) const override;
   
   public:
     std::vector<shared_ptr<hittable>> objects;
@@ -64,4 +71,34 @@ bool hittableList::boundingBox(float time0, float time1, aabb& outputBox) const
   return true;
 }
 
+float hittableList::pdfValue(const vec3f& o, const vec3f& v) const {
+  if (objects.empty())
+    return 0;
+
+  float weight = 1.0f / objects.size();
+  float sum = 0;
+
+  for (const auto& object : objects)
+    sum += weight * object->pdfValue(o, v);
+
+  return sum;
+}
+
+vec3f hittableList::random(const vec3f& o) const {
+  int   index = std::min(randomInt(0, static_cast<int>(objects.size()) - 1),
+                          static_cast<int>(objects.size()) - 1);
+
+  return objects[index]->random(o);
+}
+
+void hittableList::collectLights(const materialTable& materials,
+                                  std::vector<shared_ptr<hittable>>& lights) const {
+  for (const auto& object : objects) {
+    if (object->isEmitter(materials))
+      lights.push_back(object);
+    else
+      object->collectLights(materials, lights);
+  }
+}
+
 #endif
\ No newline at end of file
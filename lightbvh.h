@@ -0,0 +1,319 @@
+#ifndef __LIGHTBVH_H__
+#define __LIGHTBVH_H__
+
+#include <algorithm>
+#include <vector>
+
+#include "Eigen/Geometry"
+
+#include "globals.h"
+#include "hittable.h"
+#include "hittablelist.h"
+#include "settings.h"
+#include "envmap.h"
+#include "material.h"
+
+/******************************************************************************
+ * light BVH
+ *
+ * Emitters are grouped by a median split of their centroids. Each node keeps
+ * the summed power, a box and a cone bounding the emitter normals, from which
+ * a conservative estimate of the light reaching a point is computed (Conty and
+ * Kulla 2018). Sampling walks from the root picking a child proportional to
+ * its estimate, so selection costs O(log n) and tracks the lights that matter
+ * at the shading point. pdfValue() walks the same probabilities down every
+ * node the query ray passes through, which keeps MIS weights exact.
+ ******************************************************************************/
+
+// cos(a - b) and sin(a - b), clamped so the difference never goes below 0
+inline float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  if (cosA > cosB)
+    return 1.0f;
+
+  return cosA * cosB + sinA * sinB;
+}
+
+inline float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  if (cosA > cosB)
+    return 0;
+
+  return sinA * cosB - cosA * sinB;
+}
+
+// smallest cone containing cones a and b
+void unionCone(const vec3f& axisA, float cosA, const vec3f& axisB, float cosB,
+                vec3f& axis, float& cosTheta) {
+  float thetaA = acosf(clamp(cosA, -1.0f, 1.0f));
+  float thetaB = acosf(clamp(cosB, -1.0f, 1.0f));
+  float thetaD = acosf(clamp(axisA.dot(axisB), -1.0f, 1.0f));
+
+  if (fminf(thetaD + thetaB, pi) <= thetaA) {
+    axis = axisA;
+    cosTheta = cosA;
+    return;
+  }
+
+  if (fminf(thetaD + thetaA, pi) <= thetaB) {
+    axis = axisB;
+    cosTheta = cosB;
+    return;
+  }
+
+  float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+  vec3f rotationAxis = axisA.cross(axisB);
+
+  if (thetaO >= pi || lengthSquared(rotationAxis) < epsilon) {
+    axis = axisA;
+    cosTheta = -1.0f;
+    return;
+  }
+
+  // rotate a's axis towards b's until the cone just covers both
+  axis = Eigen::AngleAxisf(thetaO - thetaA, unitVector(rotationAxis)) * axisA;
+  cosTheta = cosf(thetaO);
+}
+
+lightBounds unionBounds(const lightBounds& a, const lightBounds& b) {
+  lightBounds result;
+
+  result.box = surroundingBox(a.box, b.box);
+  result.power = a.power + b.power;
+  result.cosThetaE = fminf(a.cosThetaE, b.cosThetaE);
+  unionCone(a.axis, a.cosThetaO, b.axis, b.cosThetaO, result.axis, result.cosThetaO);
+
+  return result;
+}
+
+// upper bound style estimate of the power arriving at p, 0 if nothing in the node faces p
+float lightImportance(const lightBounds& bounds, const vec3f& p) {
+  vec3f center = 0.5f * (bounds.box.minimum + bounds.box.maximum);
+  float halfDiagonal2 = 0.25f * lengthSquared(vec3f(bounds.box.maximum - bounds.box.minimum));
+  float distance2 = lengthSquared(vec3f(p - center));
+
+  // angle between the cone axis and the direction to p
+  float cosW = 1.0f;
+
+  if (distance2 > epsilon)
+    cosW = bounds.axis.dot(vec3f(p - center)) / sqrtf(distance2);
+
+  float sinW = sqrtf(fmaxf(1.0f - cosW * cosW, 0));
+
+  // angle subtended by the node's bounding sphere
+  float cosB = -1.0f;
+
+  if (distance2 > halfDiagonal2)
+    cosB = sqrtf(fmaxf(1.0f - halfDiagonal2 / distance2, 0));
+
+  float sinB = sqrtf(fmaxf(1.0f - cosB * cosB, 0));
+  float sinO = sqrtf(fmaxf(1.0f - bounds.cosThetaO * bounds.cosThetaO, 0));
+
+  float cosX = cosSubClamped(sinW, cosW, sinO, bounds.cosThetaO);
+  float sinX = sinSubClamped(sinW, cosW, sinO, bounds.cosThetaO);
+  float cosP = cosSubClamped(sinX, cosX, sinB, cosB);
+
+  if (cosP <= bounds.cosThetaE)
+    return 0;
+
+  return bounds.power * cosP / fmaxf(distance2, halfDiagonal2);
+}
+
+class lightBVH : public hittable {
+  public:
+    lightBVH(const materialTable& materials, const std::vector<shared_ptr<hittable>>& srcLights);
+
+    // only used for light sampling, rays hit the emitters through the scene itself
+    virtual bool  hit(const ray& r, float tMin, float tMax, hitRecord& record) const override { return false; }
+    virtual bool  boundingBox(float time0, float time1, aabb& outputBox) const override;
+    virtual void  calcTangentBasis(const vec3f& normal, vec3f& tangent, vec3f& bitangent) const override {}
+    virtual int   populateVector(class shared_ptr<class hittableVector> hittableVector) const override {
+        return -1;
+      }
+
+    virtual float pdfValue(const vec3f& o, const vec3f& v) const override;
+    virtual vec3f random(const vec3f& o) const override;
+
+    size_t        size() const { return lights.size(); }
+
+  private:
+    // children are at index + 1 and right, leaves store their light
+    struct lightNode {
+      lightBounds bounds;
+      int         right;
+      int         light;
+    };
+
+    int           build(std::vector<int>& indices, size_t start, size_t end);
+
+    // probability of descending into the left child of an interior node
+    float         leftProbability(int index, const vec3f& p) const {
+      float left = lightImportance(nodes[index + 1].bounds, p);
+      float right = lightImportance(nodes[nodes[index].right].bounds, p);
+
+      // neither child faces p, keep the walk going so random() always returns a light sample
+      if (left + right <= 0)
+        return 0.5f;
+
+      return left / (left + right);
+    }
+
+  private:
+    std::vector<shared_ptr<hittable>> lights;
+    std::vector<lightBounds>          lightInfo;
+    std::vector<lightNode>            nodes;
+};
+
+lightBVH::lightBVH(const materialTable& materials, const std::vector<shared_ptr<hittable>>& srcLights) {
+  std::vector<int>  indices;
+
+  for (const auto& light : srcLights) {
+    lightBounds bounds;
+
+    // black emitters never contribute and are left out
+    if (!light->emitterBounds(materials, bounds) || bounds.power <= 0)
+      continue;
+
+    indices.push_back(lights.size());
+    lights.push_back(light);
+    lightInfo.push_back(bounds);
+  }
+
+  if (!indices.empty()) {
+    nodes.reserve(2 * indices.size() - 1);
+    build(indices, 0, indices.size());
+  }
+}
+
+int lightBVH::build(std::vector<int>& indices, size_t start, size_t end) {
+  int index = nodes.size();
+  nodes.emplace_back();
+
+  if (end - start == 1) {
+    nodes[index].bounds = lightInfo[indices[start]];
+    nodes[index].right = -1;
+    nodes[index].light = indices[start];
+
+    return index;
+  }
+
+  // split at the median centroid along the widest axis
+  vec3f minCentroid(infinity, infinity, infinity);
+  vec3f maxCentroid(-infinity, -infinity, -infinity);
+
+  for (size_t i = start; i < end; i++) {
+    const aabb& box = lightInfo[indices[i]].box;
+    vec3f       centroid = 0.5f * (box.minimum + box.maximum);
+
+    minCentroid = minCentroid.cwiseMin(centroid);
+    maxCentroid = maxCentroid.cwiseMax(centroid);
+  }
+
+  vec3f extent = maxCentroid - minCentroid;
+  int   axis = (extent(0) > extent(1) && extent(0) > extent(2)) ? 0 : (extent(1) > extent(2) ? 1 : 2);
+  auto  mid = start + (end - start) / 2;
+
+  std::nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end,
+                    [&](int a, int b) {
+                      return lightInfo[a].box.minimum(axis) + lightInfo[a].box.maximum(axis) <
+                              lightInfo[b].box.minimum(axis) + lightInfo[b].box.maximum(axis);
+                    });
+
+  build(indices, start, mid);
+  int right = build(indices, mid, end);
+
+  nodes[index].bounds = unionBounds(nodes[index + 1].bounds, nodes[right].bounds);
+  nodes[index].right = right;
+  nodes[index].light = -1;
+
+  return index;
+}
+
+bool lightBVH::boundingBox(float time0, float time1, aabb& outputBox) const {
+  if (nodes.empty())
+    return false;
+
+  outputBox = nodes[0].bounds.box;
+  return true;
+}
+
+float lightBVH::pdfValue(const vec3f& o, const vec3f& v) const {
+  if (nodes.empty())
+    return 0;
+
+  struct stackEntry {
+    int   node;
+    float probability;
+  };
+
+  stackEntry  stack[64];
+  int         stackSize = 0;
+  float       sum = 0;
+  ray         r(o, v);
+
+  stack[stackSize++] = {0, 1.0f};
+
+  while (stackSize > 0) {
+    stackEntry        entry = stack[--stackSize];
+    const lightNode&  node = nodes[entry.node];
+
+    if (!node.bounds.box.hit(r, 0.001f, infinity))
+      continue;
+
+    if (node.light >= 0) {
+      sum += entry.probability * lights[node.light]->pdfValue(o, v);
+      continue;
+    }
+
+    float pLeft = leftProbability(entry.node, o);
+
+    if (pLeft > 0)
+      stack[stackSize++] = {entry.node + 1, entry.probability * pLeft};
+    if (pLeft < 1.0f)
+      stack[stackSize++] = {node.right, entry.probability * (1.0f - pLeft)};
+  }
+
+  return sum;
+}
+
+vec3f lightBVH::random(const vec3f& o) const {
+  if (nodes.empty())
+    return vec3f(1.0f, 0, 0);
+
+  const float oneMinusEpsilon = 1.0f - epsilon;
+  int         index = 0;
+  float       u = randomFloat();
+
+  // one random number, rescaled at every level
+  while (nodes[index].light < 0) {
+    float pLeft = leftProbability(index, o);
+
+    if (u < pLeft) {
+      u = fminf(u / pLeft, oneMinusEpsilon);
+      index = index + 1;
+    }
+    else {
+      u = fminf((u - pLeft) / (1.0f - pLeft), oneMinusEpsilon);
+      index = nodes[index].right;
+    }
+  }
+
+  return lights[nodes[index].light]->random(o);
+}
+
+// emitters of a scene in the form rayColor samples them from, an image environment is picked
+// as often as the tree or as any single light in the uniform list
+hittableList buildLights(const hittableList& objects, const materialTable& materials,
+                          const shared_ptr<environmentLight>& environment = nullptr) {
+  hittableList  lights;
+
+  objects.collectLights(materials, lights.objects);
+
+  if (settings.lightSelection == lightSampling::tree && lights.objects.size() > 1)
+    lights = hittableList(make_shared<lightBVH>(materials, lights.objects));
+
+  if (environment && environment->importanceSampled() && settings.environmentSampling)
+    lights.add(environment);
+
+  return lights;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <ostream>
 #include <memory>
+#include <vector>
 
 #include "Eigen/Core"
 #include "Eigen/Geometry"
@@ -15,8 +16,19 @@
 #include "camera.h"
 #include "material.h"
 #include "bvh.h"
+#include "lightbvh.h"
+#include "envmap.h"
 #include "model.h"
+#include "texturecache.h"
 #include "gl.h"
+#include "photonmap.h"
+#include "denoise.h"
+#include "film.h"
+#include "checkpoint.h"
+#include "render.h"
+#include "daemon.h"
+#include "animation.h"
+#include "bench.h"
 
 using namespace Eigen;
 
@@ -30,28 +42,8 @@ using quatf = Quaternion<float>;
 
 shared_ptr<hittableVector> sceneIndexed;
 
-color3f rayColor(const ray &r, const color3f& background, const hittable &world, int maxBounce) {
-  hitRecord record;
-
-  if (maxBounce <= 0)
-    return color3f(0, 0, 0);
-
-  if (!world.hit(r, 0.001f, infinity, record))
-    return background;
-
-  ray     scattered;
-  color3f attenuation;
-  color3f emitted = record.matPtr->emitted(record.uv(0), record.uv(1), record.p);
-
-  if (!record.matPtr->scatter(r, record, attenuation, scattered))
-    return emitted;
-
-  color3f newColor = rayColor(scattered, background, world, maxBounce - 1);
-  newColor = color3f(newColor(0) * attenuation(0), newColor(1) * attenuation(1), newColor(2) * attenuation(2));
-  return emitted + newColor;
-}
-
-hittableList randomScene() {
+hittableList randomScene(materialTable& materials, hittableList& lights,
+                          const shared_ptr<environmentLight>& environment) {
   hittableList  objects;
   hittableList  scene;
   shared_ptr<model> testModel;
@@ -60,7 +52,7 @@ hittableList randomScene() {
   if (0) {
     //testModel = model::create("../data/cube.gltf");
     testModel = model::create("../data/square.gltf");
-    testModel->init();
+    testModel->init(materials);
 
     //AngleAxisf      rotate(deg2rad(180.0f), vec3f::UnitX());
     AngleAxisf      rotate(deg2rad(-15.0f), vec3f::UnitY());
@@ -72,11 +64,11 @@ hittableList randomScene() {
   else if (1) {
     //testModel = model::create("../data/masterchief-sep.gltf");
     testModel = model::create("../data/masterchief2-separate-xf.gltf");
-    testModel->init();
+    testModel->init(materials);
   }
   else {
     testModel = model::create("../data/scene.gltf");
-    testModel->init();
+    testModel->init(materials);
   }
 
   for (const auto& mesh : testModel->meshes) {
@@ -87,7 +79,7 @@ hittableList randomScene() {
 
   //auto ground_material = make_shared<pbrMetallicRoughness>(color3f(0.5, 0.5, 0.5));
   auto checkerTex = make_shared<checker>(color3f(0.2f, 0.3f, 0.1f), color3f(0.9f, 0.9f, 0.9f));
-  objects.add(make_shared<sphere>(vec3f(0,-1000,0.0f), vec3f(0,-1000,0.0f), 0, 1.0f, 1000, make_shared<pbrMetallicRoughness>(checkerTex)));
+  objects.add(make_shared<sphere>(vec3f(0,-1000,0.0f), vec3f(0,-1000,0.0f), 0, 1.0f, 1000, materials.add(pbrMetallicRoughness(checkerTex))));
 
 /*    for (int a = -11; a < 11; a++) {
       for (int b = -11; b < 11; b++) {
@@ -123,26 +115,30 @@ hittableList randomScene() {
 #if 1
   //auto material1 = make_shared<dielectric>(1.5);
   //spheres.add(make_shared<sphere>(vec3f(0, 1, 0), vec3f(0, 1, 0), 0, 1.0f, 1.0f, material1));
-  auto lightMat = make_shared<diffuseLight>(color3f(250.2f, 220.9f, 110.2f));
+  auto lightMat = materials.add(diffuseLight(color3f(250.2f, 220.9f, 110.2f)));
   objects.add(make_shared<sphere>(vec3f(-7.0f, 4.0f, 6.0f), vec3f(-7.0f, 4.0f, 6.0f), 0, 1.0f, 1.0f, lightMat));
 
   //auto material2 = make_shared<pbrMetallicRoughness>(color3f(0.4, 0.2, 0.1));
   //spheres.add(make_shared<sphere>(vec3f(-4, 1, 0), vec3f(-4, 1, 0), 0, 1.0f, 1.0f, material2));
   //spheres.add(make_shared<sphere>(vec3f(0, 1, 2.25f), vec3f(0, 1, 2.25f), 0, 1.0f, 1.0f, material2));
 
-  auto ironAlbedo = make_shared<imagePNG>("../data/rustediron2_basecolor-2x1.png", 3);
-  auto ironNMap = make_shared<imagePNG>("../data/rustediron2_normal-2x1.png", 3);
-  auto ironMMap = make_shared<imagePNG>("../data/rustediron2_metallic-2x1.png", 1);
-  auto ironRMap = make_shared<imagePNG>("../data/rustediron2_roughness-2x1.png", 1);
-  auto ironMat = make_shared<pbrMetallicRoughness>(ironAlbedo, ironNMap,
-                                                    ironMMap, ironRMap,
-                                                    vec4f(1.0f, 1.0f, 1.0f, 1.0f));
+  auto ironAlbedo = loadTexture("../data/rustediron2_basecolor-2x1.png", 3);
+  auto ironNMap = loadTexture("../data/rustediron2_normal-2x1.png", 3, textureUsage::normal);
+  auto ironMMap = loadTexture("../data/rustediron2_metallic-2x1.png", 1, textureUsage::scalar);
+  auto ironRMap = loadTexture("../data/rustediron2_roughness-2x1.png", 1, textureUsage::scalar);
+  pbrMetallicRoughness ironMat(ironAlbedo, ironNMap,
+                                ironMMap, ironRMap,
+                                vec4f(1.0f, 1.0f, 1.0f, 1.0f));
+#if USE_MATERIAL_BAKE
+  ironMat.bake();
+#endif
   objects.add(make_shared<sphere>(vec3f(-3.0f, 1.0f, 0.0f), vec3f(-3.0f, 1.0f, 0.0f), 0, 1.0f, 1.0f,
-                                  ironMat));
+                                  materials.add(ironMat)));
 
-  auto material3 = make_shared<metal>(color3f(0.7, 0.6, 0.5), 0.0);
+  auto material3 = materials.add(metal(color3f(0.7, 0.6, 0.5), 0.0));
   objects.add(make_shared<sphere>(vec3f(3.0f, 1.0f, 0), vec3f(3.0f, 1.0f, 0), 0, 1.0f, 1.0f, material3));
 #endif
+  lights = buildLights(objects, materials, environment);
   scene.add(make_shared<bvhNode>(objects, 0, 1));
 
   sceneIndexed = hittableVector::create();
@@ -153,7 +149,45 @@ hittableList randomScene() {
   //return objects;
 }
 
-int main(int, char**) {
+// image's mean, or its denoised mean when the film has AOVs, to an 8 bit target
+void resolveImage(const film& image, uint8_t* target) {
+  if (!image.hasAOVs()) {
+    image.toTarget(target, 4);
+    return;
+  }
+
+  std::vector<color3f>  noisy, beauty;
+  aovBuffers            aovs;
+  int                   numSamples = image.gather(noisy, &aovs);
+
+  denoise(noisy, numSamples, aovs, image.width(), image.height(), beauty);
+
+  for (int y = 0; y < image.height(); ++y) {
+    for (int x = 0; x < image.width(); ++x)
+      writeColorTarget(target, x, y, image.width(), image.height(), 4, beauty[y * image.width() + x], 1);
+  }
+}
+
+// the partial films of a distributed render's workers to test.png and test.exr
+bool mergeShards(const std::vector<std::string>& filenames) {
+  film  merged(0, 0);
+
+  if (!mergeFilms(filenames, merged))
+    return false;
+
+  std::vector<uint8_t>  target(4 * merged.width() * merged.height());
+
+  std::cerr << "Merged " << filenames.size() << " films, " << merged.maxCount() << " spp, estimated relative error "
+            << merged.relativeError() << "\n";
+  resolveImage(merged, target.data());
+
+  return writePNG("test.png", merged.width(), merged.height(), target.data()) && merged.writeEXR("test.exr");
+}
+
+int main(int argc, char** argv) {
+  if (argc > 2 && std::string(argv[1]) == "--bench")
+    return runBenchmark(argv[2]);
+
   // camera
 #if USE_OPENGL
   const auto  aspect = 2.0f;
@@ -166,8 +200,12 @@ int main(int, char**) {
   vec3f       vUp(0, 1.0f, 0);
   auto        distToFocus = 10.0f; //(eye - lookAt).length();
   auto        aperture = 0.1f; //2.0f;
+#if USE_ENVIRONMENT_MAP
+  auto        background = make_shared<environmentLight>("../data/sky.hdr");
+#else
   // sky blue day
-  color3f     background(0.53f, 0.81f, 0.92f);
+  auto        background = make_shared<environmentLight>(color3f(0.53f, 0.81f, 0.92f));
+#endif
 
   camera      mainCamera(eye, lookAt, vUp, 70.0f, aspect, aperture, distToFocus, 0, 1.0f);
 
@@ -178,13 +216,164 @@ int main(int, char**) {
   const int   numSamples = 5000;
   //const int   numSamples = 1000;
   const int   maxBounce = 4;
-  const vec3f samplePos(0, 0.8f, 0);
+  const int   maxPassSamples = 64;
+  const int   previewScale = 8;       // first pass at 1/8 resolution
+#if USE_CHECKPOINTS
+  const float checkpointInterval = 60.0f;
+#endif
+
+  // options: --resume, --spp <n>, --time <seconds>, --noise <relative error>. Workers of a
+  // distributed render take --shard <index>/<count>, and --shard-samples to split samples rather
+  // than tiles, and write test.shard<index>.srtc instead of images. --merge <films...> combines
+  // them into test.png and test.exr. --serve <port> keeps running as a render daemon writing under
+  // --output-dir <dir>, see daemon.h. --frames <n> renders a turntable to frame0000.png onwards.
+  // --stream renders straight to test.png and test.exr a band at a time, for frames too large to
+  // hold. --guiding trains a path guide on the first passes of the progressive render, see guiding.h.
+  // --photons <n> and --photon-radius <r> set the caustic photons traced per pass and the initial
+  // gather radius when USE_CAUSTIC_PHOTONS is on, see photonmap.h
+  bool                      resume = false;
+  int                       requestedSamples = 0;
+  renderBudget              budget;
+  int                       shardIndex = 0, shardCount = 1;
+  bool                      bySamples = false;
+  std::vector<std::string>  mergeFilenames;
+  int                       servePort = -1;
+  std::string               outputDirectory = ".";
+  int                       numFrames = 0;
+  bool                      streamed = false;
+  int                       photonsPerPass = 1000000;
+  float                     photonRadius = 0.02f;
+
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+
+    if (option == "--resume")
+      resume = true;
+    else if (option == "--spp" && i + 1 < argc)
+      requestedSamples = atoi(argv[++i]);
+    else if (option == "--time" && i + 1 < argc)
+      budget.seconds = atof(argv[++i]);
+    else if (option == "--noise" && i + 1 < argc)
+      budget.error = static_cast<float>(atof(argv[++i]));
+    else if (option == "--shard" && i + 1 < argc) {
+      if (sscanf(argv[++i], "%d/%d", &shardIndex, &shardCount) != 2 || shardIndex < 0 || shardIndex >= shardCount) {
+        std::cerr << "ERROR: Expected --shard <index>/<count>, got '" << argv[i] << "'\n";
+        return 1;
+      }
+    }
+    else if (option == "--shard-samples")
+      bySamples = true;
+    else if (option == "--serve" && i + 1 < argc)
+      servePort = atoi(argv[++i]);
+    else if (option == "--output-dir" && i + 1 < argc)
+      outputDirectory = argv[++i];
+    else if (option == "--frames" && i + 1 < argc)
+      numFrames = atoi(argv[++i]);
+    else if (option == "--stream")
+      streamed = true;
+    else if (option == "--guiding")
+      settings.pathGuiding = true;
+    else if (option == "--photons" && i + 1 < argc)
+      photonsPerPass = atoi(argv[++i]);
+    else if (option == "--photon-radius" && i + 1 < argc)
+      photonRadius = static_cast<float>(atof(argv[++i]));
+    else if (option == "--merge") {
+      mergeFilenames.assign(argv + i + 1, argv + argc);
+      break;
+    }
+    else {
+      std::cerr << "ERROR: Unknown option '" << option << "'\n";
+      return 1;
+    }
+  }
+
+  if (!mergeFilenames.empty())
+    return mergeShards(mergeFilenames) ? 0 : 1;
+
+  if (photonsPerPass <= 0 || !(photonRadius > 0)) {
+    std::cerr << "ERROR: --photons and --photon-radius must be positive\n";
+    return 1;
+  }
+
+  if ((numFrames > 0 || streamed) &&
+      (budget.seconds > 0 || budget.error > 0 || shardCount > 1 || settings.pathGuiding)) {
+    std::cerr << "ERROR: --frames and --stream take --spp, not budgets, shards or guiding\n";
+    return 1;
+  }
+
+  if (servePort >= 0) {
+    renderDaemon  daemon(outputDirectory);
+    int           port = daemon.listen(servePort);
+
+    if (port < 0)
+      return 1;
+
+    std::cerr << "Serving renders on 127.0.0.1:" << port << "\n";
+    daemon.serve();
+
+    return 0;
+  }
+
+  // --spp with --resume raises the target of the saved film, which otherwise keeps its own
+  bool  samplesGiven = requestedSamples > 0;
+
+  // budgets alone render until they run out
+  if (!requestedSamples)
+    requestedSamples = budget.seconds > 0 || budget.error > 0 ? unlimitedSamples : numSamples;
+
+  renderShard shard;
+  int         shardSamples = splitShard(shard, shardIndex, shardCount, bySamples, requestedSamples);
+  bool        writeImages = shard.count == 1;
+  std::string filmFilename = writeImages ? "test.srtc" : "test.shard" + std::to_string(shard.index) + ".srtc";
+
+  mainCamera.setImageHeight(imageHeight);
   uint8_t*    target = static_cast<uint8_t*>(malloc(sizeof(uint8_t) * 4 * imageWidth * imageHeight));
   //uint8_t*    targetCompute = static_cast<uint8_t*>(malloc(sizeof(uint8_t) * 4 * imageWidth * imageHeight));
   uint8_t*    targetCompute = static_cast<uint8_t*>(malloc(sizeof(float) * 4 * imageWidth * imageHeight));
 
   // world
-  hittableList world = randomScene();
+  materialTable materials;
+  hittableList  lights;
+  hittableList  world = randomScene(materials, lights, background);
+
+#if USE_CAUSTIC_PHOTONS
+  causticMap    causticPhotons(photonsPerPass, photonRadius);
+  causticMap*   caustics = &causticPhotons;
+
+  causticPhotons.emit(world, materials);
+#else
+  causticMap*   caustics = nullptr;
+#endif
+
+  // one orbit around the look at point every 5 seconds at 24 fps
+  if (numFrames > 0) {
+    vec3f         offset = eye - lookAt;
+    animatedScene turntable(world, lights, cameraPath::orbit(lookAt, vec3f(offset(0), 0, offset(2)).norm(),
+                                                              offset(1), 70.0f, 5.0f));
+    auto          timings = renderSequence(turntable, materials, *background, imageWidth, imageHeight, numFrames,
+                                            24.0f, requestedSamples, maxBounce, "frame%04d.png");
+
+    for (size_t f = 0; f < timings.size(); f++) {
+      std::cerr << "Frame " << f << ": setup " << timings[f].setup * 1000.0 << " ms, render " << timings[f].render
+                << " s, encode " << timings[f].encode * 1000.0 << " ms\n";
+    }
+
+    return timings.empty() ? 1 : 0;
+  }
+
+  if (streamed) {
+    pngStream png("test.png", imageWidth, imageHeight);
+    exrStream exr("test.exr", imageWidth, imageHeight);
+    auto      renderStart = benchClock::now();
+    bool      ok = png.ok() && exr.ok() &&
+                    renderStreamed(world, materials, lights, mainCamera, *background, imageWidth, imageHeight,
+                                    requestedSamples, maxBounce, &png, &exr, 2 * filmTileSize, caustics);
+
+    std::cerr << "Streamed " << requestedSamples << " spp in " << secondsSince(renderStart) << " s\n";
+
+    return ok ? 0 : 1;
+  }
+
   std::cout << "P3\n" << imageWidth << ' ' << imageHeight << "\n255\n";
 
 #if USE_OPENGL
@@ -197,33 +386,103 @@ int main(int, char**) {
   while (glDevice.rtFrame(target, imageWidth, imageHeight, sceneIndexed->objects)) {
 #endif  // USE_COMPUTE
 #endif  // USE_OPENGL
-    for (int y = 0; y < imageHeight; ++y) {
-      std::cerr << "\rScanlines remaining: " << (imageHeight - y) << ' ' << std::flush;
-      for (int x = 0; x < imageWidth; ++x) {
-        color3f pixelColor(0, 0, 0);
-        for (int s = 0; s < numSamples; ++s) {
-          AngleAxisf rotate(deg2rad(15.0f) + deg2rad(90.0f * s), vec3f::UnitZ());
-          mat33f     m = rotate.matrix();
-          vec3f      newSamplePos = m * samplePos;
-
-          // random samples
-          auto  u = float(x + randomFloat()) / (imageWidth - 1);
-          auto  v = float((imageHeight - y) + randomFloat()) / (imageHeight - 1);
-
-          // 4x rotated grid
-          //auto  u = float((w + newSamplePos(0)) / (imageWidth - 1));
-          //auto  v = float((h + newSamplePos(1)) / (imageHeight - 1));
-          ray   r = mainCamera.getRay(u, v);
-          pixelColor += rayColor(r, background, world, maxBounce);
-        }
-
-        //writeColor(std::cout, pixelColor, numSamples);
+    film  image(imageWidth, imageHeight, USE_DENOISER);
+    int   targetSamples = shardSamples;
+    auto  renderStart = benchClock::now();
+
+    image.setShard(shard);
+
 #if USE_COMPUTE
-        writeColorTarget(targetCompute, x, y, imageWidth, imageHeight, 4, pixelColor, numSamples);
+    uint8_t*  output = targetCompute;
 #else
-        writeColorTarget(target, x, y, imageWidth, imageHeight, 4, pixelColor, numSamples);
+    uint8_t*  output = target;
 #endif
+
+#if USE_CHECKPOINTS
+    checkpointWriter  checkpoints(filmFilename);
+    auto              lastCheckpoint = benchClock::now();
+
+    int               savedSamples;
+
+    if (resume && readCheckpoint(filmFilename, image, savedSamples)) {
+      if (!samplesGiven)
+        targetSamples = savedSamples;
+
+      std::cerr << "Resuming at " << image.maxCount() << " of " << targetSamples << " spp\n";
+    }
+#endif
+
+#if USE_PROGRESSIVE
+    // something to look at within seconds
+    if (writeImages && image.maxCount() == 0) {
+      film  preview(imageWidth / previewScale, imageHeight / previewScale);
+
+      renderFilm(world, materials, lights, mainCamera, *background, preview, 1, maxBounce, caustics);
+      preview.toTarget(output, 4, imageWidth, imageHeight);
+      writePNG("test.png", imageWidth, imageHeight, output);
+      std::cerr << "Preview after " << secondsSince(renderStart) << " s\n";
+    }
+#endif
+
+    // progressive passes until the target or a budget is reached, checkpointed in between
+    bool    predicted = false;
+    aabb    sceneBounds;
+
+    // learns from this run's first passes, resumed renders included
+    world.boundingBox(0, 1.0f, sceneBounds);
+    sdTree  guide(sceneBounds);
+
+    renderProgressive(world, materials, lights, mainCamera, *background, image, targetSamples, maxPassSamples,
+                      budget, maxBounce, caustics, [&](double elapsed, double secondsPerSample) {
+      int done = image.maxCount();
+
+      std::cerr << "\r" << done << " spp, error " << image.relativeError() << ", " << elapsed << " s   "
+                << std::flush;
+
+      if (!predicted && budget.seconds > 0 && done >= 2) {
+        budgetPrediction  prediction = predictBudget(image, budget, targetSamples, elapsed, secondsPerSample);
+
+        std::cerr << "\n" << secondsPerSample << " s per spp, the " << budget.seconds << " s budget is predicted "
+                  << (prediction.reachesTarget ? "to suffice: " : "to stop at ") << prediction.samples << " spp after "
+                  << prediction.seconds << " s, error " << prediction.error << "\n";
+        predicted = true;
+      }
+
+#if USE_CHECKPOINTS
+      if (secondsSince(lastCheckpoint) >= checkpointInterval && checkpoints.save(image, targetSamples))
+        lastCheckpoint = benchClock::now();
+#endif
+
+#if USE_PROGRESSIVE
+      if (writeImages && done < targetSamples) {
+        resolveImage(image, output);
+        writePNG("test.png", imageWidth, imageHeight, output);
       }
+#endif
+    }, settings.pathGuiding ? &guide : nullptr);
+
+    std::cerr << "\nRendered " << image.maxCount() << " spp in " << secondsSince(renderStart)
+              << " s, estimated relative error " << image.relativeError();
+
+#if USE_CHECKPOINTS
+    checkpoints.wait();
+#endif
+
+    if (writeImages) {
+      auto  resolveStart = benchClock::now();
+
+      resolveImage(image, output);
+      std::cerr << "\nResolved in " << secondsSince(resolveStart) << " s";
+
+      image.writeEXR("test.exr");
+
+      // the exr only has the means, the finished film stays resumable with counts and AOVs
+      writeCheckpoint(filmFilename, image, targetSamples, generatorSeeds());
+    }
+    else {
+      // the worker's partial film for --merge, the last checkpoint has the same name
+      writeCheckpoint(filmFilename, image, targetSamples, generatorSeeds());
+      std::cerr << "\nWrote shard " << shard.index << " of " << shard.count << " to " << filmFilename;
     }
 #if USE_OPENGL
   }
@@ -232,11 +491,17 @@ int main(int, char**) {
 #endif  // USE_OPENGL
 
 #if USE_COMPUTE
-  stbi_write_png("test.png", imageWidth, imageHeight, 4, target, 4 * imageWidth);
+  if (writeImages)
+    writePNG("test.png", imageWidth, imageHeight, target);
 #else
-  stbi_write_png("test.png", imageWidth, imageHeight, 4, target, 4 * imageWidth);
+  if (writeImages)
+    writePNG("test.png", imageWidth, imageHeight, target);
 #endif
   free(target);
 
+#if USE_TEXTURE_CACHE
+  defaultTextureCache().printStats(std::cerr);
+#endif
+
   std::cerr << "\nDone.\n";
 }
@@ -3,41 +3,102 @@
 
 #include <cmath>
 #include <algorithm>
+#include <array>
+#include <utility>
+#include <variant>
+#include <vector>
 
 #include "globals.h"
+#include "hittable.h"
+#include "settings.h"
 #include "texture.h"
 #include "pbr.h"
+#include "pbrbake.h"
 
 using namespace Eigen;
 
-struct hitRecord;
+// widen a ray cone after scattering off a surface, rougher lobes spread faster
+inline float scatterSpread(float spread, float roughness) {
+  return spread + 0.5f * pi * roughness * roughness;
+}
 
+// Materials are a closed set held by value in a materialTable and dispatched with std::visit,
+// so there are no virtual calls. Each provides
+//
+//   bool scatter(rIn, record, attenuation, scatterRay, pdf)
+//
+// where pdf is the solid angle density of scatterRay, 0 for delta lobes that light sampling can't
+// reach. The defaults below are hidden by the materials that need something else.
 class material {
   public:
-    virtual bool    scatter(const ray& rIn, const hitRecord& record, color3f& attenuation, ray& scatterRay) const = 0;
-    virtual color3f emitted(float u, float v, const vec3f& p) const {
+    color3f emitted(float u, float v, const vec3f& p) const {
       return color3f(0, 0, 0);
     }
+    bool    isEmissive() const { return false; }
+
+    // scatter() has no pdf to evaluate, caustic photons pass through instead of being stored
+    bool    isSpecular() const { return false; }
+
+    // f * cos towards a unit direction and the pdf scatter() would have sampled it with,
+    // false if the material has no lobe to evaluate
+    bool    evalScatter(const ray& rIn, const hitRecord& record, const vec3f& dir,
+                        color3f& value, float& pdf) const {
+      return false;
+    }
+
+    // albedo and shading normal written to the denoiser's AOVs
+    void    surfaceAOV(const ray& rIn, const hitRecord& record, color3f& albedo, vec3f& normal) const {
+      albedo = color3f(1.0f, 1.0f, 1.0f);
+      normal = record.normal;
+    }
+};
+
+// shading inputs at a hit point, resolved from maps and factors
+struct pbrSurface {
+  vec3f   normal;
+  color3f baseColor;
+  float   metallic;
+  float   roughness;
+  float   occlusion;
+};
+
+// GGX with alpha = roughness^2 becomes a delta below this
+const float minRoughness = 0.03f;
+
+// what a surfaceAt kernel is specialized on, absent maps fall back to the constant factors
+enum pbrFeature : uint32_t {
+  pbrAlbedoTexture            = 1 << 0,
+  pbrAlbedoFactor             = 1 << 1,   // albedo texture scaled by a factor other than 1
+  pbrNormalTexture            = 1 << 2,
+  pbrMetallicRoughnessTexture = 1 << 3,
+  pbrMetallicTexture          = 1 << 4,
+  pbrRoughnessTexture         = 1 << 5,
+  pbrOcclusionTexture         = 1 << 6,
+  pbrBaked                    = 1 << 7    // shadingMap, never combined with the others
 };
 
 class pbrMetallicRoughness : public material {
   public:
     pbrMetallicRoughness(const color3f& a) :
-                          albedoMap(make_shared<solidColor>(a)),
+                          albedoMap(make_shared<solidColor>(a * 255.0f)),
                           normalMap(0),
-                          albedo(vec4f(1.0f, 1.0f, 1.0f, 1.0f)) {}
+                          albedo(vec4f(1.0f, 1.0f, 1.0f, 1.0f)),
+                          metalness(0), roughness(0), anisotropy(0) {}
     pbrMetallicRoughness(shared_ptr<texture> aMap) :
                           albedoMap(aMap),
                           normalMap(0),
-                          albedo(vec4f(1.0f, 1.0f, 1.0f, 1.0f)) {}
+                          albedo(vec4f(1.0f, 1.0f, 1.0f, 1.0f)),
+                          metalness(0), roughness(0), anisotropy(0) {}
     pbrMetallicRoughness(shared_ptr<texture> aMap,
                           vec4f a) :
                           albedoMap(aMap),
                           normalMap(0),
-                          albedo(a) {}
+                          albedo(a),
+                          metalness(0), roughness(0), anisotropy(0) {}
     pbrMetallicRoughness(shared_ptr<texture> aMap, shared_ptr<texture> nMap) :
                           albedoMap(aMap), normalMap(nMap),
-                          albedo(vec4f(1.0f, 1.0f, 1.0f, 1.0f)) {}
+                          albedo(vec4f(1.0f, 1.0f, 1.0f, 1.0f)),
+                          metalness(0), roughness(0), anisotropy(0) {}
     pbrMetallicRoughness(shared_ptr<texture> aMap, shared_ptr<texture> nMap,
                           shared_ptr<texture> mMap, shared_ptr<texture> rMap) :
                           albedoMap(aMap), normalMap(nMap),
@@ -69,8 +130,52 @@ class pbrMetallicRoughness : public material {
                           albedoMap(aMap), albedo(a),
                           metalness(m), roughness(r), anisotropy(0) {}
 
-    virtual bool scatter(const ray& rIn, const hitRecord& record, color3f& attenuation,
-                          ray& scatterRay) const override;
+    bool scatter(const ray& rIn, const hitRecord& record, color3f& attenuation,
+                  ray& scatterRay, float& pdf) const;
+    bool evalScatter(const ray& rIn, const hitRecord& record, const vec3f& dir,
+                      color3f& value, float& pdf) const;
+
+    pbrSurface  surfaceAt(const ray& rIn, const hitRecord& record) const { return kernel(*this, rIn, record); }
+
+    void        surfaceAOV(const ray& rIn, const hitRecord& record, color3f& a, vec3f& normal) const {
+      pbrSurface  surface = surfaceAt(rIn, record);
+
+      a = surface.baseColor;
+      normal = surface.normal;
+    }
+
+    // pick the surfaceAt kernel for the current maps and factors, needed again after changing them.
+    // materialTable::add and bake() call it, until then every hit looks the features up
+    void        specialize();
+    uint32_t    features() const;
+
+    // f(l, v) without the cosine factor, both vectors point away from the surface
+    color3f     evalBRDF(const pbrSurface& surface, const vec3f& viewVec, const vec3f& lightVec) const;
+
+    // importance sampling: pick diffuse or GGX lobe, then a direction within it
+    vec3f       sampleDirection(const pbrSurface& surface, const vec3f& viewVec) const;
+    float       pdf(const pbrSurface& surface, const vec3f& viewVec, const vec3f& lightVec) const;
+    float       specularProbability(const pbrSurface& surface, const vec3f& viewVec) const;
+
+    // unit direction drawn with the strategy selected in settings.bsdf, may be below the surface
+    vec3f       scatterDirection(const pbrSurface& surface, const vec3f& viewVec) const;
+
+    // pdf of the strategy selected in settings.bsdf
+    float       scatterPdf(const pbrSurface& surface, const vec3f& viewVec, const vec3f& lightVec) const;
+
+    // pack all maps into one shading map, the source maps are released on success
+    bool bake() {
+      shadingMap = pbrShadingMap::bake(albedoMap, normalMap, metallicRoughnessMap,
+                                        metallicMap, roughnessMap, occlusionMap,
+                                        albedo, metalness, roughness);
+
+      if (!shadingMap)
+        return false;
+
+      albedoMap = normalMap = metallicRoughnessMap = metallicMap = roughnessMap = occlusionMap = nullptr;
+      specialize();
+      return true;
+    }
 
   public:
     shared_ptr<texture> albedoMap;
@@ -78,24 +183,52 @@ class pbrMetallicRoughness : public material {
     shared_ptr<texture> metallicRoughnessMap;
     shared_ptr<texture> metallicMap;
     shared_ptr<texture> roughnessMap;
+    shared_ptr<texture> occlusionMap;
+    shared_ptr<pbrShadingMap> shadingMap;
     vec4f               albedo;
     float               metalness;
     float               roughness;
     float               anisotropy;
+
+  private:
+    using surfaceFn = pbrSurface (*)(const pbrMetallicRoughness&, const ray&, const hitRecord&);
+
+    template <uint32_t features>
+    static pbrSurface   surfaceKernel(const pbrMetallicRoughness& mat, const ray& rIn, const hitRecord& record);
+    static pbrSurface   surfaceUnspecialized(const pbrMetallicRoughness& mat, const ray& rIn,
+                                              const hitRecord& record);
+
+    // every combination below pbrBaked
+    template <size_t... features>
+    static std::array<surfaceFn, sizeof...(features)> surfaceKernels(std::index_sequence<features...>) {
+      return {&surfaceKernel<features>...};
+    }
+
+    surfaceFn           kernel = &surfaceUnspecialized;
 };
 
 class metal : public material {
   public:
     metal(const color3f& a, float f) : albedo(a), fuzz(f < 1.0f ? f : 1.0f) {}
 
-    virtual bool scatter(const ray& rIn, const hitRecord& record, color3f& attenuation, ray& scatterRay) const override {
+    bool scatter(const ray& rIn, const hitRecord& record, color3f& attenuation, ray& scatterRay,
+                  float& pdf) const {
       vec3f reflected = reflect(unitVector(rIn.dir), record.normal);
-      scatterRay = ray(record.p, reflected + fuzz * randomInUnitSphere(), rIn.time);
+      scatterRay = ray(record.p, reflected + fuzz * randomInUnitSphere(), rIn.time,
+                        record.coneWidth, scatterSpread(rIn.coneSpread, fuzz));
       attenuation = albedo;
+      pdf = 0;
 
       return (scatterRay.dir.dot(record.normal) > 0);
     }
 
+    bool isSpecular() const { return true; }
+
+    void surfaceAOV(const ray& rIn, const hitRecord& record, color3f& a, vec3f& normal) const {
+      a = albedo;
+      normal = record.normal;
+    }
+
   public:
     color3f albedo;
     float   fuzz;
@@ -105,8 +238,10 @@ class dielectric : public material {
   public:
     dielectric(float indexRefraction) : ir(indexRefraction) {}
 
-    virtual bool scatter(const ray& rIn, const hitRecord& record, color3f& attenuation, ray& scatterRay) const override {
+    bool scatter(const ray& rIn, const hitRecord& record, color3f& attenuation, ray& scatterRay,
+                  float& pdf) const {
       attenuation = color3f(1.0f, 1.0f, 1.0f);
+      pdf = 0;
       float refractionRatio = record.frontFace ? (1.0f / ir) : ir;
 
       vec3f unitDir = unitVector(rIn.dir);
@@ -121,9 +256,11 @@ class dielectric : public material {
       else
         dir = refract(unitDir, record.normal, refractionRatio);
 
-      scatterRay = ray(record.p, dir, rIn.time);
+      scatterRay = ray(record.p, dir, rIn.time, record.coneWidth, rIn.coneSpread);
       return true;
     }
+
+    bool isSpecular() const { return true; }
   
   public:
     float ir;
@@ -141,107 +278,330 @@ class diffuseLight : public material {
     diffuseLight(shared_ptr<texture> a) : emit(a) {}
     diffuseLight(color3f c) : emit(make_shared<solidColor>(c)) {}
 
-    virtual bool    scatter(const ray& rIn, const hitRecord& record, color3f& attenuation, ray& scatterRay) const override {
+    bool    scatter(const ray& rIn, const hitRecord& record, color3f& attenuation, ray& scatterRay,
+                    float& pdf) const {
       return false;
     }
 
-    virtual color3f emitted(float u, float v, const vec3f& p) const override {
+    color3f emitted(float u, float v, const vec3f& p) const {
       return emit->value(u, v, p);
     }
 
+    bool    isEmissive() const { return true; }
+
   private:
     shared_ptr<texture> emit;
 };
 
-bool pbrMetallicRoughness::scatter(const ray& rIn, const hitRecord& record,
-              color3f& attenuation, ray& scatterRay) const {
-  vec3f halfVec;
-  vec3f normal;
-  float m;
-  float r;
+uint32_t pbrMetallicRoughness::features() const {
+  if (shadingMap)
+    return pbrBaked;
+
+  uint32_t  f = 0;
 
   if (albedoMap) {
-    // sample reflected color for this point
-    attenuation = albedoMap->value(record.uv(0), record.uv(1), record.p);
-    attenuation /= 255.0f;
+    f |= pbrAlbedoTexture;
+
+    if (albedo.head<3>() != vec3f(1.0f, 1.0f, 1.0f))
+      f |= pbrAlbedoFactor;
   }
-  else
-    attenuation = vec3f(albedo(0), albedo(1), albedo(2));
-  
-  if (normalMap) {
-    // sample tangent space normal
-    normal = normalMap->value(record.uv(0), record.uv(1), record.p);
 
-    // convert to range -1 to 1
-    normal = normalIntToFloat(normal);
+  if (normalMap)
+    f |= pbrNormalTexture;
+  if (metallicRoughnessMap)
+    f |= pbrMetallicRoughnessTexture;
+  if (metallicMap)
+    f |= pbrMetallicTexture;
+  if (roughnessMap)
+    f |= pbrRoughnessTexture;
+  if (occlusionMap)
+    f |= pbrOcclusionTexture;
+
+  return f;
+}
+
+void pbrMetallicRoughness::specialize() {
+  static const auto kernels = surfaceKernels(std::make_index_sequence<pbrBaked>());
+  uint32_t          f = features();
+
+  kernel = f == pbrBaked ? &surfaceKernel<pbrBaked> : kernels[f];
+}
+
+pbrSurface pbrMetallicRoughness::surfaceUnspecialized(const pbrMetallicRoughness& mat, const ray& rIn,
+                                                      const hitRecord& record) {
+  static const auto kernels = surfaceKernels(std::make_index_sequence<pbrBaked>());
+  uint32_t          f = mat.features();
 
-    // construct tangent to world space xfrom
-    Matrix3f tangentToWorld;
-    tangentToWorld.col(0) = record.tangent;
-    tangentToWorld.col(1) = record.bitangent;
-    tangentToWorld.col(2) = record.normal;
+  return f == pbrBaked ? surfaceKernel<pbrBaked>(mat, rIn, record) : kernels[f](mat, rIn, record);
+}
+
+template <uint32_t features>
+pbrSurface pbrMetallicRoughness::surfaceKernel(const pbrMetallicRoughness& mat, const ray& rIn,
+                                                const hitRecord& record) {
+  pbrSurface  surface;
+  float       u = record.uv(0);
+  float       v = record.uv(1);
+
+  // texture footprint of the incoming ray cone
+  float       footprint = features ? record.uvFootprint(rIn) : 0;
+
+  // tangent to world space xform
+  auto        toWorld = [&](const vec3f& n) {
+    return unitVector(vec3f(n(0) * record.tangent + n(1) * record.bitangent + n(2) * record.normal));
+  };
+
+  if constexpr ((features & pbrBaked) != 0) {
+    // single fetch of every shading input, factors already applied
+    pbrShadingInputs inputs = mat.shadingMap->fetch(u, v, footprint);
 
-    // xform tangent space normal to world space
-    normal = unitVector(tangentToWorld * normal);
+    surface.baseColor = inputs.albedo;
+    surface.normal = toWorld(inputs.normal);
+    surface.metallic = inputs.metallic;
+    surface.roughness = fmaxf(inputs.roughness, minRoughness);
+    surface.occlusion = inputs.occlusion;
+
+    return surface;
   }
-  else
-    normal = record.normal;
 
-  if (metallicMap) {
-    m = clamp(metallicMap->value(record.uv(0), record.uv(1), record.p)(0) / 255.0f, 0, 1.0f);
+  if constexpr ((features & pbrAlbedoTexture) != 0) {
+    // sample reflected color for this point
+    surface.baseColor = mat.albedoMap->value(u, v, record.p, footprint) / 255.0f;
+
+    if constexpr ((features & pbrAlbedoFactor) != 0)
+      surface.baseColor = surface.baseColor.cwiseProduct(mat.albedo.head<3>());
   }
   else
-    m = metalness;
+    surface.baseColor = mat.albedo.head<3>();
 
-  if (roughnessMap) {
-    r = clamp(roughnessMap->value(record.uv(0), record.uv(1), record.p)(1) / 255.0f, 0, 1.0f);
+  // sampled tangent space normal in range -1 to 1
+  if constexpr ((features & pbrNormalTexture) != 0)
+    surface.normal = toWorld(normalIntToFloat(mat.normalMap->value(u, v, record.p, footprint)));
+  else
+    surface.normal = record.normal;
+
+  // glTF packs roughness in green and metallic in blue, scaled by the factors
+  float       m = mat.metalness;
+  float       r = mat.roughness;
+
+  if constexpr ((features & pbrMetallicRoughnessTexture) != 0) {
+    color3f mr = mat.metallicRoughnessMap->value(u, v, record.p, footprint) / 255.0f;
+
+    m *= mr(2);
+    r *= mr(1);
   }
+
+  if constexpr ((features & pbrMetallicTexture) != 0)
+    m = clamp(mat.metallicMap->value(u, v, record.p, footprint)(0) / 255.0f, 0, 1.0f);
+
+  if constexpr ((features & pbrRoughnessTexture) != 0)
+    r = clamp(mat.roughnessMap->value(u, v, record.p, footprint)(1) / 255.0f, 0, 1.0f);
+
+  if constexpr ((features & pbrOcclusionTexture) != 0)
+    surface.occlusion = mat.occlusionMap->value(u, v, record.p, footprint)(0) / 255.0f;
   else
-    r = roughness;
-  
-  // generate random scatter direction from surface normal
-  vec3f  scatterDir = normal + randomUnitVector();
+    surface.occlusion = 1.0f;
 
-  if (nearZero(scatterDir))
-    scatterDir = normal;
-  
-  scatterDir = unitVector(scatterDir);
-  scatterRay = ray(record.p, scatterDir, rIn.time);
+  surface.metallic = m;
+  surface.roughness = fmaxf(r, minRoughness);
 
-  // BRDF assumes view vector points towards camera
-  vec3f viewVec = -unitVector(rIn.dir);
+  return surface;
+}
+
+color3f pbrMetallicRoughness::evalBRDF(const pbrSurface& surface, const vec3f& viewVec,
+                                        const vec3f& lightVec) const {
+  vec3f halfVec = unitVector(lightVec + viewVec);
+  float m = surface.metallic;
+  float r = surface.roughness;
 
-  // using scatter ray as effective light ray
-  halfVec = unitVector(scatterRay.dir + viewVec);
-  
   // begin PBR BRDF
-  float NdotL = fmaxf(normal.dot(scatterRay.dir), 0);
-  float NdotH = fmaxf(normal.dot(halfVec), 0);
+  float NdotL = fmaxf(surface.normal.dot(lightVec), 0);
+  float NdotH = fmaxf(surface.normal.dot(halfVec), 0);
   float HdotV = fmaxf(halfVec.dot(viewVec), 0);
-  float NdotV = fmaxf(normal.dot(viewVec), 0);
-  float HdotT; // used for anisotropic BRDFs
-  float HdotB; // used for anisotropic BRDFs
+  float NdotV = fmaxf(surface.normal.dot(viewVec), 0);
 
-  //vec3f fresnelReflectance = vec3f(1.0f, 1.0f, 1.0f);
-  vec3f fresnelReflectance = vec3f(albedo(0), albedo(1), albedo(2));
-
-  vec3f F0 = lerp(vec3f(0.4f, 0.4f, 0.4f), fresnelReflectance, m);
+  // 0.04 for nonmetals, tinted by base color for metals
+  vec3f F0 = lerp(vec3f(0.04f, 0.04f, 0.04f), surface.baseColor, m);
   float D = trowbridgeReitzNDF(NdotH, r);
   vec3f F = fresnelEpic(F0, HdotV);
   float G = schlickGAF(NdotL, r) * schlickGAF(NdotV, r);
 
   // final diffuse is a ratio vs specular
-  vec3f finalDiffuse = (attenuation / pi);
+  vec3f finalDiffuse = (surface.baseColor / pi);
   finalDiffuse(0) *= (1.0f - F(0));  finalDiffuse(1) *= (1.0f - F(1));  finalDiffuse(2) *= (1.0f - F(2));
-  finalDiffuse *= (1.0f - m);
-  finalDiffuse(0) *= albedo(0); finalDiffuse(1) *= albedo(1); finalDiffuse(2) *= albedo(2);
+  finalDiffuse *= (1.0f - m) * surface.occlusion;
 
   vec3f finalSpecular = D * F * G / (4.0f * NdotV * NdotL + epsilon);
 
-  // final attenuation *= cosine factor
-  attenuation = vec3f((finalDiffuse + finalSpecular) * NdotL);
+  return finalDiffuse + finalSpecular;
+}
+
+float pbrMetallicRoughness::specularProbability(const pbrSurface& surface, const vec3f& viewVec) const {
+  float NdotV = fmaxf(surface.normal.dot(viewVec), 0);
+  vec3f F0 = lerp(vec3f(0.04f, 0.04f, 0.04f), surface.baseColor, surface.metallic);
+  float specular = luminance(fresnelEpic(F0, NdotV));
+  float diffuse = luminance(surface.baseColor) * (1.0f - surface.metallic);
+
+  // keep both lobes reachable so the combined pdf never drops to zero where f > 0
+  return clamp(specular / (specular + diffuse + epsilon), 0.1f, 0.9f);
+}
+
+float pbrMetallicRoughness::pdf(const pbrSurface& surface, const vec3f& viewVec, const vec3f& lightVec) const {
+  float NdotL = surface.normal.dot(lightVec);
+  float NdotV = surface.normal.dot(viewVec);
+
+  if (NdotL <= 0)
+    return 0;
+
+  float diffusePdf = NdotL / pi;
+
+  if (NdotV <= 0)
+    return diffusePdf;
+
+  float pSpecular = specularProbability(surface, viewVec);
+  float NdotH = fmaxf(surface.normal.dot(unitVector(lightVec + viewVec)), 0);
+  float specularPdf = ggxVNDFPdf(NdotV, NdotH, surface.roughness);
+
+  return pSpecular * specularPdf + (1.0f - pSpecular) * diffusePdf;
+}
+
+vec3f pbrMetallicRoughness::sampleDirection(const pbrSurface& surface, const vec3f& viewVec) const {
+  vec3f tangent, bitangent;
+  buildBasis(surface.normal, tangent, bitangent);
+
+  float NdotV = surface.normal.dot(viewVec);
+  float u1 = randomFloat(), u2 = randomFloat();
+
+  if (NdotV > 0 && randomFloat() < specularProbability(surface, viewVec)) {
+    // GGX visible normal, mirrored about the sampled microfacet
+    vec3f localV(viewVec.dot(tangent), viewVec.dot(bitangent), NdotV);
+    vec3f localH = sampleGGXVNDF(localV, surface.roughness * surface.roughness, u1, u2);
+    vec3f halfVec = localH(0) * tangent + localH(1) * bitangent + localH(2) * surface.normal;
+
+    return reflect(-viewVec, halfVec);
+  }
+
+  vec3f localL = cosineSampleHemisphere(u1, u2);
+
+  return localL(0) * tangent + localL(1) * bitangent + localL(2) * surface.normal;
+}
+
+float pbrMetallicRoughness::scatterPdf(const pbrSurface& surface, const vec3f& viewVec,
+                                        const vec3f& lightVec) const {
+  if (settings.bsdf == bsdfSampling::importance)
+    return pdf(surface, viewVec, lightVec);
+
+  return fmaxf(surface.normal.dot(lightVec), 0) / pi;
+}
+
+bool pbrMetallicRoughness::evalScatter(const ray& rIn, const hitRecord& record, const vec3f& dir,
+                                        color3f& value, float& pdf) const {
+  pbrSurface  surface = surfaceAt(rIn, record);
+  vec3f       viewVec = -unitVector(rIn.dir);
+  float       NdotL = surface.normal.dot(dir);
+
+  // same rejection as scatter() so both strategies cover the same directions
+  if (NdotL <= 0 || dir.dot(record.normal) <= 0)
+    return false;
+
+  value = evalBRDF(surface, viewVec, dir) * NdotL;
+  pdf = scatterPdf(surface, viewVec, dir);
+
+  return pdf > 0;
+}
+
+vec3f pbrMetallicRoughness::scatterDirection(const pbrSurface& surface, const vec3f& viewVec) const {
+  if (settings.bsdf == bsdfSampling::importance)
+    return unitVector(sampleDirection(surface, viewVec));
+
+  // cosine weighted around the shading normal
+  vec3f scatterDir = surface.normal + randomUnitVector();
+
+  if (nearZero(scatterDir))
+    scatterDir = surface.normal;
+
+  return unitVector(scatterDir);
+}
+
+bool pbrMetallicRoughness::scatter(const ray& rIn, const hitRecord& record,
+              color3f& attenuation, ray& scatterRay, float& pdf) const {
+  pbrSurface  surface = surfaceAt(rIn, record);
+
+  // BRDF assumes view vector points towards camera
+  vec3f       viewVec = -unitVector(rIn.dir);
+  vec3f       scatterDir = scatterDirection(surface, viewVec);
+
+  float NdotL = surface.normal.dot(scatterDir);
+
+  // directions under the geometric surface would leak light through it
+  if (NdotL <= 0 || scatterDir.dot(record.normal) <= 0)
+    return false;
+
+  pdf = scatterPdf(surface, viewVec, scatterDir);
+
+  if (pdf <= 0)
+    return false;
+
+  scatterRay = ray(record.p, scatterDir, rIn.time, record.coneWidth,
+                    scatterSpread(rIn.coneSpread, surface.roughness));
+
+  // BRDF * cosine factor / pdf
+  attenuation = evalBRDF(surface, viewVec, scatterDir) * (NdotL / pdf);
 
   return true;
 }
 
+using materialVariant = std::variant<pbrMetallicRoughness, metal, dielectric, diffuseLight>;
+
+// scene-owned materials, hittables and hit records refer to them by materialId
+class materialTable {
+  public:
+    materialId  add(materialVariant m) {
+      // maps and factors are final from here on
+      if (auto pbr = std::get_if<pbrMetallicRoughness>(&m))
+        pbr->specialize();
+
+      materials.push_back(std::move(m));
+      return materials.size() - 1;
+    }
+
+    size_t      size() const { return materials.size(); }
+
+    // the pbr material behind id, nullptr for the other kinds
+    const pbrMetallicRoughness* pbr(materialId id) const {
+      return std::get_if<pbrMetallicRoughness>(&materials[id]);
+    }
+
+    bool        scatter(materialId id, const ray& rIn, const hitRecord& record, color3f& attenuation,
+                        ray& scatterRay, float& pdf) const {
+      return std::visit([&](const auto& m) { return m.scatter(rIn, record, attenuation, scatterRay, pdf); },
+                        materials[id]);
+    }
+
+    bool        evalScatter(materialId id, const ray& rIn, const hitRecord& record, const vec3f& dir,
+                            color3f& value, float& pdf) const {
+      return std::visit([&](const auto& m) { return m.evalScatter(rIn, record, dir, value, pdf); },
+                        materials[id]);
+    }
+
+    color3f     emitted(materialId id, float u, float v, const vec3f& p) const {
+      return std::visit([&](const auto& m) { return m.emitted(u, v, p); }, materials[id]);
+    }
+
+    bool        isEmissive(materialId id) const {
+      return std::visit([](const auto& m) { return m.isEmissive(); }, materials[id]);
+    }
+
+    void        surfaceAOV(materialId id, const ray& rIn, const hitRecord& record, color3f& albedo,
+                            vec3f& normal) const {
+      std::visit([&](const auto& m) { m.surfaceAOV(rIn, record, albedo, normal); }, materials[id]);
+    }
+
+    bool        isSpecular(materialId id) const {
+      return std::visit([](const auto& m) { return m.isSpecular(); }, materials[id]);
+    }
+
+  private:
+    std::vector<materialVariant>  materials;
+};
+
 #endif
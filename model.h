@@ -8,12 +8,13 @@
 #include "hittableindexed.h"
 #include "hittablevector.h"
 #include "material.h"
+#include "texturecache.h"
 
 using std::vector;
 using std::uint16_t;
 using std::uint32_t;
 
-bool gltfLoad(std::string filename, shared_ptr<class model> model);
+bool gltfLoad(std::string filename, shared_ptr<class model> model, materialTable& materials);
 
 class triangle : public hittable, public std::enable_shared_from_this<triangle> {
   public:
@@ -28,6 +29,13 @@ class triangle : public hittable, public std::enable_shared_from_this<triangle>
     virtual void  calcTangentBasis(const vec3f& normal, vec3f& tangent, vec3f& biTangent) const override;
     virtual int   selectBvhAxis() const override;
 
+    // uniform area sampling, converted to solid angle
+    virtual float pdfValue(const vec3f& o, const vec3f& v) const override;
+    virtual vec3f random(const vec3f& o) const override;
+    virtual bool  isEmitter(const materialTable& materials) const override;
+    virtual bool  emitterBounds(const materialTable& materials, lightBounds& bounds) const override;
+    virtual bool  emitPhoton(const materialTable& materials, ray& photon, color3f& power) const override;
+
     // indexed tree for compute shaders
     virtual int   populateVector(class shared_ptr<hittableVector> hittableVector) const override;
 
@@ -40,10 +48,14 @@ class triangle : public hittable, public std::enable_shared_from_this<triangle>
       vertices[0] = index0;
       vertices[1] = index1;
       vertices[2] = index2;
+      uvScale = calcUVScale();
     }
 
+    float calcUVScale() const;
+
   private:
     uint16_t                vertices[3];
+    float                   uvScale;
     shared_ptr<class mesh>  parentMesh;
 };
 
@@ -62,6 +74,12 @@ class mesh : public hittable, public std::enable_shared_from_this<mesh> {
     virtual int   populateVector(shared_ptr<hittableVector> hittableVector) const override {
         return hittableVector->objects.size();
       }
+
+    virtual void  collectLights(const materialTable& materials,
+                                std::vector<shared_ptr<hittable>>& lights) const override {
+      if (materials.isEmissive(matId))
+        lights.insert(lights.end(), triangles.begin(), triangles.end());
+    }
     
   private:
     mesh() {}
@@ -70,7 +88,7 @@ class mesh : public hittable, public std::enable_shared_from_this<mesh> {
     std::vector<shared_ptr<triangle>>   triangles;
     std::vector<vec3f>                  positions;
     std::vector<vec2f>                  texcoords;
-    shared_ptr<material>                matPtr;
+    materialId                          matId = noMaterial;
     shared_ptr<class model>             parentModel;
 };
 
@@ -89,8 +107,15 @@ class model : public hittable, public std::enable_shared_from_this<model> {
         return hittableVector->objects.size();
       }
 
-    bool         init() {
-      return gltfLoad(filename, getPtr());
+    virtual void  collectLights(const materialTable& materials,
+                                std::vector<shared_ptr<hittable>>& lights) const override {
+      for (const auto& mesh : meshes)
+        mesh->collectLights(materials, lights);
+    }
+
+    // materials of the model are added to the scene's table
+    bool         init(materialTable& materials) {
+      return gltfLoad(filename, getPtr(), materials);
     }
 
   private:
@@ -174,7 +199,9 @@ bool triangle::hit(const ray &ray, float tMin, float tMax, hitRecord &record) co
   record.p = ray.at(record.t);
   record.setFaceNormal(ray, outwardNormal);
   record.uv = vec2f(u, v);
-  record.matPtr = parentMesh->matPtr;
+  record.setCone(ray);
+  record.uvScale = uvScale;
+  record.matId = parentMesh->matId;
   calcTangentBasis(outwardNormal, record.tangent, record.bitangent);
 
   return true;
@@ -234,6 +261,104 @@ void triangle::calcTangentBasis(const vec3f& normal, vec3f& tangent, vec3f& bita
   bitangent = unitVector(bitangent);
 }
 
+float triangle::calcUVScale() const {
+  vec3f edge0 = parentMesh->positions[vertices[1]] - parentMesh->positions[vertices[0]];
+  vec3f edge1 = parentMesh->positions[vertices[2]] - parentMesh->positions[vertices[0]];
+  vec2f deltaUV0 = parentMesh->texcoords[vertices[1]] - parentMesh->texcoords[vertices[0]];
+  vec2f deltaUV1 = parentMesh->texcoords[vertices[2]] - parentMesh->texcoords[vertices[0]];
+
+  float worldArea = length(edge0.cross(edge1));
+  float uvArea = fabsf(deltaUV0(0) * deltaUV1(1) - deltaUV1(0) * deltaUV0(1));
+
+  if (worldArea < epsilon)
+    return 0;
+
+  return sqrtf(uvArea / worldArea);
+}
+
+float triangle::pdfValue(const vec3f& o, const vec3f& v) const {
+  hitRecord record;
+
+  if (!hit(ray(o, v), 0.001f, infinity, record))
+    return 0;
+
+  float area = 0.5f * length(getNormal());
+  float distanceSquared = record.t * record.t * lengthSquared(v);
+  float cosine = fabsf(v.dot(record.normal)) / length(v);
+
+  if (area < epsilon || cosine < epsilon)
+    return 0;
+
+  return distanceSquared / (cosine * area);
+}
+
+vec3f triangle::random(const vec3f& o) const {
+  float su = sqrtf(randomFloat());
+  float b0 = 1.0f - su;
+  float b1 = randomFloat() * su;
+
+  vec3f p = b0 * parentMesh->positions[vertices[0]] +
+            b1 * parentMesh->positions[vertices[1]] +
+            (1.0f - b0 - b1) * parentMesh->positions[vertices[2]];
+
+  return p - o;
+}
+
+bool triangle::isEmitter(const materialTable& materials) const {
+  return materials.isEmissive(parentMesh->matId);
+}
+
+bool triangle::emitterBounds(const materialTable& materials, lightBounds& bounds) const {
+  if (!isEmitter(materials))
+    return false;
+
+  vec3f normal = getNormal();
+  vec3f centroid = (parentMesh->positions[vertices[0]] + parentMesh->positions[vertices[1]] +
+                    parentMesh->positions[vertices[2]]) / 3.0f;
+  vec2f uv = (parentMesh->texcoords[vertices[0]] + parentMesh->texcoords[vertices[1]] +
+              parentMesh->texcoords[vertices[2]]) / 3.0f;
+
+  // front face only, matching hit()
+  boundingBox(0, 0, bounds.box);
+  bounds.axis = unitVector(normal);
+  bounds.cosThetaO = 1.0f;
+  bounds.cosThetaE = 0;
+  bounds.power = pi * 0.5f * length(normal) *
+                  luminance(materials.emitted(parentMesh->matId, uv(0), uv(1), centroid));
+
+  return true;
+}
+
+bool triangle::emitPhoton(const materialTable& materials, ray& photon, color3f& power) const {
+  if (!isEmitter(materials))
+    return false;
+
+  float su = sqrtf(randomFloat());
+  float b0 = 1.0f - su;
+  float b1 = randomFloat() * su;
+  float b2 = 1.0f - b0 - b1;
+
+  vec3f p = b0 * parentMesh->positions[vertices[0]] + b1 * parentMesh->positions[vertices[1]] +
+            b2 * parentMesh->positions[vertices[2]];
+  vec2f uv = b0 * parentMesh->texcoords[vertices[0]] + b1 * parentMesh->texcoords[vertices[1]] +
+              b2 * parentMesh->texcoords[vertices[2]];
+  vec3f normal = getNormal();
+  vec3f tangent, bitangent;
+
+  // front face only, matching hit()
+  float area = 0.5f * length(normal);
+
+  normal = unitVector(normal);
+  buildBasis(normal, tangent, bitangent);
+
+  vec3f local = cosineSampleHemisphere(randomFloat(), randomFloat());
+
+  photon = ray(p, local(0) * tangent + local(1) * bitangent + local(2) * normal, 0);
+  power = pi * area * materials.emitted(parentMesh->matId, uv(0), uv(1), p);
+
+  return true;
+}
+
 int triangle::selectBvhAxis() const {
   return randomInt(0, 2);
 
@@ -298,7 +423,7 @@ bool model::boundingBox(float time0, float time1, aabb& outputBox) const {
   return true;
 }
 
-bool gltfLoad(std::string filename, shared_ptr<model> model) {
+bool gltfLoad(std::string filename, shared_ptr<model> model, materialTable& materials) {
   cgltf_options options = {static_cast<cgltf_file_type>(0)};
   cgltf_data*   data;
 
@@ -379,6 +504,7 @@ bool gltfLoad(std::string filename, shared_ptr<model> model) {
           std::string textureFile;
           std::string normalMapFile;
           std::string metallicRoughnessMapFile;
+          std::string occlusionMapFile;
 
           vec4f baseColor;
           float metallicness, roughness;
@@ -387,6 +513,7 @@ bool gltfLoad(std::string filename, shared_ptr<model> model) {
           cgltf_texture_view*           albedoView = &pbrMat->base_color_texture;
           cgltf_texture_view*           normalMapView = &gltfMat->normal_texture;
           cgltf_texture_view*           metallicRoughnessView = &pbrMat->metallic_roughness_texture;
+          cgltf_texture_view*           occlusionView = &gltfMat->occlusion_texture;
 
           if (albedoView->texture) {
             albedoMap = albedoView->texture;
@@ -412,31 +539,49 @@ bool gltfLoad(std::string filename, shared_ptr<model> model) {
             metallicRoughnessMapFile.append(metallicRoughnessImage->uri);
           }
 
+          if (occlusionView->texture) {
+            occlusionMapFile = "../data/";
+            occlusionMapFile.append(occlusionView->texture->image->uri);
+          }
+
           baseColor = vec4f(pbrMat->base_color_factor[0], pbrMat->base_color_factor[1],
                             pbrMat->base_color_factor[2], pbrMat->base_color_factor[3]);
           metallicness = pbrMat->metallic_factor;
           roughness = pbrMat->roughness_factor;
 
-          shared_ptr<imagePNG>  albedoPNG;
-          shared_ptr<imagePNG>  normalPNG;
-          shared_ptr<imagePNG>  metallicRoughnessPNG;
+          shared_ptr<texture>   albedoPNG;
+          shared_ptr<texture>   normalPNG;
+          shared_ptr<texture>   metallicRoughnessPNG;
+          shared_ptr<texture>   occlusionPNG;
 
           if (!textureFile.empty())
-            albedoPNG = make_shared<imagePNG>(textureFile.c_str(), 3);
+            albedoPNG = loadTexture(textureFile.c_str(), 3);
 
           if (!normalMapFile.empty())
-            normalPNG = make_shared<imagePNG>(normalMapFile.c_str(), 3);
+            normalPNG = loadTexture(normalMapFile.c_str(), 3, textureUsage::normal);
 
           if (!metallicRoughnessMapFile.empty())
-            metallicRoughnessPNG = make_shared<imagePNG>(metallicRoughnessMapFile.c_str(), 3);
-
-          newMesh->matPtr = make_shared<pbrMetallicRoughness>(
-                              albedoPNG,
-                              normalPNG,
-                              metallicRoughnessPNG,
-                              baseColor, metallicness, roughness);
+            metallicRoughnessPNG = loadTexture(metallicRoughnessMapFile.c_str(), 3, textureUsage::data);
+
+          if (!occlusionMapFile.empty())
+            occlusionPNG = loadTexture(occlusionMapFile.c_str(), 1, textureUsage::scalar);
+
+          pbrMetallicRoughness  pbr(albedoPNG,
+                                    normalPNG,
+                                    metallicRoughnessPNG,
+                                    baseColor, metallicness, roughness);
+          pbr.occlusionMap = occlusionPNG;
+#if USE_MATERIAL_BAKE
+          pbr.bake();
+#endif
+          newMesh->matId = materials.add(pbr);
         }
       }
+
+      // glTF default material
+      if (newMesh->matId == noMaterial)
+        newMesh->matId = materials.add(pbrMetallicRoughness(make_shared<solidColor>(255.0f, 255.0f, 255.0f),
+                                                              vec4f(1.0f, 1.0f, 1.0f, 1.0f), 1.0f, 1.0f));
       
       // read in triangle data
       if (gltfPrim->type == cgltf_primitive_type_triangles) {
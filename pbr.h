@@ -80,4 +80,54 @@ inline vec3f fresnelEpic(const vec3f& F0, float HdotV) {
                 F0(2) + (1.0f - F0(2)) * power);
 }
 
+/******************************************************************************
+ * importance sampling:
+ *
+ *  Specular lobe samples the distribution of visible normals, Heitz 2018
+ *    (https://jcgt.org/published/0007/04/01/)
+ *
+ *    pdf(l) = G_1(v) * D(h) / (4 * (n dot v))
+ *
+ *    with Smith G_1 for GGX, alpha = pow(roughness, 2)
+ *      G_1(v) = 2 * (n dot v) / ((n dot v) + sqrt(pow(alpha, 2) + (1 - pow(alpha, 2)) * pow(n dot v, 2)))
+ *
+ *  Diffuse lobe is cosine weighted, pdf(l) = (n dot l) / pi
+ *
+ ******************************************************************************/
+
+float smithG1GGX(float NdotV, float alpha) {
+  float alpha2 = alpha * alpha;
+
+  return 2.0f * NdotV / (NdotV + sqrtf(alpha2 + (1.0f - alpha2) * NdotV * NdotV));
+}
+
+// V in the local frame with the normal along +z, returns the sampled microfacet normal
+inline vec3f sampleGGXVNDF(const vec3f& V, float alpha, float u1, float u2) {
+  // stretch view so the distribution becomes a hemisphere
+  vec3f Vh = unitVector(vec3f(alpha * V(0), alpha * V(1), V(2)));
+
+  float lenSq = Vh(0) * Vh(0) + Vh(1) * Vh(1);
+  vec3f T1 = lenSq > 0 ? vec3f(-Vh(1), Vh(0), 0) / sqrtf(lenSq) : vec3f(1.0f, 0, 0);
+  vec3f T2 = Vh.cross(T1);
+
+  // uniform point on the projected hemisphere
+  float r = sqrtf(u1);
+  float phi = 2.0f * pi * u2;
+  float t1 = r * cosf(phi);
+  float t2 = r * sinf(phi);
+  float s = 0.5f * (1.0f + Vh(2));
+  t2 = (1.0f - s) * sqrtf(fmaxf(1.0f - t1 * t1, 0)) + s * t2;
+
+  vec3f Nh = t1 * T1 + t2 * T2 + sqrtf(fmaxf(1.0f - t1 * t1 - t2 * t2, 0)) * Vh;
+
+  // unstretch
+  return unitVector(vec3f(alpha * Nh(0), alpha * Nh(1), fmaxf(Nh(2), 0)));
+}
+
+inline float ggxVNDFPdf(float NdotV, float NdotH, float roughness) {
+  float alpha = roughness * roughness;
+
+  return smithG1GGX(NdotV, alpha) * trowbridgeReitzNDF(NdotH, roughness) / (4.0f * NdotV);
+}
+
 #endif
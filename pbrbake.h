@@ -0,0 +1,171 @@
+#ifndef __PBRBAKE_H__
+#define __PBRBAKE_H__
+
+#include "globals.h"
+#include "texture.h"
+#include "bcn.h"
+
+// convert pbr texture sets into a single packed texture when materials are loaded,
+// block compressed textures are left compressed instead
+#define USE_MATERIAL_BAKE (!USE_BLOCK_COMPRESSION)
+
+using vec8f = Eigen::Matrix<float, 8, 1>;
+
+// everything pbrMetallicRoughness::scatter reads from textures, in shading units
+struct pbrShadingInputs {
+  color3f albedo;     // 0 to 1
+  vec3f   normal;     // tangent space, unit length
+  float   metallic;
+  float   roughness;
+  float   occlusion;
+};
+
+/******************************************************************************
+ * Packed pbr shading map
+ *
+ *  Albedo, normal, metallic, roughness and occlusion maps are resampled at load
+ *  time into one 8 byte texel:
+ *
+ *    albedo r, g, b | normal x, y | metallic | roughness | occlusion
+ *
+ *  The bake is lossy, it trades exactness for a single fetch per hit:
+ *
+ *    - every map is resampled bilinearly to the largest source resolution and
+ *      mip-mapped from there, so smaller maps filter slightly differently
+ *    - normals are normalized at bake time and stored as 8 bit x and y, z is
+ *      rebuilt on lookup, normals pointing below the surface are mirrored
+ *
+ *  The constant factors of the material are applied at fetch time as part of
+ *  the scale to shading units, so they cost no precision. --bench bake prints
+ *  the error against the per-map path.
+ ******************************************************************************/
+
+class pbrShadingMap : public imagePNG {
+  public:
+    // returns nullptr if a source map is procedural and cannot be baked
+    static shared_ptr<pbrShadingMap> bake(shared_ptr<texture> albedoMap, shared_ptr<texture> normalMap,
+                                          shared_ptr<texture> metallicRoughnessMap,
+                                          shared_ptr<texture> metallicMap, shared_ptr<texture> roughnessMap,
+                                          shared_ptr<texture> occlusionMap,
+                                          const vec4f& albedo, float metalness, float roughness);
+
+    inline pbrShadingInputs fetch(float u, float v, float footprint) const {
+      u = clamp(u, 0, 1.0f);
+      v = 1.0f - clamp(v, 0, 1.0f);
+
+      vec8f             raw = trilinearSample<vec8f>(u, v, footprint, width, height, mips.size(),
+                                                      [this](int l, int i, int j) { return packedTexel(l, i, j); });
+      vec8f             value = (raw - bias()).cwiseProduct(scale);
+      pbrShadingInputs  inputs;
+
+      inputs.albedo = value.head<3>();
+      inputs.normal = vec3f(value(3), value(4),
+                            sqrtf(fmaxf(1.0f - value(3) * value(3) - value(4) * value(4), 0)));
+      inputs.metallic = value(5);
+      inputs.roughness = value(6);
+      inputs.occlusion = value(7);
+
+      return inputs;
+    }
+
+  private:
+    pbrShadingMap() : imagePNG(texelBytes) {}
+
+    inline vec8f packedTexel(int level, int i, int j) const {
+      const mipLevel& mip = mips[level];
+
+      return Eigen::Map<const Eigen::Matrix<uint8_t, 8, 1>>(&mip.texels[mip.texelIndex(i, j) * texelBytes]).cast<float>();
+    }
+
+    static const vec8f& bias() {
+      static const vec8f b = (vec8f() << 0, 0, 0, 128.0f, 128.0f, 0, 0, 0).finished();
+      return b;
+    }
+
+  private:
+    static const int  texelBytes = 8;
+
+    vec8f             scale;    // bytes to shading units, times the material factors
+};
+
+shared_ptr<pbrShadingMap> pbrShadingMap::bake(shared_ptr<texture> albedoMap, shared_ptr<texture> normalMap,
+                                              shared_ptr<texture> metallicRoughnessMap,
+                                              shared_ptr<texture> metallicMap, shared_ptr<texture> roughnessMap,
+                                              shared_ptr<texture> occlusionMap,
+                                              const vec4f& albedo, float metalness, float roughness) {
+  shared_ptr<texture> sources[] = {albedoMap, normalMap, metallicRoughnessMap,
+                                    metallicMap, roughnessMap, occlusionMap};
+  int                 w = 0, h = 0;
+  bool                anyMap = false;
+
+  // bake at the highest resolution of the source maps
+  for (const auto& source : sources) {
+    int sourceW, sourceH;
+
+    if (!source)
+      continue;
+
+    if (!source->resolution(sourceW, sourceH))
+      return nullptr;
+
+    w = std::max(w, sourceW);
+    h = std::max(h, sourceH);
+    anyMap = true;
+  }
+
+  if (!anyMap)
+    return nullptr;
+
+  auto                  packed = shared_ptr<pbrShadingMap>(new pbrShadingMap());
+  std::vector<uint8_t>  texels(static_cast<size_t>(w) * h * texelBytes);
+  vec3f                 p(0, 0, 0);
+
+  auto  toByte = [](float x) {
+    return static_cast<uint8_t>(clamp(x + 0.5f, 0, 255.0f));
+  };
+
+  // bilinear at the finest level, the same filter the per-map path uses when magnifying
+  auto  sample = [&](const shared_ptr<texture>& map, float u, float v) {
+    return map->value(u, v, p, 0);
+  };
+
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++) {
+      float     u = (i + 0.5f) / w;
+      float     v = 1.0f - (j + 0.5f) / h;
+      uint8_t*  texel = &texels[(static_cast<size_t>(j) * w + i) * texelBytes];
+      color3f   a = albedoMap ? sample(albedoMap, u, v) : color3f(255.0f, 255.0f, 255.0f);
+      color3f   mr = metallicRoughnessMap ? sample(metallicRoughnessMap, u, v) : color3f(0, 255.0f, 255.0f);
+      vec3f     n = normalMap ? normalIntToFloat(sample(normalMap, u, v)) : vec3f(0, 0, 1.0f);
+
+      n = n.squaredNorm() > 0 ? vec3f(n / n.norm()) : vec3f(0, 0, 1.0f);
+
+      texel[0] = toByte(a(0));
+      texel[1] = toByte(a(1));
+      texel[2] = toByte(a(2));
+      texel[3] = toByte(n(0) * 128.0f + 128.0f);
+      texel[4] = toByte(n(1) * 128.0f + 128.0f);
+
+      // glTF packs roughness in green and metallic in blue, the factors are applied on fetch
+      texel[5] = toByte(metallicMap ? sample(metallicMap, u, v)(0) : mr(2));
+      texel[6] = toByte(roughnessMap ? sample(roughnessMap, u, v)(1) : mr(1));
+      texel[7] = toByte(occlusionMap ? sample(occlusionMap, u, v)(0) : 255.0f);
+    }
+  }
+
+  // separate metallic and roughness maps are not scaled by the factors
+  float metallicFactor = metallicMap ? 1.0f : metalness;
+  float roughnessFactor = roughnessMap ? 1.0f : roughness;
+
+  packed->scale = (vec8f() << albedo(0) / 255.0f, albedo(1) / 255.0f, albedo(2) / 255.0f,
+                    1.0f / 128.0f, 1.0f / 128.0f,
+                    metallicFactor / 255.0f, roughnessFactor / 255.0f, 1.0f / 255.0f).finished();
+
+  packed->width = w;
+  packed->height = h;
+  packed->buildMips(texels.data(), textureLayout::tiled);
+
+  return packed;
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef __PBRBATCH_H__
+#define __PBRBATCH_H__
+
+#include <vector>
+
+#include "globals.h"
+#include "settings.h"
+#include "simd.h"
+#include "material.h"
+
+/******************************************************************************
+ * batched pbr shading
+ *
+ *  Shading inputs are resolved per hit as usual (textures, normal maps), then
+ *  queued in structure of arrays form and evaluated as many lanes at a time
+ *  as the widest instruction set of the cpu has.
+ *  Lanes only share the strategy, so hits of different pbr materials batch
+ *  together. The kernel is evalBRDF * (n dot l) and scatterPdf with exp2 in
+ *  the Fresnel term replaced by vexp2 and the integer powers multiplied out.
+ ******************************************************************************/
+
+template <typename V>
+inline V pbrFresnel(V F0, V power) {
+  return F0 + (1.0f - F0) * power;
+}
+
+// spherical gaussian power of fresnelEpic
+template <typename V>
+inline V pbrFresnelPower(V HdotV) {
+  return vexp2((-5.55473f * HdotV - 6.98316f) * HdotV);
+}
+
+// n, v, l are unit vectors, l above the surface. Returns f * (n dot l) in value and the pdf of the
+// strategy in pdf
+template <typename V>
+void pbrShade(const V n[3], const V v[3], const V l[3], const V base[3], V metallic, V roughness,
+              V occlusion, bool importance, V value[3], V& pdf) {
+  V     h[3] = {l[0] + v[0], l[1] + v[1], l[2] + v[2]};
+  V     invLength = 1.0f / vsqrt(h[0] * h[0] + h[1] * h[1] + h[2] * h[2]);
+
+  h[0] = h[0] * invLength;  h[1] = h[1] * invLength;  h[2] = h[2] * invLength;
+
+  V     rawNdotV = n[0] * v[0] + n[1] * v[1] + n[2] * v[2];
+  V     NdotL = vmax(n[0] * l[0] + n[1] * l[1] + n[2] * l[2], 0.0f);
+  V     NdotH = vmax(n[0] * h[0] + n[1] * h[1] + n[2] * h[2], 0.0f);
+  V     HdotV = vmax(h[0] * v[0] + h[1] * v[1] + h[2] * v[2], 0.0f);
+  V     NdotV = vmax(rawNdotV, 0.0f);
+
+  // trowbridgeReitzNDF
+  V     alpha = roughness * roughness;
+  V     alpha2 = alpha * alpha;
+  V     d = NdotH * NdotH * (alpha2 - 1.0f) + 1.0f;
+  V     D = alpha2 / (pi * d * d);
+
+  // schlickGAF for l and v
+  V     k = (roughness + 1.0f) * (roughness + 1.0f) * 0.125f;
+  V     G = NdotL / (NdotL * (1.0f - k) + k) * (NdotV / (NdotV * (1.0f - k) + k));
+
+  V     power = pbrFresnelPower(HdotV);
+  V     specular = D * G / (4.0f * NdotV * NdotL + epsilon);
+  V     diffuse = (1.0f - metallic) * occlusion * (1.0f / pi);
+  V     F0[3];
+
+  for (int c = 0; c < 3; c++) {
+    F0[c] = 0.04f + (base[c] - 0.04f) * metallic;
+
+    V   F = pbrFresnel(F0[c], power);
+
+    value[c] = (base[c] * diffuse * (1.0f - F) + specular * F) * NdotL;
+  }
+
+  V     diffusePdf = NdotL * (1.0f / pi);
+
+  if (!importance) {
+    pdf = diffusePdf;
+    return;
+  }
+
+  // specularProbability, Fresnel at normal incidence to the view
+  V     powerV = pbrFresnelPower(NdotV);
+  V     specularWeight = 0.2126f * pbrFresnel(F0[0], powerV) + 0.7152f * pbrFresnel(F0[1], powerV) +
+                          0.0722f * pbrFresnel(F0[2], powerV);
+  V     diffuseWeight = (0.2126f * base[0] + 0.7152f * base[1] + 0.0722f * base[2]) * (1.0f - metallic);
+  V     pSpecular = vmin(vmax(specularWeight / (specularWeight + diffuseWeight + epsilon), 0.1f), 0.9f);
+
+  // ggxVNDFPdf
+  V     G1 = 2.0f * NdotV / (NdotV + vsqrt(alpha2 + (1.0f - alpha2) * NdotV * NdotV));
+  V     specularPdf = G1 * D / (4.0f * NdotV);
+
+  pdf = vselect(rawNdotV > 0.0f, pSpecular * specularPdf + (1.0f - pSpecular) * diffusePdf, diffusePdf);
+}
+
+class pbrShadingBatch {
+  public:
+    // queues one evaluation and returns its lane
+    size_t  add(const pbrSurface& surface, const vec3f& viewVec, const vec3f& lightVec) {
+      const float values[inputCount] = {surface.normal(0), surface.normal(1), surface.normal(2),
+                                        viewVec(0), viewVec(1), viewVec(2),
+                                        lightVec(0), lightVec(1), lightVec(2),
+                                        surface.baseColor(0), surface.baseColor(1), surface.baseColor(2),
+                                        surface.metallic, surface.roughness, surface.occlusion};
+
+      for (int i = 0; i < inputCount; i++)
+        inputs[i].push_back(values[i]);
+
+      return count++;
+    }
+
+    // shades every queued lane with the bsdf strategy
+    void    evaluate(bsdfSampling strategy, simdISA isa = simdLevel());
+
+    color3f value(size_t lane) const {
+      return color3f(outputs[valueR][lane], outputs[valueG][lane], outputs[valueB][lane]);
+    }
+
+    float   pdf(size_t lane) const { return outputs[pdfOut][lane]; }
+    size_t  size() const { return count; }
+
+    void    clear() {
+      for (auto& input : inputs)
+        input.clear();
+
+      count = 0;
+    }
+
+  private:
+    enum {
+      normalX, normalY, normalZ,
+      viewX, viewY, viewZ,
+      lightX, lightY, lightZ,
+      baseR, baseG, baseB,
+      metallicIn, roughnessIn, occlusionIn,
+      inputCount
+    };
+
+    enum { valueR, valueG, valueB, pdfOut, outputCount };
+
+    template <typename V>
+    void    shadeLanes(size_t padded, bool importance);
+
+#if SIMD_DISPATCH
+    SIMD_AVX2_KERNEL void   shadeAVX2(size_t padded, bool importance) { shadeLanes<floatx8>(padded, importance); }
+    SIMD_AVX512_KERNEL void shadeAVX512(size_t padded, bool importance) { shadeLanes<floatx16>(padded, importance); }
+#endif
+
+    std::vector<float>  inputs[inputCount];
+    std::vector<float>  outputs[outputCount];
+    size_t              count = 0;
+};
+
+void pbrShadingBatch::evaluate(bsdfSampling strategy, simdISA isa) {
+  if (count == 0)
+    return;
+
+  // pad to whole vectors with copies of lane 0
+  size_t  lanes = simdLanes(isa);
+  size_t  padded = (count + lanes - 1) / lanes * lanes;
+
+  for (auto& input : inputs)
+    input.resize(padded, input[0]);
+
+  for (auto& output : outputs)
+    output.resize(padded);
+
+  bool    importance = strategy == bsdfSampling::importance;
+
+#if SIMD_DISPATCH
+  if (isa == simdISA::avx512)
+    shadeAVX512(padded, importance);
+  else if (isa == simdISA::avx2)
+    shadeAVX2(padded, importance);
+  else
+#endif
+    shadeLanes<float>(padded, importance);
+
+  for (auto& input : inputs)
+    input.resize(count);
+}
+
+template <typename V>
+void pbrShadingBatch::shadeLanes(size_t padded, bool importance) {
+  const size_t  lanes = sizeof(V) / sizeof(float);
+
+  for (size_t i = 0; i < padded; i += lanes) {
+    V   n[3] = {loadLanes<V>(&inputs[normalX][i]), loadLanes<V>(&inputs[normalY][i]), loadLanes<V>(&inputs[normalZ][i])};
+    V   v[3] = {loadLanes<V>(&inputs[viewX][i]), loadLanes<V>(&inputs[viewY][i]), loadLanes<V>(&inputs[viewZ][i])};
+    V   l[3] = {loadLanes<V>(&inputs[lightX][i]), loadLanes<V>(&inputs[lightY][i]), loadLanes<V>(&inputs[lightZ][i])};
+    V   base[3] = {loadLanes<V>(&inputs[baseR][i]), loadLanes<V>(&inputs[baseG][i]), loadLanes<V>(&inputs[baseB][i])};
+    V   value[3];
+    V   pdf;
+
+    pbrShade<V>(n, v, l, base, loadLanes<V>(&inputs[metallicIn][i]), loadLanes<V>(&inputs[roughnessIn][i]),
+                loadLanes<V>(&inputs[occlusionIn][i]), importance, value, pdf);
+
+    storeLanes<V>(&outputs[valueR][i], value[0]);
+    storeLanes<V>(&outputs[valueG][i], value[1]);
+    storeLanes<V>(&outputs[valueB][i], value[2]);
+    storeLanes<V>(&outputs[pdfOut][i], pdf);
+  }
+}
+
+#endif
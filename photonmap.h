@@ -0,0 +1,244 @@
+#ifndef __PHOTONMAP_H__
+#define __PHOTONMAP_H__
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "globals.h"
+#include "hittable.h"
+#include "envmap.h"
+#include "material.h"
+
+// gather caustics from a photon map in main's render loop
+#define USE_CAUSTIC_PHOTONS   0
+
+/******************************************************************************
+ * caustic photon map
+ *
+ *  Photons leave the emitters of the scene, picked by power, and follow
+ *  specular surfaces (metal, dielectric). The first non-specular surface after
+ *  at least one specular bounce stores the photon and ends it, so the map only
+ *  holds light that took L S+ D paths. Photons are traced on all hardware
+ *  threads and bucketed into a hashed grid with cells twice the gather radius:
+ *
+ *    keys      cell hash of every photon, counted per bucket with atomics
+ *    offsets   prefix sum of the counts
+ *    photons   scattered to their bucket's range, again in parallel
+ *
+ *  A gather visits the 8 cells the radius can overlap. rayColor adds the
+ *  gathered radiance at every non-specular hit and drops emission reached by
+ *  a non-specular hit followed by specular ones, which the map already has.
+ *
+ *  Progressive photon mapping (Knaus and Zwicker 2011): every pass traces
+ *  fresh photons and nextPass() shrinks the radius by r^2 *= (i + alpha) /
+ *  (i + 1), so the average over passes converges as bias and variance both
+ *  go to 0.
+ ******************************************************************************/
+
+// photons lost in specular chains longer than this
+const int causticMaxDepth = 16;
+
+struct photon {
+  vec3f   p;
+  vec3f   dir;        // unit direction of travel
+  vec3f   normal;     // of the surface it landed on, facing the photon
+  color3f power;
+};
+
+class causticMap {
+  public:
+    causticMap(int numPhotons = 100000, float initialRadius = 0.05f, float a = 2.0f / 3.0f)
+      : photonsPerPass(numPhotons), radius2(initialRadius * initialRadius), alpha(a) {}
+
+    // traces photonsPerPass photons from the emitters of world and rebuilds the grid
+    void    emit(const hittable& world, const materialTable& materials);
+
+    // radiance the stored photons reflect at record towards the origin of rIn
+    color3f gather(const materialTable& materials, const ray& rIn, const hitRecord& record) const;
+
+    // shrinks the radius for the next emit()
+    void    nextPass() {
+      radius2 *= (pass + alpha) / (pass + 1.0f);
+      pass++;
+    }
+
+    float   radius() const { return sqrtf(radius2); }
+    size_t  size() const { return photons.size(); }
+
+  private:
+    uint32_t  bucket(int x, int y, int z) const {
+      uint32_t  h = (static_cast<uint32_t>(x) * 73856093u) ^ (static_cast<uint32_t>(y) * 19349663u) ^
+                    (static_cast<uint32_t>(z) * 83492791u);
+
+      return h & bucketMask;
+    }
+
+    int       cellCoord(float x) const { return static_cast<int>(floorf(x / cellSize)); }
+
+    void      build(std::vector<photon>& traced);
+
+  private:
+    int                   photonsPerPass;
+    float                 radius2;
+    float                 alpha;
+    int                   pass = 1;
+    float                 cellSize = 0;
+    uint32_t              bucketMask = 0;
+    std::vector<photon>   photons;        // sorted by bucket
+    std::vector<uint32_t> offsets;        // bucket ranges into photons, buckets + 1 entries
+};
+
+void causticMap::emit(const hittable& world, const materialTable& materials) {
+  std::vector<shared_ptr<hittable>> emitters;
+  std::vector<float>                weights;
+  std::vector<aliasEntry>           table;
+  std::vector<photon>               traced;
+  std::mutex                        tracedMutex;
+
+  world.collectLights(materials, emitters);
+
+  for (const auto& emitter : emitters) {
+    lightBounds bounds;
+
+    weights.push_back(emitter->emitterBounds(materials, bounds) ? fmaxf(bounds.power, 0) : 0);
+  }
+
+  if (!buildAliasTable(weights, table)) {
+    build(traced);
+    return;
+  }
+
+  parallelFor(photonsPerPass, [&](int begin, int end) {
+    std::vector<photon> local;
+
+    for (int i = begin; i < end; i++) {
+      float   u = randomFloat() * table.size();
+      size_t  index = std::min(static_cast<size_t>(u), table.size() - 1);
+
+      if (u - index >= table[index].probability)
+        index = table[index].alias;
+
+      ray     r;
+      color3f power;
+
+      if (!emitters[index]->emitPhoton(materials, r, power))
+        continue;
+
+      power /= table[index].pdf * photonsPerPass;
+
+      for (int depth = 0; depth < causticMaxDepth; depth++) {
+        hitRecord record;
+
+        if (!world.hit(r, 0.001f, infinity, record))
+          break;
+
+        if (!materials.isSpecular(record.matId)) {
+          if (depth > 0)
+            local.push_back({record.p, unitVector(r.dir), record.normal, power});
+
+          break;
+        }
+
+        ray     scattered;
+        color3f attenuation;
+        float   pdf;
+
+        if (!materials.scatter(record.matId, r, record, attenuation, scattered, pdf))
+          break;
+
+        power = power.cwiseProduct(attenuation);
+        r = scattered;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(tracedMutex);
+    traced.insert(traced.end(), local.begin(), local.end());
+  });
+
+  build(traced);
+}
+
+void causticMap::build(std::vector<photon>& traced) {
+  uint32_t  numBuckets = 1;
+
+  while (numBuckets < traced.size())
+    numBuckets *= 2;
+
+  cellSize = 2.0f * radius();
+  bucketMask = numBuckets - 1;
+  offsets.assign(numBuckets + 1, 0);
+  photons.resize(traced.size());
+
+  std::vector<uint32_t>               keys(traced.size());
+  std::vector<std::atomic<uint32_t>>  counts(numBuckets);
+  int                                 count = static_cast<int>(traced.size());
+
+  parallelFor(count, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      const vec3f&  p = traced[i].p;
+
+      keys[i] = bucket(cellCoord(p(0)), cellCoord(p(1)), cellCoord(p(2)));
+      counts[keys[i]].fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  for (uint32_t b = 0; b < numBuckets; b++) {
+    offsets[b + 1] = offsets[b] + counts[b].load(std::memory_order_relaxed);
+    counts[b].store(offsets[b], std::memory_order_relaxed);
+  }
+
+  parallelFor(count, [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+      photons[counts[keys[i]].fetch_add(1, std::memory_order_relaxed)] = traced[i];
+  });
+}
+
+color3f causticMap::gather(const materialTable& materials, const ray& rIn, const hitRecord& record) const {
+  color3f   sum(0, 0, 0);
+
+  if (photons.empty())
+    return sum;
+
+  // cells are 2r wide, so the gather sphere overlaps at most 2 per axis
+  int       lo[3];
+  uint32_t  buckets[8];
+  int       numBuckets = 0;
+
+  for (int axis = 0; axis < 3; axis++)
+    lo[axis] = cellCoord(record.p(axis) - radius());
+
+  // cells hashing to the same bucket must only be visited once
+  for (int i = 0; i < 8; i++) {
+    uint32_t  b = bucket(lo[0] + (i & 1), lo[1] + ((i >> 1) & 1), lo[2] + (i >> 2));
+
+    if (std::find(buckets, buckets + numBuckets, b) == buckets + numBuckets)
+      buckets[numBuckets++] = b;
+  }
+
+  for (int i = 0; i < numBuckets; i++) {
+    for (uint32_t j = offsets[buckets[i]]; j < offsets[buckets[i] + 1]; j++) {
+      const photon& stored = photons[j];
+
+      // same side of a similarly oriented surface only, keeps photons from leaking around edges
+      if (lengthSquared(vec3f(stored.p - record.p)) > radius2 || stored.normal.dot(record.normal) < 0.9f)
+        continue;
+
+      vec3f   incoming = -stored.dir;
+      float   cosine = incoming.dot(record.normal);
+      color3f f;
+      float   pdf;
+
+      if (cosine <= 0 || !materials.evalScatter(record.matId, rIn, record, incoming, f, pdf))
+        continue;
+
+      // evalScatter includes the cosine, the photon's power already has it
+      sum += f.cwiseProduct(stored.power) / cosine;
+    }
+  }
+
+  return sum / (pi * radius2);
+}
+
+#endif
@@ -5,8 +5,10 @@
 
 class ray {
   public:
-    ray() {}
-    ray(const vec3f &origin, const vec3f &direction, float t = 0) : o(origin), dir(direction), time(t) {}
+    ray() : coneWidth(0), coneSpread(0) {}
+    ray(const vec3f &origin, const vec3f &direction, float t = 0,
+        float width = 0, float spread = 0) : o(origin), dir(direction), time(t),
+        coneWidth(width), coneSpread(spread) {}
 
 //    vec3f origin() const { return o; }
 //    vec3f   direction() const { return dir; }
@@ -20,6 +22,10 @@ class ray {
     vec3f o;
     vec3f dir;
     float time;
+
+    // ray cone used for texture filtering: width at the origin and spread angle (radians)
+    float coneWidth;
+    float coneSpread;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,675 @@
+#ifndef __RENDER_H__
+#define __RENDER_H__
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "globals.h"
+#include "hittable.h"
+#include "hittablelist.h"
+#include "settings.h"
+#include "envmap.h"
+#include "material.h"
+#include "pbrbatch.h"
+#include "photonmap.h"
+#include "guiding.h"
+#include "denoise.h"
+#include "film.h"
+#include "camera.h"
+
+// main renders passes of 1, 1, 2, 4, ... spp and rewrites its image after each one
+#define USE_PROGRESSIVE   1
+
+// power heuristic with beta = 2
+inline float misWeight(float pdfA, float pdfB) {
+  float a2 = pdfA * pdfA;
+
+  return a2 / (a2 + pdfB * pdfB);
+}
+
+// radiance a light sample from p towards dir receives
+color3f incomingLight(const vec3f& p, const vec3f& dir, float time, const environmentLight& background,
+                      const hittable& world, const materialTable& materials) {
+  hitRecord record;
+
+  if (world.hit(ray(p, dir, time), 0.001f, infinity, record))
+    return materials.emitted(record.matId, record.uv(0), record.uv(1), record.p);
+
+  return background.value(dir);
+}
+
+// lights are the emissive primitives of world plus an importance sampled background, direct
+// light sampling is skipped when empty. With caustics, L S+ D light comes from the photon map.
+// aov receives the first non-specular hit's albedo and normal and the first hit's depth. With a
+// guide, pbr scattering mixes in its learned directions, and paths record into it while it trains
+color3f rayColor(const ray &r, const environmentLight& background, const hittable &world,
+                  const materialTable& materials, const hittableList& lights, int maxBounce,
+                  const causticMap* caustics = nullptr, pixelAOV* aov = nullptr, sdTree* guide = nullptr) {
+  color3f radiance(0, 0, 0);
+  color3f throughput(1.0f, 1.0f, 1.0f);
+  ray     current = r;
+  bool    sampleLights = settings.nextEventEstimation && !lights.objects.empty();
+
+  // pdf of the bsdf sample that produced current, 0 for camera rays and delta lobes
+  float   scatterPdf = 0;
+
+  // a non-specular hit was followed by specular ones only, emitters found now are in the map
+  bool    diffuseSeen = false;
+  bool    causticPath = false;
+
+  bool            recording = guide && guide->training();
+  guidingRecorder recorder;
+  auto            addRadiance = [&](const color3f& c) {
+    radiance += c;
+
+    if (recording)
+      recorder.addRadiance(c);
+  };
+
+  // AOVs of paths that never reach a non-specular hit are those of the last hit or the sky
+  if (aov)
+    *aov = {color3f(1.0f, 1.0f, 1.0f), -unitVector(r.dir), missDepth};
+
+  for (int bounce = 0; bounce < maxBounce; bounce++) {
+    hitRecord record;
+
+    if (!world.hit(current, 0.001f, infinity, record)) {
+      color3f sky = background.value(current.dir);
+
+      // lights that can't produce this direction return a pdf of 0 and leave it unweighted
+      if (sampleLights && scatterPdf > 0)
+        sky *= misWeight(scatterPdf, lights.pdfValue(current.o, current.dir));
+
+      addRadiance(throughput.cwiseProduct(sky));
+      break;
+    }
+
+    color3f emitted = materials.emitted(record.matId, record.uv(0), record.uv(1), record.p);
+
+    if (sampleLights && scatterPdf > 0 && materials.isEmissive(record.matId))
+      emitted *= misWeight(scatterPdf, lights.pdfValue(current.o, current.dir));
+
+    if (!causticPath)
+      addRadiance(throughput.cwiseProduct(emitted));
+
+    bool    specular = materials.isSpecular(record.matId);
+
+    if (aov && !diffuseSeen) {
+      if (bounce == 0)
+        aov->depth = record.t * length(current.dir);
+
+      materials.surfaceAOV(record.matId, current, record, aov->albedo, aov->normal);
+    }
+
+    if (caustics && !specular && !materials.isEmissive(record.matId))
+      addRadiance(throughput.cwiseProduct(caustics->gather(materials, current, record)));
+
+    // only pbr has a lobe worth guiding, the other materials are delta or emit
+    dTree*  tree = guide && materials.pbr(record.matId) ? &guide->leafAt(record.p) : nullptr;
+    bool    guided = tree && tree->trained();
+
+    // next event: one shadow ray towards a light, as long as a further bounce could have reached it
+    if (sampleLights && bounce + 1 < maxBounce) {
+      vec3f   lightDir = unitVector(lights.random(record.p));
+      color3f f;
+      float   bsdfPdf;
+      float   lightPdf = lights.pdfValue(record.p, lightDir);
+
+      if (lightPdf > 0 && materials.evalScatter(record.matId, current, record, lightDir, f, bsdfPdf)) {
+        color3f lightEmitted = incomingLight(record.p, lightDir, current.time, background, world, materials);
+
+        if (guided)
+          bsdfPdf = guidedPdf(*tree, lightDir, bsdfPdf);
+
+        addRadiance(throughput.cwiseProduct(f).cwiseProduct(lightEmitted) * (misWeight(lightPdf, bsdfPdf) / lightPdf));
+      }
+    }
+
+    ray     scattered;
+    color3f attenuation;
+
+    if (guided ? !guidedScatter(materials, *tree, current, record, attenuation, scattered, scatterPdf)
+               : !materials.scatter(record.matId, current, record, attenuation, scattered, scatterPdf))
+      break;
+
+    diffuseSeen = diffuseSeen || !specular;
+
+    if (caustics)
+      causticPath = diffuseSeen && specular;
+
+    throughput = throughput.cwiseProduct(attenuation);
+    current = scattered;
+
+    if (recording && tree)
+      recorder.add(tree, unitVector(scattered.dir), throughput, scatterPdf);
+  }
+
+  if (recording)
+    recorder.record();
+
+  return radiance;
+}
+
+// a path of the batched renderer between bounces
+struct pathState {
+  ray     r;
+  color3f throughput;
+  float   scatterPdf;     // as in rayColor
+  int     pixel;
+};
+
+// a queued pbr evaluation and what its result is applied to
+struct shadeQuery {
+  int     path;
+  size_t  lane;
+  vec3f   p;
+  vec3f   dir;
+  float   lightPdf;       // 0 for the scatter direction
+  float   coneWidth, coneSpread;
+};
+
+// renderPass advancing all paths of a row one bounce at a time, same estimator as rayColor. Light
+// samples and scatter directions of the bounce's pbr hits are drawn per hit, shaded together in a
+// pbrShadingBatch and applied afterwards; the other materials are shaded as they are hit
+void renderPassBatched(const hittable& world, const materialTable& materials, const hittableList& lights,
+                        camera& cam, const environmentLight& background, int imageWidth, int imageHeight,
+                        int numSamples, int maxBounce, std::vector<color3f>& pixels) {
+  bool                    sampleLights = settings.nextEventEstimation && !lights.objects.empty();
+  pbrShadingBatch         batch;
+  std::vector<shadeQuery> queries;
+  std::vector<pathState>  paths, nextPaths;
+
+  pixels.resize(imageWidth * imageHeight, color3f(0, 0, 0));
+
+  for (int y = 0; y < imageHeight; ++y) {
+    paths.clear();
+
+    for (int x = 0; x < imageWidth; ++x) {
+      for (int s = 0; s < numSamples; ++s) {
+        auto  u = float(x + randomFloat()) / (imageWidth - 1);
+        auto  v = float((imageHeight - y) + randomFloat()) / (imageHeight - 1);
+
+        paths.push_back({cam.getRay(u, v), color3f(1.0f, 1.0f, 1.0f), 0, y * imageWidth + x});
+      }
+    }
+
+    for (int bounce = 0; bounce < maxBounce && !paths.empty(); bounce++) {
+      bool  nextEvent = sampleLights && bounce + 1 < maxBounce;
+
+      batch.clear();
+      queries.clear();
+      nextPaths.clear();
+
+      for (int i = 0; i < static_cast<int>(paths.size()); i++) {
+        const pathState&  path = paths[i];
+        color3f&          pixel = pixels[path.pixel];
+        hitRecord         record;
+
+        if (!world.hit(path.r, 0.001f, infinity, record)) {
+          color3f sky = background.value(path.r.dir);
+
+          if (sampleLights && path.scatterPdf > 0)
+            sky *= misWeight(path.scatterPdf, lights.pdfValue(path.r.o, path.r.dir));
+
+          pixel += path.throughput.cwiseProduct(sky);
+          continue;
+        }
+
+        color3f emitted = materials.emitted(record.matId, record.uv(0), record.uv(1), record.p);
+
+        if (sampleLights && path.scatterPdf > 0 && materials.isEmissive(record.matId))
+          emitted *= misWeight(path.scatterPdf, lights.pdfValue(path.r.o, path.r.dir));
+
+        pixel += path.throughput.cwiseProduct(emitted);
+
+        const pbrMetallicRoughness* pbr = materials.pbr(record.matId);
+
+        if (!pbr) {
+          vec3f   lightDir;
+          color3f f;
+          float   bsdfPdf, lightPdf;
+
+          if (nextEvent) {
+            lightDir = unitVector(lights.random(record.p));
+            lightPdf = lights.pdfValue(record.p, lightDir);
+
+            if (lightPdf > 0 && materials.evalScatter(record.matId, path.r, record, lightDir, f, bsdfPdf))
+              pixel += path.throughput.cwiseProduct(f).cwiseProduct(
+                        incomingLight(record.p, lightDir, path.r.time, background, world, materials)) *
+                        (misWeight(lightPdf, bsdfPdf) / lightPdf);
+          }
+
+          pathState next;
+          color3f   attenuation;
+
+          if (materials.scatter(record.matId, path.r, record, attenuation, next.r, next.scatterPdf)) {
+            next.throughput = path.throughput.cwiseProduct(attenuation);
+            next.pixel = path.pixel;
+            nextPaths.push_back(next);
+          }
+
+          continue;
+        }
+
+        pbrSurface  surface = pbr->surfaceAt(path.r, record);
+        vec3f       viewVec = -unitVector(path.r.dir);
+
+        // the same rejections as pbrMetallicRoughness::evalScatter and scatter
+        if (nextEvent) {
+          vec3f lightDir = unitVector(lights.random(record.p));
+          float lightPdf = lights.pdfValue(record.p, lightDir);
+
+          if (lightPdf > 0 && surface.normal.dot(lightDir) > 0 && lightDir.dot(record.normal) > 0)
+            queries.push_back({i, batch.add(surface, viewVec, lightDir), record.p, lightDir, lightPdf, 0, 0});
+        }
+
+        vec3f scatterDir = pbr->scatterDirection(surface, viewVec);
+
+        if (surface.normal.dot(scatterDir) > 0 && scatterDir.dot(record.normal) > 0)
+          queries.push_back({i, batch.add(surface, viewVec, scatterDir), record.p, scatterDir, 0,
+                              record.coneWidth, scatterSpread(path.r.coneSpread, surface.roughness)});
+      }
+
+      batch.evaluate(settings.bsdf);
+
+      for (const auto& query : queries) {
+        const pathState&  path = paths[query.path];
+        float             pdf = batch.pdf(query.lane);
+
+        if (pdf <= 0)
+          continue;
+
+        if (query.lightPdf > 0) {
+          color3f lightEmitted = incomingLight(query.p, query.dir, path.r.time, background, world, materials);
+
+          pixels[path.pixel] += path.throughput.cwiseProduct(batch.value(query.lane)).cwiseProduct(lightEmitted) *
+                                (misWeight(query.lightPdf, pdf) / query.lightPdf);
+        }
+        else {
+          nextPaths.push_back({ray(query.p, query.dir, path.r.time, query.coneWidth, query.coneSpread),
+                                path.throughput.cwiseProduct(batch.value(query.lane) / pdf), pdf, path.pixel});
+        }
+      }
+
+      std::swap(paths, nextPaths);
+    }
+  }
+}
+
+// add numSamples samples per pixel to a float image, rows top to bottom, starting at sample index
+// firstSample of each pixel's sequence, and sum the AOVs into aovs when given. The batched mode
+// interleaves paths, so it has no photon gather or AOVs and its samples are always independent;
+// passes with either shade through rayColor
+void renderPass(const hittable& world, const materialTable& materials, const hittableList& lights,
+                camera& cam, const environmentLight& background, int imageWidth, int imageHeight,
+                int numSamples, int maxBounce, std::vector<color3f>& pixels,
+                const causticMap* caustics = nullptr, int firstSample = 0, aovBuffers* aovs = nullptr) {
+  if (settings.batchShading && !caustics && !aovs) {
+    renderPassBatched(world, materials, lights, cam, background, imageWidth, imageHeight, numSamples,
+                      maxBounce, pixels);
+    return;
+  }
+
+  pixels.resize(imageWidth * imageHeight, color3f(0, 0, 0));
+
+  if (aovs)
+    aovs->resize(imageWidth * imageHeight);
+
+  for (int y = 0; y < imageHeight; ++y) {
+    for (int x = 0; x < imageWidth; ++x) {
+      color3f pixelColor(0, 0, 0);
+
+      for (int s = 0; s < numSamples; ++s) {
+        pixelSample sample(x, y, firstSample + s, settings.sampler == pixelSampling::sobol);
+
+        auto      u = float(x + randomFloat()) / (imageWidth - 1);
+        auto      v = float((imageHeight - y) + randomFloat()) / (imageHeight - 1);
+        ray       r = cam.getRay(u, v);
+        pixelAOV  aov;
+        color3f   radiance = rayColor(r, background, world, materials, lights, maxBounce, caustics,
+                                      aovs ? &aov : nullptr);
+
+        if (aovs)
+          aovs->add(y * imageWidth + x, aov, radiance);
+
+        pixelColor += radiance;
+      }
+
+      pixels[y * imageWidth + x] += pixelColor;
+    }
+  }
+}
+
+/******************************************************************************
+ * cost aware tile scheduling
+ *
+ *  A pixel of sky costs one ray, a pixel of dense geometry or glossy
+ *  bounces orders of magnitude more. Handed out in index order, the tiles
+ *  that happen to come last decide when a pass ends, with every other thread
+ *  idle while the last few expensive ones finish.
+ *
+ *  Given a tileSchedule, renderFilm() measures how long every tile took per
+ *  sample and plans the next pass from it: tiles ordered most expensive
+ *  first, and tiles costing more than a fraction of a thread's share split
+ *  into row ranges, so a pass ends on small cheap pieces. The first pass of
+ *  a progressive render, 1 spp, serves as the pre-pass. Split tiles are
+ *  written by several threads, each to its own rows.
+ ******************************************************************************/
+
+// rows [rowBegin, rowEnd) of a film tile, the unit threads take work in
+struct tileWork {
+  uint32_t  tile;
+  int       rowBegin, rowEnd;
+};
+
+// what one thread did, in seconds from the start of the pass
+struct workSpan {
+  int       thread;
+  uint32_t  item;
+  double    start, end;
+};
+
+struct tileSchedule {
+  std::vector<tileWork> items;        // next pass's work in order, empty for whole tiles in index order
+  std::vector<double>   tileCost;     // seconds per sample of every tile, from the last pass
+  std::vector<workSpan> timeline;     // the last pass, items indexing its work list
+  int                   numThreads = 0;
+};
+
+// pieces are split down to this fraction of a thread's share of the pass
+const int scheduleSplitsPerThread = 8;
+
+// every owned tile whole, in index order
+std::vector<tileWork> indexOrderWork(const film& image) {
+  std::vector<tileWork> items;
+
+  for (size_t t = 0; t < image.numTiles(); t++) {
+    if (image.shard().ownsTile(t))
+      items.push_back({static_cast<uint32_t>(t), 0, image.tile(t).height});
+  }
+
+  return items;
+}
+
+// schedule.items from schedule.tileCost: expensive first, hot tiles split into row ranges
+void planTiles(tileSchedule& schedule, const film& image, int numThreads) {
+  double  total = 0;
+
+  for (double cost : schedule.tileCost)
+    total += cost;
+
+  schedule.items.clear();
+
+  if (total <= 0 || schedule.tileCost.size() != image.numTiles())
+    return;
+
+  double                            target = total / (numThreads * scheduleSplitsPerThread);
+  std::vector<std::pair<double, tileWork>>  pieces;
+
+  for (size_t t = 0; t < image.numTiles(); t++) {
+    int     rows = image.tile(t).height;
+    double  cost = schedule.tileCost[t];
+    int     numPieces = std::min(rows, std::max(1, static_cast<int>(ceil(cost / target))));
+
+    if (!image.shard().ownsTile(t))
+      continue;
+
+    for (int p = 0; p < numPieces; p++) {
+      pieces.push_back({cost / numPieces, {static_cast<uint32_t>(t), rows * p / numPieces,
+                                           rows * (p + 1) / numPieces}});
+    }
+  }
+
+  std::stable_sort(pieces.begin(), pieces.end(),
+                    [](const auto& a, const auto& b) { return a.first > b.first; });
+
+  for (const auto& piece : pieces)
+    schedule.items.push_back(piece.second);
+}
+
+// add numSamples samples to every pixel of image's shard. Work goes to hardware threads as they free
+// up, whole tiles in index order or, with a schedule, as planned from the last pass, which is then
+// measured to plan the next. Each pixel's samples continue its sequence from its current count, so
+// passes can be added to a film at any time. Shades through rayColor like renderPass, guided by guide
+void renderFilm(const hittable& world, const materialTable& materials, const hittableList& lights,
+                camera& cam, const environmentLight& background, film& image, int numSamples, int maxBounce,
+                const causticMap* caustics = nullptr, tileSchedule* schedule = nullptr, sdTree* guide = nullptr) {
+  using clock = std::chrono::steady_clock;
+
+  std::atomic<size_t>                 nextItem(0);
+  int                                 numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  int                                 imageWidth = image.width(), imageHeight = image.frameHeight();
+  bool                                planned = schedule && !schedule->items.empty() &&
+                                                schedule->tileCost.size() == image.numTiles();
+  std::vector<tileWork>               items = planned ? schedule->items : indexOrderWork(image);
+  std::vector<std::vector<workSpan>>  spans(numThreads);
+  auto                                passStart = clock::now();
+
+  parallelThreads(numThreads, [&](int thread) {
+    for (size_t w = nextItem++; w < items.size(); w = nextItem++) {
+      const tileWork& work = items[w];
+      filmTile&       tile = image.tile(work.tile);
+      auto            workStart = clock::now();
+
+      for (int j = work.rowBegin; j < work.rowEnd; j++) {
+        for (int i = 0; i < tile.width; i++) {
+          int       pixel = j * tile.width + i;
+          int       x = tile.x + i, y = image.firstRow() + tile.y + j;
+          uint32_t  firstSample = image.shard().firstSample + tile.count[pixel];
+
+          for (int s = 0; s < numSamples; s++) {
+            pixelSample sample(x, y, firstSample + s, settings.sampler == pixelSampling::sobol);
+
+            auto      u = float(x + randomFloat()) / (imageWidth - 1);
+            auto      v = float((imageHeight - y) + randomFloat()) / (imageHeight - 1);
+            ray       r = cam.getRay(u, v);
+            pixelAOV  aov;
+            color3f   radiance = rayColor(r, background, world, materials, lights, maxBounce, caustics,
+                                          image.hasAOVs() ? &aov : nullptr, guide);
+
+            tile.add(pixel, radiance, &aov);
+          }
+        }
+      }
+
+      if (schedule) {
+        spans[thread].push_back({thread, static_cast<uint32_t>(w),
+                                  std::chrono::duration<double>(workStart - passStart).count(),
+                                  std::chrono::duration<double>(clock::now() - passStart).count()});
+      }
+    }
+  });
+
+  if (!schedule)
+    return;
+
+  schedule->tileCost.assign(image.numTiles(), 0);
+  schedule->timeline.clear();
+  schedule->numThreads = numThreads;
+
+  for (const auto& threadSpans : spans) {
+    for (const auto& span : threadSpans) {
+      schedule->tileCost[items[span.item].tile] += (span.end - span.start) / numSamples;
+      schedule->timeline.push_back(span);
+    }
+  }
+
+  planTiles(*schedule, image, numThreads);
+}
+
+// renders a width x height frame of numSamples spp a band of bandRows rows at a time and streams the
+// finished bands to png and exr, either may be null. Only one band's film and 8 bit rows exist at a
+// time, and the bands already handed to png deflate while the next one renders
+bool renderStreamed(const hittable& world, const materialTable& materials, const hittableList& lights,
+                    camera& cam, const environmentLight& background, int width, int height, int numSamples,
+                    int maxBounce, pngStream* png, exrStream* exr, int bandRows = 2 * filmTileSize,
+                    const causticMap* caustics = nullptr) {
+  std::vector<uint8_t>  target;
+  std::vector<color3f>  linear;
+
+  for (int firstRow = 0; firstRow < height; firstRow += bandRows) {
+    film  band(width, std::min(bandRows, height - firstRow));
+
+    band.setBand(firstRow, height);
+    renderFilm(world, materials, lights, cam, background, band, numSamples, maxBounce, caustics);
+
+    if (png) {
+      target.resize(4 * width * band.height());
+      band.toTarget(target.data(), 4);
+      png->writeRows(target.data(), band.height());
+    }
+
+    if (exr) {
+      linear.resize(width * band.height());
+
+      for (int y = 0; y < band.height(); y++) {
+        for (int x = 0; x < width; x++)
+          linear[y * width + x] = band.mean(x, y);
+      }
+
+      exr->writeRows(linear.data(), band.height());
+    }
+  }
+
+  bool  ok = true;
+
+  if (png)
+    ok = png->finish() && ok;
+
+  if (exr)
+    ok = exr->finish() && ok;
+
+  return ok;
+}
+
+// samples of the next progressive pass, doubling the total each pass (1, 2, 4, ... spp) until
+// passes reach maxPassSamples, and never past targetSamples
+inline int progressivePassSamples(int done, int targetSamples, int maxPassSamples) {
+  return std::min({std::max(done, 1), maxPassSamples, targetSamples - done});
+}
+
+// target of renders that only stop at a budget
+const int unlimitedSamples = 1 << 24;
+
+// where a progressive render may stop early, 0 disables either
+struct renderBudget {
+  double  seconds = 0;      // wall clock
+  float   error = 0;        // film::relativeError() to reach
+};
+
+// samples per pixel at which error, measured at done samples, is predicted to reach targetError
+inline int budgetErrorSamples(int done, float error, float targetError) {
+  double  ratio = error / targetError;
+
+  return static_cast<int>(std::min(ceil(done * ratio * ratio), static_cast<double>(unlimitedSamples)));
+}
+
+// progressivePassSamples, cut down to what is predicted to fit in the rest of the time budget
+// at secondsPerSample, and to the samples 1/sqrt(n) convergence predicts the error target needs.
+// 0 once neither allows another sample
+inline int budgetedPassSamples(int done, int targetSamples, int maxPassSamples, const renderBudget& budget,
+                                double elapsed, double secondsPerSample, float error) {
+  int samples = progressivePassSamples(done, targetSamples, maxPassSamples);
+
+  if (budget.error > 0 && done > 0) {
+    if (error <= budget.error)
+      return 0;
+
+    samples = std::min(samples, std::max(budgetErrorSamples(done, error, budget.error) - done, 1));
+  }
+
+  if (budget.seconds > 0 && secondsPerSample > 0)
+    samples = std::min(samples, static_cast<int>((budget.seconds - elapsed) / secondsPerSample));
+
+  return std::max(samples, 0);
+}
+
+// where a render with a time budget is headed, from the cost of its passes so far
+struct budgetPrediction {
+  int     samples;          // spp when it stops
+  double  seconds;          // total time by then
+  float   error;            // relativeError() by then
+  bool    reachesTarget;    // stops at the sample or error target rather than the time budget
+};
+
+budgetPrediction predictBudget(const film& image, const renderBudget& budget, int targetSamples, double elapsed,
+                                double secondsPerSample) {
+  int     done = image.maxCount();
+  float   error = image.relativeError();
+  int     wanted = targetSamples;
+
+  if (budget.error > 0)
+    wanted = std::min(wanted, budgetErrorSamples(done, error, budget.error));
+
+  int     affordable = done + static_cast<int>(std::max(budget.seconds - elapsed, 0.0) / secondsPerSample);
+  int     samples = std::max(std::min(wanted, affordable), done);
+
+  return {samples, elapsed + (samples - done) * secondsPerSample, error * sqrtf(static_cast<float>(done) / samples),
+          wanted <= affordable};
+}
+
+// progressive passes into image until it has targetSamples or budget is spent. The latest pass
+// predicts the cost of the next, the first also paid for warming up caches. afterPass(seconds
+// since the start, seconds per spp) runs after every pass, returns the seconds taken. A guide
+// learns from the passes while it trains, and guides them. Caustic photons emitted by the caller
+// serve the first pass, every later pass traces fresh ones with a smaller radius
+template <typename F>
+double renderProgressive(const hittable& world, const materialTable& materials, const hittableList& lights,
+                          camera& cam, const environmentLight& background, film& image, int targetSamples,
+                          int maxPassSamples, const renderBudget& budget, int maxBounce,
+                          causticMap* caustics, F afterPass, sdTree* guide = nullptr) {
+  using clock = std::chrono::steady_clock;
+
+  auto    start = clock::now();
+  auto    elapsed = [](clock::time_point since) {
+    return std::chrono::duration<double>(clock::now() - since).count();
+  };
+  double        secondsPerSample = 0;
+  tileSchedule  schedule;
+  bool          firstPass = true;
+
+  for (int done = image.maxCount(); done < targetSamples; done = image.maxCount()) {
+    int   passSamples = budgetedPassSamples(done, targetSamples, maxPassSamples, budget, elapsed(start),
+                                            secondsPerSample, image.relativeError());
+
+    if (passSamples == 0)
+      break;
+
+    auto  passStart = clock::now();
+
+    // counted in the pass, photons are part of what a sample costs
+    if (caustics && !firstPass) {
+      caustics->nextPass();
+      caustics->emit(world, materials);
+    }
+
+    firstPass = false;
+    renderFilm(world, materials, lights, cam, background, image, passSamples, maxBounce, caustics, &schedule, guide);
+    secondsPerSample = elapsed(passStart) / passSamples;
+
+    if (guide && guide->training())
+      guide->refine(passSamples);
+
+    afterPass(elapsed(start), secondsPerSample);
+  }
+
+  return elapsed(start);
+}
+
+// progressive photon mapping: numSamples samples per pixel in passes of samplesPerPass, each with
+// freshly traced photons and a smaller gather radius than the last
+void renderCaustics(const hittable& world, const materialTable& materials, const hittableList& lights,
+                    camera& cam, const environmentLight& background, int imageWidth, int imageHeight,
+                    int numSamples, int samplesPerPass, int maxBounce, causticMap& caustics,
+                    std::vector<color3f>& pixels) {
+  for (int done = 0; done < numSamples; done += samplesPerPass) {
+    caustics.emit(world, materials);
+    renderPass(world, materials, lights, cam, background, imageWidth, imageHeight,
+                std::min(samplesPerPass, numSamples - done), maxBounce, pixels, &caustics, done);
+    caustics.nextPass();
+  }
+}
+
+#endif
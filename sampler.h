@@ -0,0 +1,144 @@
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <cstdint>
+
+/******************************************************************************
+ * low discrepancy pixel samples
+ *
+ *  Owen-scrambled Sobol (Burley 2020). Only 4 Sobol dimensions are stored;
+ *  every group of 4 dimensions shuffles the sample index with its own seed,
+ *  which pads the sequence to any number of dimensions while keeping each
+ *  group well stratified in all its projections. Shuffle and scramble are
+ *  hash-based nested uniform scrambles seeded per pixel, so pixels are
+ *  decorrelated from each other.
+ *
+ *  While a pixelSample is alive on a thread, randomFloat() returns successive
+ *  dimensions of that pixel sample instead of mt19937 draws, so jitter, lens,
+ *  light and bsdf samples all take their share without changing signatures.
+ *  The warps the paths use draw a fixed number of dimensions each, rejection
+ *  loops would shift every dimension after them.
+ ******************************************************************************/
+
+struct sobolMatrices {
+  uint32_t  v[4][32];
+};
+
+// direction numbers for the first 4 dimensions (Joe and Kuo 2008)
+constexpr sobolMatrices buildSobolMatrices() {
+  const uint32_t  s[4] = {0, 1, 2, 3};
+  const uint32_t  a[4] = {0, 0, 1, 1};
+  const uint32_t  m[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+  sobolMatrices   result = {};
+
+  // van der Corput
+  for (int i = 0; i < 32; i++)
+    result.v[0][i] = 1u << (31 - i);
+
+  for (int d = 1; d < 4; d++) {
+    uint32_t* v = result.v[d];
+
+    for (uint32_t i = 0; i < s[d]; i++)
+      v[i] = m[d][i] << (31 - i);
+
+    for (uint32_t i = s[d]; i < 32; i++) {
+      v[i] = v[i - s[d]] ^ (v[i - s[d]] >> s[d]);
+
+      for (uint32_t k = 1; k < s[d]; k++)
+        v[i] ^= ((a[d] >> (s[d] - 1 - k)) & 1) * v[i - k];
+    }
+  }
+
+  return result;
+}
+
+constexpr sobolMatrices sobolDirections = buildSobolMatrices();
+
+inline uint32_t sobol(uint32_t index, int dimension) {
+  uint32_t  x = 0;
+
+  for (int bit = 0; index; index >>= 1, bit++) {
+    if (index & 1)
+      x ^= sobolDirections.v[dimension][bit];
+  }
+
+  return x;
+}
+
+inline uint32_t hashUint(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+
+  return x;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t value) {
+  return seed ^ (hashUint(value) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+inline uint32_t reverseBits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+
+  return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of the bits from the top down, a Laine-Karras permutation on the reversed bits
+inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+  x = reverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+
+  return reverseBits(x);
+}
+
+// the dimensions of one pixel sample handed out in order
+struct sampleStream {
+  uint32_t  index;
+  uint32_t  seed;
+  uint32_t  dimension;
+  bool      active;
+};
+
+inline sampleStream& currentSampleStream() {
+  thread_local sampleStream stream = {0, 0, 0, false};
+
+  return stream;
+}
+
+inline float nextSample(sampleStream& stream) {
+  uint32_t  group = stream.dimension / 4;
+  uint32_t  groupSeed = hashCombine(stream.seed, group);
+  uint32_t  index = nestedUniformScramble(stream.index, groupSeed);
+  uint32_t  x = nestedUniformScramble(sobol(index, stream.dimension % 4), hashCombine(groupSeed, stream.dimension));
+
+  stream.dimension++;
+
+  // top 24 bits, so the result stays below 1
+  return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// randomFloat() draws the dimensions of sample sampleIndex of pixel (x, y) while this lives
+class pixelSample {
+  public:
+    pixelSample(int x, int y, int sampleIndex, bool enable = true) {
+      if (enable)
+        currentSampleStream() = {static_cast<uint32_t>(sampleIndex),
+                                  hashCombine(hashUint(static_cast<uint32_t>(x)), static_cast<uint32_t>(y)), 0, true};
+    }
+
+    ~pixelSample() { currentSampleStream().active = false; }
+
+    pixelSample(const pixelSample&) = delete;
+    pixelSample& operator=(const pixelSample&) = delete;
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __SETTINGS_H__
+#define __SETTINGS_H__
+
+// runtime switches for A/B comparisons, set from main() or benchmarks
+
+enum class bsdfSampling {
+  cosine,       // cosine weighted around the shading normal
+  importance    // pick diffuse or GGX lobe, sample visible normals for GGX
+};
+
+enum class lightSampling {
+  uniform,      // every light equally likely
+  tree          // light BVH, lights picked by estimated contribution at the shading point
+};
+
+enum class pixelSampling {
+  independent,  // mt19937 for every dimension
+  sobol         // Owen-scrambled Sobol dimensions per pixel sample, see sampler.h
+};
+
+struct renderSettings {
+  bsdfSampling  bsdf = bsdfSampling::importance;
+  bool          nextEventEstimation = true;   // sample lights directly, combined with bsdf sampling by MIS
+  lightSampling lightSelection = lightSampling::tree;
+  bool          environmentSampling = true;   // importance sample image environments as a light
+  bool          batchShading = false;         // renderPass shades pbr hits in SIMD batches, see pbrbatch.h
+  pixelSampling sampler = pixelSampling::sobol;
+  bool          pathGuiding = false;          // progressive renders learn where light comes from, see guiding.h
+};
+
+renderSettings settings;
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_DISPATCH 1
+#include <immintrin.h>
+#else
+#define SIMD_DISPATCH 0
+#endif
+
+/******************************************************************************
+ * SIMD floats
+ *
+ *  Kernels are written once as templates over the lane type using the v*
+ *  helpers below, which also have float overloads, so the same code runs as a
+ *  scalar reference. floatx8 holds 8 lanes for AVX2 + FMA and floatx16 holds 16
+ *  for AVX-512. Both are compiled into every x86 build with target attributes,
+ *  whatever -march says, and simdLevel() picks one at run time, so portable
+ *  binaries still get vector kernels.
+ *
+ *  A kernel entry point is a function marked SIMD_AVX2_KERNEL or
+ *  SIMD_AVX512_KERNEL that instantiates the template; flatten inlines the whole
+ *  call tree into it, which then compiles for that instruction set. The lane
+ *  types keep their floats in memory form, so calls that do not get inlined
+ *  (-O0) still pass them correctly between differently targeted functions.
+ *
+ *  vexp2 replaces exp2f with range reduction and a degree 5 minimax polynomial
+ *  for 2^f on [0, 1), max relative error 1.5e-7 for x in [-126, 126]. Inputs
+ *  are clamped to that range, so it never returns denormals, 0 or infinity.
+ ******************************************************************************/
+
+// minimax coefficients of 2^f, f in [0, 1), relative error 7.5e-8 before rounding
+const float exp2C0 = 9.999999251e-01f;
+const float exp2C1 = 6.931530732e-01f;
+const float exp2C2 = 2.401536175e-01f;
+const float exp2C3 = 5.582631678e-02f;
+const float exp2C4 = 8.989341631e-03f;
+const float exp2C5 = 1.877576031e-03f;
+
+inline float  vmin(float a, float b) { return fminf(a, b); }
+inline float  vmax(float a, float b) { return fmaxf(a, b); }
+inline float  vsqrt(float a) { return sqrtf(a); }
+inline float  vfmadd(float a, float b, float c) { return a * b + c; }
+inline float  vselect(bool mask, float a, float b) { return mask ? a : b; }
+
+inline float vexp2(float x) {
+  x = fminf(fmaxf(x, -126.0f), 126.0f);
+
+  float   i = floorf(x);
+  float   f = x - i;
+  float   p = ((((exp2C5 * f + exp2C4) * f + exp2C3) * f + exp2C2) * f + exp2C1) * f + exp2C0;
+  int32_t bits = (static_cast<int32_t>(i) + 127) << 23;
+  float   scale;
+
+  memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+
+enum class simdISA { scalar, avx2, avx512 };
+
+inline simdISA detectSIMD() {
+#if SIMD_DISPATCH
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+    return simdISA::avx512;
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return simdISA::avx2;
+#endif
+
+  return simdISA::scalar;
+}
+
+// widest instruction set of this cpu, detected once
+inline simdISA simdLevel() {
+  static const simdISA level = detectSIMD();
+  return level;
+}
+
+inline int simdLanes(simdISA isa) {
+  return isa == simdISA::avx512 ? 16 : isa == simdISA::avx2 ? 8 : 1;
+}
+
+inline const char* simdName(simdISA isa) {
+  return isa == simdISA::avx512 ? "AVX-512" : isa == simdISA::avx2 ? "AVX2" : "scalar";
+}
+
+// loads and stores of V lanes, also plain floats when V is float
+template <typename V>
+inline V      loadLanes(const float* p);
+template <>
+inline float  loadLanes<float>(const float* p) { return *p; }
+
+template <typename V>
+inline void   storeLanes(float* p, V a);
+template <>
+inline void   storeLanes<float>(float* p, float a) { *p = a; }
+
+inline float  vabs(float a) { return fabsf(a); }
+
+#if SIMD_DISPATCH
+
+#define SIMD_AVX2           __attribute__((target("avx2,fma")))
+#define SIMD_AVX512         __attribute__((target("avx512f")))
+#define SIMD_AVX2_KERNEL    __attribute__((target("avx2,fma"), flatten))
+#define SIMD_AVX512_KERNEL  __attribute__((target("avx512f"), flatten))
+
+struct floatx8 {
+  float lanes[8];
+
+  floatx8() {}
+  SIMD_AVX2 floatx8(float f) { _mm256_storeu_ps(lanes, _mm256_set1_ps(f)); }
+  SIMD_AVX2 floatx8(__m256 x) { _mm256_storeu_ps(lanes, x); }
+  SIMD_AVX2 floatx8(const floatx8& a) { _mm256_storeu_ps(lanes, a.v()); }
+
+  SIMD_AVX2 floatx8& operator=(const floatx8& a) { _mm256_storeu_ps(lanes, a.v()); return *this; }
+
+  SIMD_AVX2 __m256  v() const { return _mm256_loadu_ps(lanes); }
+};
+
+struct maskx8 {
+  float lanes[8];
+
+  SIMD_AVX2 maskx8(__m256 x) { _mm256_storeu_ps(lanes, x); }
+
+  SIMD_AVX2 __m256  m() const { return _mm256_loadu_ps(lanes); }
+};
+
+template <>
+SIMD_AVX2 inline floatx8  loadLanes<floatx8>(const float* p) { return _mm256_loadu_ps(p); }
+template <>
+SIMD_AVX2 inline void     storeLanes<floatx8>(float* p, floatx8 a) { _mm256_storeu_ps(p, a.v()); }
+
+SIMD_AVX2 inline floatx8  operator+(floatx8 a, floatx8 b) { return _mm256_add_ps(a.v(), b.v()); }
+SIMD_AVX2 inline floatx8  operator-(floatx8 a, floatx8 b) { return _mm256_sub_ps(a.v(), b.v()); }
+SIMD_AVX2 inline floatx8  operator*(floatx8 a, floatx8 b) { return _mm256_mul_ps(a.v(), b.v()); }
+SIMD_AVX2 inline floatx8  operator/(floatx8 a, floatx8 b) { return _mm256_div_ps(a.v(), b.v()); }
+SIMD_AVX2 inline maskx8   operator>(floatx8 a, floatx8 b) { return _mm256_cmp_ps(a.v(), b.v(), _CMP_GT_OQ); }
+
+SIMD_AVX2 inline floatx8  vmin(floatx8 a, floatx8 b) { return _mm256_min_ps(a.v(), b.v()); }
+SIMD_AVX2 inline floatx8  vmax(floatx8 a, floatx8 b) { return _mm256_max_ps(a.v(), b.v()); }
+SIMD_AVX2 inline floatx8  vabs(floatx8 a) { return vmax(a, 0.0f - a); }
+SIMD_AVX2 inline floatx8  vsqrt(floatx8 a) { return _mm256_sqrt_ps(a.v()); }
+SIMD_AVX2 inline floatx8  vfmadd(floatx8 a, floatx8 b, floatx8 c) { return _mm256_fmadd_ps(a.v(), b.v(), c.v()); }
+SIMD_AVX2 inline floatx8  vselect(maskx8 mask, floatx8 a, floatx8 b) { return _mm256_blendv_ps(b.v(), a.v(), mask.m()); }
+
+SIMD_AVX2 inline floatx8 vexp2(floatx8 x) {
+  x = vmin(vmax(x, -126.0f), 126.0f);
+
+  floatx8 i = _mm256_floor_ps(x.v());
+  floatx8 f = x - i;
+  floatx8 p = vfmadd(vfmadd(vfmadd(vfmadd(vfmadd(exp2C5, f, exp2C4), f, exp2C3), f, exp2C2), f, exp2C1), f, exp2C0);
+  __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(i.v()), _mm256_set1_epi32(127)), 23);
+
+  return p * floatx8(_mm256_castsi256_ps(bits));
+}
+
+struct floatx16 {
+  float lanes[16];
+
+  floatx16() {}
+  SIMD_AVX512 floatx16(float f) { _mm512_storeu_ps(lanes, _mm512_set1_ps(f)); }
+  SIMD_AVX512 floatx16(__m512 x) { _mm512_storeu_ps(lanes, x); }
+  SIMD_AVX512 floatx16(const floatx16& a) { _mm512_storeu_ps(lanes, a.v()); }
+
+  SIMD_AVX512 floatx16& operator=(const floatx16& a) { _mm512_storeu_ps(lanes, a.v()); return *this; }
+
+  SIMD_AVX512 __m512  v() const { return _mm512_loadu_ps(lanes); }
+};
+
+struct maskx16 {
+  __mmask16 m;
+};
+
+// the unmasked forms of some intrinsics start from _mm512_undefined_ps, which GCC 12 reports as
+// used uninitialized once inlined, zero masking with every lane set compiles to the same instruction
+const __mmask16 allLanes = 0xffff;
+
+template <>
+SIMD_AVX512 inline floatx16 loadLanes<floatx16>(const float* p) { return _mm512_loadu_ps(p); }
+template <>
+SIMD_AVX512 inline void     storeLanes<floatx16>(float* p, floatx16 a) { _mm512_storeu_ps(p, a.v()); }
+
+SIMD_AVX512 inline floatx16 operator+(floatx16 a, floatx16 b) { return _mm512_add_ps(a.v(), b.v()); }
+SIMD_AVX512 inline floatx16 operator-(floatx16 a, floatx16 b) { return _mm512_sub_ps(a.v(), b.v()); }
+SIMD_AVX512 inline floatx16 operator*(floatx16 a, floatx16 b) { return _mm512_mul_ps(a.v(), b.v()); }
+SIMD_AVX512 inline floatx16 operator/(floatx16 a, floatx16 b) { return _mm512_div_ps(a.v(), b.v()); }
+SIMD_AVX512 inline maskx16  operator>(floatx16 a, floatx16 b) { return {_mm512_cmp_ps_mask(a.v(), b.v(), _CMP_GT_OQ)}; }
+
+SIMD_AVX512 inline floatx16 vmin(floatx16 a, floatx16 b) { return _mm512_maskz_min_ps(allLanes, a.v(), b.v()); }
+SIMD_AVX512 inline floatx16 vmax(floatx16 a, floatx16 b) { return _mm512_maskz_max_ps(allLanes, a.v(), b.v()); }
+SIMD_AVX512 inline floatx16 vabs(floatx16 a) { return vmax(a, 0.0f - a); }
+SIMD_AVX512 inline floatx16 vsqrt(floatx16 a) { return _mm512_maskz_sqrt_ps(allLanes, a.v()); }
+SIMD_AVX512 inline floatx16 vfmadd(floatx16 a, floatx16 b, floatx16 c) { return _mm512_fmadd_ps(a.v(), b.v(), c.v()); }
+SIMD_AVX512 inline floatx16 vselect(maskx16 mask, floatx16 a, floatx16 b) { return _mm512_mask_blend_ps(mask.m, b.v(), a.v()); }
+
+SIMD_AVX512 inline floatx16 vexp2(floatx16 x) {
+  x = vmin(vmax(x, -126.0f), 126.0f);
+
+  floatx16  i = _mm512_maskz_roundscale_ps(allLanes, x.v(), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  floatx16  f = x - i;
+  floatx16  p = vfmadd(vfmadd(vfmadd(vfmadd(vfmadd(exp2C5, f, exp2C4), f, exp2C3), f, exp2C2), f, exp2C1), f, exp2C0);
+  __m512i   exponent = _mm512_add_epi32(_mm512_maskz_cvtps_epi32(allLanes, i.v()), _mm512_set1_epi32(127));
+  __m512i   bits = _mm512_maskz_slli_epi32(allLanes, exponent, 23);
+
+  return p * floatx16(_mm512_castsi512_ps(bits));
+}
+
+#endif
+
+// y = vexp2(x) for n values, n a multiple of the lanes of isa
+template <typename V>
+inline void vexp2Lanes(const float* x, float* y, int n) {
+  const int lanes = sizeof(V) / sizeof(float);
+
+  for (int i = 0; i < n; i += lanes)
+    storeLanes<V>(&y[i], vexp2(loadLanes<V>(&x[i])));
+}
+
+#if SIMD_DISPATCH
+SIMD_AVX2_KERNEL inline void    vexp2AVX2(const float* x, float* y, int n) { vexp2Lanes<floatx8>(x, y, n); }
+SIMD_AVX512_KERNEL inline void  vexp2AVX512(const float* x, float* y, int n) { vexp2Lanes<floatx16>(x, y, n); }
+#endif
+
+inline void vexp2(const float* x, float* y, int n, simdISA isa = simdLevel()) {
+#if SIMD_DISPATCH
+  if (isa == simdISA::avx512)
+    return vexp2AVX512(x, y, n);
+
+  if (isa == simdISA::avx2)
+    return vexp2AVX2(x, y, n);
+#endif
+
+  vexp2Lanes<float>(x, y, n);
+}
+
+#endif
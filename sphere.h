@@ -4,20 +4,28 @@
 #include "globals.h"
 #include "hittable.h"
 #include "hittablevector.h"
+#include "material.h"
 
 class sphere : public hittable {
   public:
     sphere() {}
     sphere(vec3f c0, vec3f c1,
             float time0, float time1,
-            float r, shared_ptr<material> m) : center0(c0), center1(c1),
+            float r, materialId m) : center0(c0), center1(c1),
             t0(time0), t1(time1),
-            radius(r), matPtr(m) {};
+            radius(r), matId(m) {};
 
     virtual bool  hit(const ray &ray, float tMin, float tMax, hitRecord &record) const override;
     virtual bool  boundingBox(float time0, float time1, aabb& outputBox) const override;
     virtual void  calcTangentBasis(const vec3f& normal, vec3f& tangent, vec3f& bitangent) const override;
 
+    // uniform sampling of the cone subtended by the sphere, lights are sampled at time 0
+    virtual float pdfValue(const vec3f& o, const vec3f& v) const override;
+    virtual vec3f random(const vec3f& o) const override;
+    virtual bool  isEmitter(const materialTable& materials) const override { return materials.isEmissive(matId); }
+    virtual bool  emitterBounds(const materialTable& materials, lightBounds& bounds) const override;
+    virtual bool  emitPhoton(const materialTable& materials, ray& photon, color3f& power) const override;
+
     virtual int   populateVector(shared_ptr<class hittableVector> hittableVector) const override {
         int index = hittableVector->objects.size();
         hittableVector->objects.emplace_back();
@@ -41,7 +49,7 @@ class sphere : public hittable {
     vec3f                 center0, center1;
     float                 t0, t1;
     float                 radius;
-    shared_ptr<material>  matPtr;
+    materialId            matId;
 };
 
 vec3f sphere::center(float time) const {
@@ -55,8 +63,10 @@ bool sphere::hit(const ray &ray, float tMin, float tMax, hitRecord &record) cons
   vec3f oc = ray.o - center(ray.time);
   auto  a = lengthSquared(ray.dir);
   auto  halfB = oc.dot(ray.dir);
-  auto  c = lengthSquared(oc) - radius * radius;
-  auto  discriminant = halfB * halfB - a * c;
+  // b^2 - ac written as r^2 minus the squared distance of the line to the center, which
+  // doesn't cancel catastrophically for small distant spheres such as lights
+  vec3f perpendicular = oc - (halfB / a) * ray.dir;
+  auto  discriminant = a * (radius * radius - lengthSquared(perpendicular));
 
   if (discriminant < 0.0f)
     return false;
@@ -76,7 +86,10 @@ bool sphere::hit(const ray &ray, float tMin, float tMax, hitRecord &record) cons
   vec3f outwardNormal = unitVector(record.p - center(ray.time));// / radius;
   record.setFaceNormal(ray, outwardNormal);
   getSphereUV(outwardNormal, record.uv);
-  record.matPtr = matPtr;
+  record.setCone(ray);
+  // uv square maps onto the full surface area of 4 * pi * r^2
+  record.uvScale = 1.0f / (2.0f * radius * sqrtf(pi));
+  record.matId = matId;
   calcTangentBasis(outwardNormal, record.tangent, record.bitangent);
 
   return true;
@@ -93,6 +106,81 @@ bool sphere::boundingBox(float time0, float time1, aabb& outputBox) const {
   return true;
 }
 
+// 1 - cos(thetaMax) of the cone from o, written to stay accurate for small distant spheres
+inline float coneOneMinusCos(float radius, float distanceSquared) {
+  float sin2 = radius * radius / distanceSquared;
+
+  return sin2 / (1.0f + sqrtf(fmaxf(1.0f - sin2, 0)));
+}
+
+float sphere::pdfValue(const vec3f& o, const vec3f& v) const {
+  hitRecord record;
+  float     distanceSquared = lengthSquared(center(0) - o);
+
+  // no cone to sample from inside
+  if (distanceSquared <= radius * radius)
+    return 0;
+
+  if (!hit(ray(o, v), 0.001f, infinity, record))
+    return 0;
+
+  return 1.0f / (2.0f * pi * coneOneMinusCos(radius, distanceSquared));
+}
+
+vec3f sphere::random(const vec3f& o) const {
+  vec3f direction = center(0) - o;
+  float distanceSquared = lengthSquared(direction);
+
+  if (distanceSquared <= radius * radius)
+    return direction;
+
+  vec3f axis = direction / sqrtf(distanceSquared);
+  vec3f tangent, bitangent;
+  buildBasis(axis, tangent, bitangent);
+
+  float oneMinusCos = randomFloat() * coneOneMinusCos(radius, distanceSquared);
+  float cosTheta = 1.0f - oneMinusCos;
+  float sinTheta = sqrtf(fmaxf(oneMinusCos * (2.0f - oneMinusCos), 0));
+  float phi = 2.0f * pi * randomFloat();
+
+  return cosf(phi) * sinTheta * tangent + sinf(phi) * sinTheta * bitangent + cosTheta * axis;
+}
+
+bool sphere::emitterBounds(const materialTable& materials, lightBounds& bounds) const {
+  if (!isEmitter(materials))
+    return false;
+
+  // emits in every direction, textured emission is approximated by one lookup
+  boundingBox(0, 0, bounds.box);
+  bounds.axis = vec3f::UnitZ();
+  bounds.cosThetaO = -1.0f;
+  bounds.cosThetaE = 0;
+  bounds.power = pi * 4.0f * pi * radius * radius *
+                  luminance(materials.emitted(matId, 0.5f, 0.5f, center(0)));
+
+  return true;
+}
+
+bool sphere::emitPhoton(const materialTable& materials, ray& photon, color3f& power) const {
+  if (!isEmitter(materials))
+    return false;
+
+  vec3f normal = randomUnitVector();
+  vec3f p = center(0) + radius * normal;
+  vec3f tangent, bitangent;
+  vec2f uv;
+
+  buildBasis(normal, tangent, bitangent);
+  getSphereUV(normal, uv);
+
+  vec3f local = cosineSampleHemisphere(randomFloat(), randomFloat());
+
+  photon = ray(p, local(0) * tangent + local(1) * bitangent + local(2) * normal, 0);
+  power = pi * 4.0f * pi * radius * radius * materials.emitted(matId, uv(0), uv(1), p);
+
+  return true;
+}
+
 void sphere::calcTangentBasis(const vec3f& normal, vec3f& tangent, vec3f& bitangent) const {
   vec3f b;
 
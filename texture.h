@@ -1,7 +1,9 @@
 #ifndef __TEXTURE_H__
 #define __TEXTURE_H__
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
 
 #include "stb_image.h"
 #include "stb_image_write.h"
@@ -13,8 +15,68 @@ using std::uint8_t;
 class texture {
   public:
     virtual color3f value(float u, float v, const vec3f& p) const = 0;
+
+    // filtered lookup over a uv-space footprint, point sampled unless overridden
+    virtual color3f value(float u, float v, const vec3f& p, float footprint) const {
+      return value(u, v, p);
+    }
+
+    // texel resolution of image backed textures, false for procedural ones
+    virtual bool    resolution(int& w, int& h) const { return false; }
 };
 
+// fractional mip level whose texel size matches a uv-space footprint
+inline float mipLevelOf(float footprint, int width, int height, int numLevels) {
+  if (!(footprint > 0) || numLevels <= 1)
+    return 0;
+
+  float level = log2f(footprint * std::max(width, height));
+
+  return clamp(level, 0, static_cast<float>(numLevels - 1));
+}
+
+// texel(i, j) returns the texel at integer coords, u/v already clamped and flipped
+template <typename T, typename texelFn>
+T bilinearSample(float u, float v, int width, int height, texelFn texel) {
+  float x = u * width - 0.5f;
+  float y = v * height - 0.5f;
+  int   x0 = static_cast<int>(floorf(x));
+  int   y0 = static_cast<int>(floorf(y));
+  float fx = x - x0;
+  float fy = y - y0;
+  int   x1 = std::min(x0 + 1, width - 1);
+  int   y1 = std::min(y0 + 1, height - 1);
+
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+
+  T top = texel(x0, y0) * (1.0f - fx) + texel(x1, y0) * fx;
+  T bottom = texel(x0, y1) * (1.0f - fx) + texel(x1, y1) * fx;
+
+  return top * (1.0f - fy) + bottom * fy;
+}
+
+// texel(level, i, j) fetches from a mip chain where each level halves the previous
+template <typename T, typename texelFn>
+T trilinearSample(float u, float v, float footprint, int width, int height,
+                  int numLevels, texelFn texel) {
+  float level = mipLevelOf(footprint, width, height, numLevels);
+  int   level0 = static_cast<int>(level);
+  float f = level - level0;
+
+  auto  sampleLevel = [&](int l) {
+    return bilinearSample<T>(u, v, std::max(1, width >> l), std::max(1, height >> l),
+                              [&](int i, int j) { return texel(l, i, j); });
+  };
+
+  T     result = sampleLevel(level0);
+
+  if (f > 0 && level0 + 1 < numLevels)
+    result = result * (1.0f - f) + sampleLevel(level0 + 1) * f;
+
+  return result;
+}
+
 class solidColor : public texture {
   public:
     solidColor() {}
@@ -106,28 +168,74 @@ class image3bpp : public texture {
     int             bytesPerScanline;
 };
 
+enum class textureLayout { linear, tiled };
+
+// what an image texture holds, lets loaders pick a storage format
+enum class textureUsage { color, normal, scalar, data };
+
+// texels are grouped into 8x8 tiles so 2D-local lookups stay within a few cache lines
+const int tileShift = 3;
+const int tileSize = 1 << tileShift;
+const int tileMask = tileSize - 1;
+
+struct mipLevel {
+  int                   width, height;
+  int                   tilesX;   // 0 when stored row-major
+  std::vector<uint8_t>  texels;
+
+  inline size_t texelIndex(int i, int j) const {
+    if (tilesX == 0)
+      return static_cast<size_t>(j) * width + i;
+
+    size_t  tile = static_cast<size_t>(j >> tileShift) * tilesX + (i >> tileShift);
+
+    return (tile << (2 * tileShift)) | ((j & tileMask) << tileShift) | (i & tileMask);
+  }
+
+  // reorder row-major texels into padded tiles
+  void tile(int bpp) {
+    if (tilesX != 0)
+      return;
+
+    int                   tilesY = (height + tileMask) >> tileShift;
+    std::vector<uint8_t>  linear;
+
+    linear.swap(texels);
+    tilesX = (width + tileMask) >> tileShift;
+    texels.resize(static_cast<size_t>(tilesX) * tilesY * tileSize * tileSize * bpp);
+
+    for (int j = 0; j < height; j++)
+      for (int i = 0; i < width; i++)
+        std::copy_n(&linear[(static_cast<size_t>(j) * width + i) * bpp], bpp,
+                    &texels[texelIndex(i, j) * bpp]);
+  }
+};
+
 class imagePNG : public texture {
   public:
-    imagePNG(int bytesPP) : data(nullptr), width(0), height(0), bpp(bytesPP), bytesPerScanline(0) {}
-    imagePNG(const char* filename, int bytesPP) : bpp(bytesPP) {
+    imagePNG(int bytesPP) : width(0), height(0), bpp(bytesPP) {}
+    imagePNG(const char* filename, int bytesPP,
+              textureLayout layout = textureLayout::tiled) : bpp(bytesPP) {
       auto  componentsPP = bpp;
       
-      data = stbi_load(filename, &width, &height, &componentsPP, componentsPP);
+      uint8_t*  data = stbi_load(filename, &width, &height, &componentsPP, componentsPP);
 
       if (!data) {
         std::cerr << "ERROR: Could not load image file '" << filename << "'\n";
         width = height = 0;
+        return;
       }
 
-      bytesPerScanline = bpp * width;
+      buildMips(data, layout);
+      stbi_image_free(data);
     }
-
-    ~imagePNG() {
-      delete data;
+    imagePNG(const uint8_t* data, int w, int h, int bytesPP,
+              textureLayout layout = textureLayout::tiled) : width(w), height(h), bpp(bytesPP) {
+      buildMips(data, layout);
     }
 
     virtual color3f value(float u, float v, const vec3f& p) const override {
-      if (data == nullptr)
+      if (mips.empty())
         return color3f(1.0f, 0, 1.0f);
       
       u = clamp(u, 0, 1.0f);
@@ -142,15 +250,85 @@ class imagePNG : public texture {
       if (j >= height)
         j = height - 1;
       
-      auto  pixel = data + j * bytesPerScanline + i * bpp;
+      return texel(0, i, j);
+    }
 
-      return color3f(pixel[0], pixel[1], pixel[2]);
+    virtual color3f value(float u, float v, const vec3f& p, float footprint) const override {
+      if (mips.empty())
+        return color3f(1.0f, 0, 1.0f);
+
+      u = clamp(u, 0, 1.0f);
+      v = 1.0f - clamp(v, 0, 1.0f);
+
+      return trilinearSample<color3f>(u, v, footprint, width, height, mips.size(),
+                                      [this](int l, int i, int j) { return texel(l, i, j); });
     }
-  
+
+    virtual bool resolution(int& w, int& h) const override {
+      w = width;
+      h = height;
+      return !mips.empty();
+    }
+
+    int numLevels() const { return mips.size(); }
+    int bytesPerPixel() const { return bpp; }
+    const std::vector<mipLevel>& levels() const { return mips; }
+
   protected:
-    uint8_t*        data;
-    int             width, height, bpp;
-    int             bytesPerScanline;
+    inline color3f texel(int level, int i, int j) const {
+      const mipLevel& mip = mips[level];
+      auto            pixel = &mip.texels[mip.texelIndex(i, j) * bpp];
+
+      if (bpp >= 3)
+        return color3f(pixel[0], pixel[1], pixel[2]);
+      else
+        return color3f(pixel[0], pixel[0], pixel[0]);
+    }
+
+    // box filter each level down to 1x1, then swizzle into the requested layout
+    void buildMips(const uint8_t* data, textureLayout layout) {
+      mips.clear();
+      mips.push_back({width, height, 0, std::vector<uint8_t>(data, data + width * height * bpp)});
+
+      while (mips.back().width > 1 || mips.back().height > 1) {
+        const mipLevel& src = mips.back();
+        mipLevel        dst;
+
+        dst.width = std::max(1, src.width >> 1);
+        dst.height = std::max(1, src.height >> 1);
+        dst.tilesX = 0;
+        dst.texels.resize(dst.width * dst.height * bpp);
+
+        for (int j = 0; j < dst.height; j++) {
+          int j0 = std::min(2 * j, src.height - 1);
+          int j1 = std::min(2 * j + 1, src.height - 1);
+
+          for (int i = 0; i < dst.width; i++) {
+            int i0 = std::min(2 * i, src.width - 1);
+            int i1 = std::min(2 * i + 1, src.width - 1);
+
+            for (int c = 0; c < bpp; c++) {
+              int sum = src.texels[(j0 * src.width + i0) * bpp + c] +
+                        src.texels[(j0 * src.width + i1) * bpp + c] +
+                        src.texels[(j1 * src.width + i0) * bpp + c] +
+                        src.texels[(j1 * src.width + i1) * bpp + c];
+
+              dst.texels[(j * dst.width + i) * bpp + c] = static_cast<uint8_t>((sum + 2) / 4);
+            }
+          }
+        }
+
+        mips.push_back(std::move(dst));
+      }
+
+      if (layout == textureLayout::tiled)
+        for (auto& mip : mips)
+          mip.tile(bpp);
+    }
+
+  protected:
+    std::vector<mipLevel> mips;
+    int                   width, height, bpp;
 };
 
 #endif
\ No newline at end of file
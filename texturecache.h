@@ -0,0 +1,454 @@
+#ifndef __TEXTURECACHE_H__
+#define __TEXTURECACHE_H__
+
+#include <atomic>
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "texture.h"
+#include "bcn.h"
+
+// load textures through the tile cache instead of decoding them fully
+#define USE_TEXTURE_CACHE     0
+#define TEXTURE_CACHE_MB      256
+
+/******************************************************************************
+ * On-demand texture cache
+ *
+ *  Textures are converted once into a tiled, mip-mapped file (.srtx) next to
+ *  the source image:
+ *
+ *    header      magic "SRTX", version, width, height, bpp, numLevels
+ *    levels      width, height, tilesX, tilesY, file offset of first tile
+ *    tiles       8x8 texels each, row-major tile order per level
+ *
+ *  Lookups fault tiles into a fixed-size cache shared by all threads. The
+ *  cache is split into shards with their own lock and LRU list, and each
+ *  thread keeps a small direct-mapped micro-cache in front of it so most
+ *  lookups never touch a lock.
+ ******************************************************************************/
+
+struct srtxHeader {
+  char      magic[4];
+  uint32_t  version;
+  int32_t   width, height, bpp, numLevels;
+};
+
+struct srtxLevel {
+  int32_t   width, height, tilesX, tilesY;
+  uint64_t  offset;
+};
+
+bool writeTiledTexture(const imagePNG& image, const std::string& filename) {
+  const auto& mips = image.levels();
+  std::string tmpFilename = filename + ".tmp";
+  FILE*       file = fopen(tmpFilename.c_str(), "wb");
+
+  if (!file) {
+    std::cerr << "ERROR: Could not write tiled texture '" << filename << "'\n";
+    return false;
+  }
+
+  srtxHeader  header = {{'S', 'R', 'T', 'X'}, 1, mips[0].width, mips[0].height,
+                        image.bytesPerPixel(), static_cast<int32_t>(mips.size())};
+  uint64_t    offset = sizeof(srtxHeader) + sizeof(srtxLevel) * mips.size();
+
+  fwrite(&header, sizeof(header), 1, file);
+
+  for (const auto& mip : mips) {
+    srtxLevel level = {mip.width, mip.height, mip.tilesX,
+                        (mip.height + tileMask) >> tileShift, offset};
+
+    fwrite(&level, sizeof(level), 1, file);
+    offset += mip.texels.size();
+  }
+
+  for (const auto& mip : mips)
+    fwrite(mip.texels.data(), 1, mip.texels.size(), file);
+
+  bool  ok = !ferror(file);
+  fclose(file);
+
+  return ok && rename(tmpFilename.c_str(), filename.c_str()) == 0;
+}
+
+// convert a source image to .srtx unless an up to date conversion already exists
+std::string convertTexture(const char* filename, int bpp) {
+  std::string tiledFilename = std::string(filename) + ".srtx";
+  struct stat srcStat, dstStat;
+
+  if (stat(tiledFilename.c_str(), &dstStat) == 0 &&
+      (stat(filename, &srcStat) != 0 || dstStat.st_mtime >= srcStat.st_mtime))
+    return tiledFilename;
+
+  imagePNG  image(filename, bpp, textureLayout::tiled);
+
+  if (image.numLevels() == 0 || !writeTiledTexture(image, tiledFilename))
+    return std::string();
+
+  return tiledFilename;
+}
+
+struct textureTile {
+  std::vector<uint8_t>  texels;
+  bool                  complete = true;  // false if the read came up short
+};
+
+struct textureStats {
+  std::string           name;
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> readErrors{0};
+};
+
+class textureCache {
+  public:
+    textureCache(size_t capacityBytes) : capacity(capacityBytes), id(nextId()) {}
+    ~textureCache() {
+      // other threads must be done with the cache by now, drop this thread's references
+      for (auto& entry : threadMicroCache().entries) {
+        if (entry.cacheId == id) {
+          entry.flush();
+          entry = microEntry();
+        }
+      }
+    }
+
+    // returns a tile that stays valid while the calling thread's micro-cache holds it
+    const textureTile*  getTile(int textureId, int fd, const srtxLevel& level,
+                                int levelIndex, int tileX, int tileY,
+                                size_t tileBytes, textureStats& stats);
+
+    size_t  residentBytes() const { return resident.load(); }
+    size_t  peakBytes() const { return peak.load(); }
+    size_t  capacityBytes() const { return capacity; }
+
+    int     registerTexture(const std::string& name) {
+      std::lock_guard<std::mutex> lock(statsMutex);
+      stats.push_back(std::make_unique<textureStats>());
+      stats.back()->name = name;
+      return stats.size() - 1;
+    }
+
+    textureStats& textureStatsFor(int textureId) {
+      std::lock_guard<std::mutex> lock(statsMutex);
+      return *stats[textureId];
+    }
+
+    void    printStats(std::ostream& out);
+
+  private:
+    static const int  numShards = 16;
+    static const int  microSize = 64;
+
+    struct shard {
+      std::mutex                  mutex;
+      std::list<uint64_t>         lru;
+      std::unordered_map<uint64_t, std::pair<shared_ptr<const textureTile>,
+                                              std::list<uint64_t>::iterator>> tiles;
+      size_t                      bytes = 0;
+    };
+
+    struct microEntry {
+      uint64_t                        cacheId = 0;
+      uint64_t                        key = ~0ull;
+      shared_ptr<const textureTile>   tile;
+      textureStats*                   stats = nullptr;
+      uint64_t                        hits = 0;
+
+      void  flush() {
+        if (stats && hits)
+          stats->hits.fetch_add(hits, std::memory_order_relaxed);
+        hits = 0;
+      }
+    };
+
+    struct microCache {
+      microEntry  entries[microSize];
+
+      ~microCache() { flush(); }
+      void flush() {
+        for (auto& entry : entries)
+          entry.flush();
+      }
+    };
+
+    static uint64_t nextId() {
+      static std::atomic<uint64_t> counter{1};
+      return counter++;
+    }
+
+    static microCache& threadMicroCache() {
+      static thread_local microCache cache;
+      return cache;
+    }
+
+    static uint64_t tileKey(int textureId, int level, int tileX, int tileY) {
+      return (static_cast<uint64_t>(textureId) << 44) | (static_cast<uint64_t>(level) << 40) |
+              (static_cast<uint64_t>(tileY) << 20) | static_cast<uint64_t>(tileX);
+    }
+
+    shared_ptr<const textureTile> sharedLookup(uint64_t key, int fd, uint64_t offset,
+                                                size_t tileBytes, textureStats& stats);
+
+  private:
+    size_t                                      capacity;
+    uint64_t                                    id;
+    shard                                       shards[numShards];
+    std::atomic<size_t>                         resident{0};
+    std::atomic<size_t>                         peak{0};
+    std::mutex                                  statsMutex;
+    std::vector<std::unique_ptr<textureStats>>  stats;
+};
+
+const textureTile* textureCache::getTile(int textureId, int fd, const srtxLevel& level,
+                                          int levelIndex, int tileX, int tileY,
+                                          size_t tileBytes, textureStats& stats) {
+  uint64_t    key = tileKey(textureId, levelIndex, tileX, tileY);
+  microEntry& entry = threadMicroCache().entries[(key ^ (key >> 20) ^ (key >> 40)) % microSize];
+
+  if (entry.cacheId == id && entry.key == key) {
+    entry.hits++;
+    return entry.tile.get();
+  }
+
+  uint64_t  offset = level.offset +
+                      (static_cast<uint64_t>(tileY) * level.tilesX + tileX) * tileBytes;
+
+  entry.flush();
+  entry.tile = sharedLookup(key, fd, offset, tileBytes, stats);
+  entry.cacheId = id;
+  entry.key = entry.tile->complete ? key : ~0ull;   // retry incomplete tiles next time
+  entry.stats = &stats;
+
+  return entry.tile.get();
+}
+
+shared_ptr<const textureTile> textureCache::sharedLookup(uint64_t key, int fd, uint64_t offset,
+                                                          size_t tileBytes, textureStats& stats) {
+  shard&  s = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+
+  {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto                        found = s.tiles.find(key);
+
+    if (found != s.tiles.end()) {
+      s.lru.splice(s.lru.begin(), s.lru, found->second.second);
+      stats.hits.fetch_add(1, std::memory_order_relaxed);
+      return found->second.first;
+    }
+  }
+
+  // fault the tile in without holding the shard lock
+  auto  tile = make_shared<textureTile>();
+  tile->texels.resize(tileBytes);
+
+  stats.misses.fetch_add(1, std::memory_order_relaxed);
+
+  // a short read (file truncated or I/O error) is served black but never cached
+  if (pread(fd, tile->texels.data(), tileBytes, offset) != static_cast<ssize_t>(tileBytes)) {
+    if (stats.readErrors.fetch_add(1) == 0)
+      std::cerr << "ERROR: Could not read tile of texture '" << stats.name << "'\n";
+
+    std::fill(tile->texels.begin(), tile->texels.end(), 0);
+    tile->complete = false;
+    return tile;
+  }
+
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto                        found = s.tiles.find(key);
+
+  // another thread faulted the same tile in meanwhile
+  if (found != s.tiles.end())
+    return found->second.first;
+
+  size_t  shardCapacity = std::max(capacity / numShards, tileBytes);
+
+  while (!s.lru.empty() && s.bytes + tileBytes > shardCapacity) {
+    auto    victim = s.tiles.find(s.lru.back());
+    size_t  victimBytes = victim->second.first->texels.size();
+
+    s.lru.pop_back();
+    s.tiles.erase(victim);
+    s.bytes -= victimBytes;
+    resident -= victimBytes;
+  }
+
+  s.lru.push_front(key);
+  s.tiles[key] = std::make_pair(tile, s.lru.begin());
+  s.bytes += tileBytes;
+
+  size_t  now = resident += tileBytes;
+  size_t  prevPeak = peak.load();
+
+  while (now > prevPeak && !peak.compare_exchange_weak(prevPeak, now)) {}
+
+  return tile;
+}
+
+void textureCache::printStats(std::ostream& out) {
+  threadMicroCache().flush();
+
+  std::lock_guard<std::mutex> lock(statsMutex);
+
+  out << "Texture cache: " << capacity / (1024 * 1024) << " MB budget, "
+      << peak.load() / 1024 << " KB peak, " << resident.load() / 1024 << " KB resident\n";
+
+  for (const auto& texStats : stats) {
+    uint64_t  hits = texStats->hits.load();
+    uint64_t  misses = texStats->misses.load();
+
+    out << "  " << texStats->name << ": " << hits << " tile hits, " << misses << " misses ("
+        << (hits + misses ? 100.0 * hits / (hits + misses) : 0) << "% hit rate)\n";
+
+    if (texStats->readErrors.load())
+      out << "    " << texStats->readErrors.load() << " short tile reads\n";
+  }
+}
+
+textureCache& defaultTextureCache() {
+  static textureCache cache(static_cast<size_t>(TEXTURE_CACHE_MB) * 1024 * 1024);
+  return cache;
+}
+
+class cachedImage : public texture {
+  public:
+    cachedImage(const std::string& tiledFilename, textureCache& c) : cache(c), fd(-1) {
+      srtxHeader  header;
+
+      width = height = bpp = 0;
+      fd = open(tiledFilename.c_str(), O_RDONLY);
+
+      if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+          std::string(header.magic, 4) != "SRTX" || header.version != 1 ||
+          !readLevels(header)) {
+        std::cerr << "ERROR: Could not open tiled texture '" << tiledFilename << "'\n";
+        levels.clear();
+        return;
+      }
+
+      width = header.width;
+      height = header.height;
+      bpp = header.bpp;
+      textureId = cache.registerTexture(tiledFilename);
+      stats = &cache.textureStatsFor(textureId);
+    }
+
+    ~cachedImage() {
+      if (fd >= 0)
+        close(fd);
+    }
+
+    virtual color3f value(float u, float v, const vec3f& p) const override {
+      if (levels.empty())
+        return color3f(1.0f, 0, 1.0f);
+
+      u = clamp(u, 0, 1.0f);
+      v = 1.0f - clamp(v, 0, 1.0f);
+
+      auto  i = std::min(static_cast<int>(u * width), width - 1);
+      auto  j = std::min(static_cast<int>(v * height), height - 1);
+
+      return texel(0, i, j);
+    }
+
+    virtual color3f value(float u, float v, const vec3f& p, float footprint) const override {
+      if (levels.empty())
+        return color3f(1.0f, 0, 1.0f);
+
+      u = clamp(u, 0, 1.0f);
+      v = 1.0f - clamp(v, 0, 1.0f);
+
+      return trilinearSample<color3f>(u, v, footprint, width, height, levels.size(),
+                                      [this](int l, int i, int j) { return texel(l, i, j); });
+    }
+
+    virtual bool resolution(int& w, int& h) const override {
+      w = width;
+      h = height;
+      return !levels.empty();
+    }
+
+  private:
+    // reads the level table and checks it against the header and the file size
+    bool readLevels(const srtxHeader& header) {
+      struct stat fileStat;
+
+      if (header.width <= 0 || header.height <= 0 || header.bpp < 1 || header.bpp > 4 ||
+          header.numLevels < 1 || header.numLevels > 32 || fstat(fd, &fileStat) != 0)
+        return false;
+
+      size_t  tableBytes = sizeof(srtxLevel) * header.numLevels;
+
+      levels.resize(header.numLevels);
+      tileBytes = tileSize * tileSize * header.bpp;
+
+      if (pread(fd, levels.data(), tableBytes, sizeof(srtxHeader)) != static_cast<ssize_t>(tableBytes))
+        return false;
+
+      for (const auto& level : levels) {
+        if (level.width <= 0 || level.height <= 0 || level.width > header.width ||
+            level.height > header.height ||
+            level.tilesX != (level.width + tileMask) >> tileShift ||
+            level.tilesY != (level.height + tileMask) >> tileShift ||
+            level.offset + static_cast<uint64_t>(level.tilesX) * level.tilesY * tileBytes >
+            static_cast<uint64_t>(fileStat.st_size))
+          return false;
+      }
+
+      return levels[0].width == header.width && levels[0].height == header.height;
+    }
+
+    inline color3f texel(int level, int i, int j) const {
+      const textureTile*  tile = cache.getTile(textureId, fd, levels[level], level,
+                                                i >> tileShift, j >> tileShift, tileBytes, *stats);
+      auto                pixel = &tile->texels[(((j & tileMask) << tileShift) | (i & tileMask)) * bpp];
+
+      if (bpp >= 3)
+        return color3f(pixel[0], pixel[1], pixel[2]);
+      else
+        return color3f(pixel[0], pixel[0], pixel[0]);
+    }
+
+  private:
+    textureCache&           cache;
+    int                     fd;
+    int                     textureId;
+    textureStats*           stats;
+    int                     width, height, bpp;
+    size_t                  tileBytes;
+    std::vector<srtxLevel>  levels;
+};
+
+// image texture factory used by scene loading
+shared_ptr<texture> loadTexture(const char* filename, int bpp,
+                                textureUsage usage = textureUsage::color) {
+#if USE_TEXTURE_CACHE
+  std::string tiledFilename = convertTexture(filename, bpp);
+
+  if (!tiledFilename.empty())
+    return make_shared<cachedImage>(tiledFilename, defaultTextureCache());
+#endif
+
+#if USE_BLOCK_COMPRESSION
+  if (usage == textureUsage::normal)
+    return make_shared<bcImage>(filename, bcFormat::bc5);
+  else if (usage == textureUsage::scalar || (usage == textureUsage::color && bpp == 1))
+    return make_shared<bcImage>(filename, bcFormat::bc4);
+  else if (usage == textureUsage::color)
+    return make_shared<bcImage>(filename, bcFormat::bc1);
+#endif
+
+  return make_shared<imagePNG>(filename, bpp);
+}
+
+#endif
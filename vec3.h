@@ -59,18 +59,19 @@ inline vec3f unitVector(const vec3f &v) {
     return v;
 }
 
-inline vec3f randomInUnitSphere() {
-  while (true) {
-    auto  p = vec3f(randomVec3f(-1.0f, 1.0f));
-    if (lengthSquared(p) >= 1.0f)
-      continue;
-    
-    return p;
-  }
+// the warps below draw a fixed number of random numbers, see sampler.h
+inline vec3f randomUnitVector() {
+  float z = 1.0f - 2.0f * randomFloat();
+  float r = sqrtf(fmaxf(1.0f - z * z, 0));
+  float phi = 2.0f * pi * randomFloat();
+
+  return vec3f(r * cosf(phi), r * sinf(phi), z);
 }
 
-inline vec3f randomUnitVector() {
-  return unitVector(randomInUnitSphere());
+inline vec3f randomInUnitSphere() {
+  vec3f dir = randomUnitVector();
+
+  return cbrtf(randomFloat()) * dir;
 }
 
 inline vec3f reflect(const vec3f& v, const vec3f& n) {
@@ -85,13 +86,40 @@ inline vec3f refract(const vec3f& uv, const vec3f& n, float etaIOverEtaiT) {
   return rOutPerp + rOutParallel;
 }
 
+// concentric mapping of the square (Shirley and Chiu 1997), keeps stratification
 inline vec3f randomInUnitDisk() {
-  while(true) {
-    auto  p = vec3f(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f), 0);
-    if (lengthSquared(p) >= 1.0f)
-      continue;
-    return p;
-  }
+  float a = randomFloat(-1.0f, 1.0f);
+  float b = randomFloat(-1.0f, 1.0f);
+
+  if (a == 0 && b == 0)
+    return vec3f(0, 0, 0);
+
+  if (fabsf(a) > fabsf(b))
+    return vec3f(a * cosf(0.25f * pi * b / a), a * sinf(0.25f * pi * b / a), 0);
+
+  return vec3f(b * sinf(0.25f * pi * a / b), b * cosf(0.25f * pi * a / b), 0);
+}
+
+// orthonormal basis around a unit normal (Duff et al. 2017)
+inline void buildBasis(const vec3f& n, vec3f& tangent, vec3f& bitangent) {
+  float sign = copysignf(1.0f, n(2));
+  float a = -1.0f / (sign + n(2));
+  float b = n(0) * n(1) * a;
+
+  tangent = vec3f(1.0f + sign * n(0) * n(0) * a, sign * b, -sign * n(0));
+  bitangent = vec3f(b, sign + n(1) * n(1) * a, -n(1));
+}
+
+// local space direction around +z with pdf cos(theta) / pi
+inline vec3f cosineSampleHemisphere(float u1, float u2) {
+  float r = sqrtf(u1);
+  float phi = 2.0f * pi * u2;
+
+  return vec3f(r * cosf(phi), r * sinf(phi), sqrtf(fmaxf(1.0f - u1, 0)));
+}
+
+inline float luminance(const color3f& c) {
+  return 0.2126f * c(0) + 0.7152f * c(1) + 0.0722f * c(2);
 }
 
 inline vec3f lerp(const vec3f& a, const vec3f& b, float t) {